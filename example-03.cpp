@@ -1,286 +1,7480 @@
 #include <pthread.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cassert>
+#include <climits>
+#include <cmath>
 #include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <cerrno>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <deque>
 #include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/thread.hpp>
 #include <boost/threadpool.hpp>
 
-/* 
- * The class emulates task, which is running during long term of time.
- * Its job is:
- * 1. open text file
- * 2. read file line by line
- * 3. count the frequency of occurency of each word
- * 
- * The job is performed by method operator()(), invoked
- * in scope of separate thread from the pool of threads.
- * */
-class Task final {
 
+static std::uint64_t hash_bytes(const char* data, std::size_t size, std::uint64_t seed = 0);
+static double seconds_since(const struct timespec& start);
+// lowercases letters and replaces punctuation by spaces in place, the size 
+// is kept. ASCII is handled by SIMD (if simd is set), the 2-byte UTF-8 
+// letters of Latin-1, Greek and Cyrillic are folded by a scalar pass.
+static void normalize_text(char* data, std::size_t size, bool simd = true);
+
+/*
+ * Counters of the words of a task. They are 32-bit, which is enough for
+ * almost all the words, the count of a word, which would overflow its 
+ * counter, is carried to the side table of 64-bit counters. So only the 
+ * most frequent words of huge corpora take the wide counters, the count
+ * of a word is the sum of both.
+ * */
+class WordCounters final {
 public:
-	explicit Task(const char* fname);
-	~Task();
-	
-	void operator()();
-	
-	// unsafe acccess to internal variables.
-	// not serious mistake in given context, 
-	// because they are used just for logging of task's state
+	typedef std::map<std::string, std::uint32_t> Narrow;
+	typedef std::map<std::string, std::uint64_t> Wide;
 	
-	pthread_t tid() const { return _tid; }
+	static const std::uint32_t MAX_NARROW = 0xffffffffU;
 	
-	double elapsed_time() const {
-		clock_t t = clock();
-		return static_cast<double>(t - _start) / CLOCKS_PER_SEC;
+	void add(const std::string& w, std::uint64_t n = 1) {
+		std::uint32_t& c = _narrow[w];
+		if (n <= MAX_NARROW - c) {
+			c += static_cast<std::uint32_t>(n);
+			return;
+		}
+		_wide[w] += c + n;
+		c = 0;
 	}
 	
-	std::size_t line_count() const { return _line_count; }
+	// the narrow counters may be 0, if they are carried to the wide ones
+	Narrow& narrow() { return _narrow; }
+	const Narrow& narrow() const { return _narrow; }
+	const Wide& wide() const { return _wide; }
+	
+	std::size_t size() const { return _narrow.size(); }
+	bool empty() const { return _narrow.empty() && _wide.empty(); }
+	void clear() { _narrow.clear(); _wide.clear(); }
+	void swap(WordCounters& other) { _narrow.swap(other._narrow); _wide.swap(other._wide); }
 	
 private:
-	const char* _fname;
-	pthread_t _tid;
-	clock_t _start;
-	std::size_t _line_count;	
-	std::map<std::string, std::uint32_t> _word_counters;
+	Narrow _narrow;
+	Wide _wide;
 };
 
-
-class TasksRegistry {
-	TasksRegistry(const TasksRegistry&) = delete;
-	const TasksRegistry& operator=(const TasksRegistry&) = delete;
-	
+/*
+ * Small open addressing table of (word, n) pairs, sized to stay
+ * resident in L1 cache. Natural text repeats a few words very often,
+ * so most tokens are combined here and the main counters table is
+ * touched once per distinct word per flush instead of once per token.
+ * */
+class PreAggregator final {
 public:
-	explicit TasksRegistry(const Task* task);
-	~TasksRegistry();
-	
-	static std::list<const Task*> GetRunningTasks();
-		
-private:
-	static std::map<pthread_t, const Task*> _tasks;
-	static boost::mutex _mutex;
-};
+	static const std::size_t SLOTS_NUM = 512;
+	// flush when the table is filled by 3/4, to keep probe sequences short
+	static const std::size_t MAX_LOAD = SLOTS_NUM / 4 * 3;
+	// the hottest words since previous flush stay in the table and keep
+	// accumulating, other ones are written to the counters table
+	static const std::size_t HOT_SLOTS_NUM = SLOTS_NUM / 8;
 
+	PreAggregator();
 
-////////////////////////////////////////////////////////////////////////
-// 
+	void add(const std::string& w, WordCounters& counters);
+	void flush(WordCounters& counters);
 
-static sigset_t sig_set;
+	std::uint64_t tokens() const { return _tokens; }
+	std::uint64_t table_ops() const { return _table_ops; }
+	std::size_t memory_usage() const;
 
-static std::atomic<int> sig_num{ 0 }; // number of the latest received signal
-static std::atomic<bool> running{ true };
+private:
+	struct Slot {
+		std::string key;
+		std::uint32_t n;
+		std::uint32_t hits; // since previous flush
+	};
 
-static void* sig_handle_worker_routine(void* arg) {
-	int sig_num = 0;
-	bool emergency = false;
-	while (::running.load()) {
-		if (sigwait(&::sig_set, &sig_num) < 0) {
-			perror("sigwait()");
-			emergency = true;
-		} else {
-			::sig_num.store(sig_num);
-			std::cout << "received signal: " << sig_num << std::endl;
-		}
-		
-		if (emergency || 
-			sig_num == SIGINT || sig_num == SIGABRT || sig_num == SIGTERM) {
-			std::cout << "cancel running tasks (if any)\n";
-			// cancel tasks which are running
-			std::list<const Task*> tasks = TasksRegistry::GetRunningTasks();
-			for (const Task* task : tasks) {
-				if (pthread_cancel(task->tid()) != 0) {
-					perror("pthread_cancel()");
-					std::cerr << "canceliing of task TID " 
-						<< task->tid() << " failed\n";
-				}
-			}
-			break;
-		}
-	}
-	/*
-	::running = 0;
-	* */
-	::running.store(false);
-	return NULL;
-}
+	void evict(WordCounters& counters);
+	void insert(Slot& slot);
 
-int main(int argc, char** argv) {
+	std::vector<Slot> _slots;
+	std::size_t _used;
+	std::uint64_t _tokens;
+	std::uint64_t _table_ops;
+};
+
+/*
+ * Read-only result table, built once the counting is finished.
+ * The words are stored one after another in a single blob and the
+ * table is an array of (offset, length, count) sorted by word, so
+ * there are no pointers inside and both arrays could be written to
+ * a file and mapped back as is. Optionally a minimal perfect hash
+ * (hash and displace) gives O(1) lookups instead of binary search.
+ * */
+class FrozenTable final {
+	friend class SpillFiles;
 	
-	if (argc != 2) {
-		std::cout << "usage: " << argv[0] << " <file-to-process>\n";
-		std::exit(-1);
-	}
+public:
+	struct Entry {
+		std::uint32_t offset;
+		std::uint32_t length;
+		std::uint32_t count; // WIDE_COUNT if it's in the wide counts
+	};
 	
-	if (sigemptyset(&::sig_set) < 0) {
-		perror("sigemptyset()");
-		std::exit(-1);
-	}
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+	static const std::uint32_t WIDE_COUNT = 0xffffffffU;
 	
-	// fill the signal's mask and block signals, which we are going to handle
-	std::array<int, 7> sig_nums{ SIGINT, SIGTERM, SIGILL, 
-								SIGFPE, SIGBUS, SIGTRAP, SIGABRT };
-	for (std::size_t i = 0; i < sig_nums.size(); i++) {
-		if (sigaddset(&::sig_set, sig_nums[i]) < 0) {
-			perror("sigaddset()");
-			std::cerr << "couldn't add signal " << sig_nums[i] << " to mask\n";
-			std::exit(-1);
-		}
-	}
+	typedef std::pair<const std::string, std::uint64_t> Counter;
 	
-	sigset_t original_sig_set;	
-	if (sigprocmask(SIG_BLOCK, &sig_set, &original_sig_set) != 0) {
-		perror("sigprocmask()");
-		std::cerr << "couldn't block signals\n";
-		std::exit(-1);
-	}
-		
-	// start thread, responsible for receiving and handling of signals
-	pthread_t sig_handle_worker;
-	if (pthread_create(&sig_handle_worker, NULL, sig_handle_worker_routine, NULL) != 0) {
-		perror("pthread_create()");
-		std::cerr << "couldn't create thread to handle signals\n";
-		std::exit(-1);
+	static FrozenTable Freeze(const WordCounters& counters);
+	// the counters are sorted by word, the words are unique
+	static FrozenTable Freeze(const std::vector<const Counter*>& counters);
+	static FrozenTable Merge(const std::vector<const FrozenTable*>& tables);
+	
+	// returns false if hash couldn't be built, lookups use binary search then
+	bool build_perfect_hash();
+	bool has_perfect_hash() const { return !_mph_slots.empty(); }
+	
+	std::size_t size() const { return _entries.size(); }
+	const char* word(std::size_t i) const { return _blob.data() + _entries[i].offset; }
+	std::size_t word_length(std::size_t i) const { return _entries[i].length; }
+	std::string word_str(std::size_t i) const { return std::string(word(i), word_length(i)); }
+	std::uint64_t count(std::size_t i) const {
+		std::uint32_t c = _entries[i].count;
+		return (c != WIDE_COUNT) ? c : wide_count(i);
 	}
+	// number of counts, which don't fit into 32 bits
+	std::size_t wide_counts() const { return _wide_counts.size(); }
+	
+	// index of the word or npos
+	std::size_t find(const char* w, std::size_t len) const;
+	std::size_t find(const std::string& w) const { return find(w.data(), w.size()); }
+	// index of the first word which is not less than given one
+	std::size_t lower_bound(const char* w, std::size_t len) const;
+	
+	std::uint64_t words_total() const;
+	std::size_t memory_usage() const;
+	
+	// stores the table for FrozenTableFile, returns size of the file or 0 on failure
+	std::uint64_t write(const char* path) const;
 	
+private:
+	void append(const char* w, std::size_t len, std::uint64_t count);
+	int compare(std::size_t i, const char* w, std::size_t len) const;
+	std::uint64_t wide_count(std::size_t i) const;
+	
+	std::string _blob;
+	std::vector<Entry> _entries;
+	// (entry index, count), sorted by index
+	std::vector<std::pair<std::uint32_t, std::uint64_t>> _wide_counts;
+	// minimal perfect hash: displacement per bucket and slot -> entry index
+	std::vector<std::uint32_t> _mph_seeds;
+	std::vector<std::uint32_t> _mph_slots;
+};
 
-	const char* fname = argv[1];
+/*
+ * Read-only view of the result table, stored by FrozenTable::write() and 
+ * mapped into memory, so it's used without parsing. The file is:
+ *   header, offsets of words (u32, one more than words), string blob,
+ *   counts bit-packed by the width of the max count, perfect hash
+ *   (u32 seeds, then u32 slots), if the table has it.
+ * The sections start at 8 bytes boundaries and are followed by 8 bytes of
+ * padding, so a count is read by one unaligned 64-bit load. The header
+ * has checksums of itself and of the sections, open() checks the header 
+ * and the bounds of sections only, verify() checks the sections' data.
+ * */
+class FrozenTableFile final {
+	FrozenTableFile(const FrozenTableFile&) = delete;
+	const FrozenTableFile& operator=(const FrozenTableFile&) = delete;
 	
-	unsigned int num_of_threads = std::thread::hardware_concurrency();
-	std::cout << "able to run " << num_of_threads << " concurrent threads\n";
+public:
+	struct Header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t words_num;
+		std::uint64_t words_total;
+		std::uint32_t count_bits;
+		std::uint32_t mph_seeds_num; // 0 if there is no perfect hash
+		// offsets of the sections from the beginning of the file
+		std::uint64_t offsets_offset;
+		std::uint64_t blob_offset;
+		std::uint64_t counts_offset;
+		std::uint64_t mph_offset;
+		std::uint64_t file_size;
+		std::uint64_t data_checksum; // of the file after the header
+		std::uint64_t header_checksum; // of the header before this field
+	};
 	
-	boost::threadpool::pool tp(num_of_threads);	
+	static const char MAGIC[4];
+	static const std::uint32_t VERSION = 1;
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+	
+	FrozenTableFile();
+	~FrozenTableFile();
+	
+	bool open(const char* path);
+	// checksum of the sections, it reads the whole file
+	bool verify() const;
+	
+	std::size_t size() const { return _header->words_num; }
+	std::uint64_t words_total() const { return _header->words_total; }
+	bool has_perfect_hash() const { return _header->mph_seeds_num != 0; }
+	std::size_t file_size() const { return _size; }
+	
+	// access to the entries, sorted by word
+	const char* word(std::size_t i) const { return _blob + _offsets[i]; }
+	std::size_t word_length(std::size_t i) const { return _offsets[i + 1] - _offsets[i]; }
+	std::string word_str(std::size_t i) const { return std::string(word(i), word_length(i)); }
+	std::uint64_t count(std::size_t i) const {
+		std::uint64_t bit_pos = i * _header->count_bits;
+		std::uint64_t v;
+		std::memcpy(&v, _counts + bit_pos / 8, sizeof(v));
+		v >>= bit_pos % 8;
+		// the widest counts may take one byte more
+		if (bit_pos % 8 + _header->count_bits > 64)
+			v |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(_counts[bit_pos / 8 + 8])) << (64 - bit_pos % 8);
+		return v & _count_mask;
+	}
+	
+	// index of the word or npos
+	std::size_t find(const char* w, std::size_t len) const;
+	std::size_t find(const std::string& w) const { return find(w.data(), w.size()); }
+	
+private:
+	int compare(std::size_t i, const char* w, std::size_t len) const;
+	void close();
+	
+	void* _data;
+	std::size_t _size;
+	const Header* _header;
+	const std::uint32_t* _offsets;
+	const char* _blob;
+	const char* _counts;
+	std::uint64_t _count_mask;
+	const std::uint32_t* _mph_seeds;
+	const std::uint32_t* _mph_slots;
+};
 
-	Task task1(fname);
-	Task task2(fname);
-	Task task3(fname);
-	Task task4(fname);
+/*
+ * Ordered key store for prefix and range queries over the result table.
+ * Burst trie (as HAT-trie): the upper levels are trie nodes with array 
+ * of 256 children, the lower ones are containers, keeping suffixes of 
+ * the words in sorted contiguous array. A container grows untill its 
+ * size exceeds the threshold, then it bursts into a node with new 
+ * containers. So the most of search is the scan of a few cache lines.
+ * */
+class BurstTrie final {
+public:
+	// word and its count, returns false to stop the iteration
+	typedef std::function<bool (const std::string&, std::uint32_t)> Visitor;
 	
-	tp.schedule(task1);
-	tp.schedule(task2);
-	tp.schedule(task3);
-	tp.schedule(task4);	
+	static const std::size_t BURST_THRESHOLD = 4096;
+	
+	BurstTrie();
+	
+	void insert(const char* w, std::size_t len, std::uint32_t count);
+	bool find(const char* w, std::size_t len, std::uint32_t& count) const;
+	
+	// words, starting with the prefix, in order
+	void for_each_prefix(const char* prefix, std::size_t len, const Visitor& visitor) const;
+	// words in range [lo, hi), in order
+	void for_each_range(const std::string& lo, const std::string& hi, const Visitor& visitor) const;
+	
+	std::size_t size() const { return _size; }
+	std::size_t memory_usage() const;
+	
+private:
+	// child reference: 0 - none, > 0 - node index + 1, < 0 - -(container index + 1)
+	struct Node {
+		std::int32_t children[256];
+		std::uint32_t count;
+		bool has_value;
+	};
+	// container entries: u8 length of suffix, suffix, u32 count
+	typedef std::string Container;
+	
+	static std::int32_t NodeRef(std::size_t i) { return static_cast<std::int32_t>(i + 1); }
+	static std::int32_t ContainerRef(std::size_t i) { return -static_cast<std::int32_t>(i + 1); }
+	
+	std::size_t new_node();
+	void insert_into(Container& c, const char* suffix, std::size_t len, std::uint32_t count);
+	void burst(std::size_t node, unsigned char c);
+	// walks subtree in order, the path is the prefix of all its words
+	bool visit_node(std::size_t node, std::string& path, const std::string* lo, 
+		const std::string* hi, const Visitor& visitor) const;
+	bool visit_container(const Container& c, std::string& path, const char* filter, std::size_t filter_len,
+		const std::string* lo, const std::string* hi, const Visitor& visitor) const;
+	
+	std::vector<Node> _nodes;
+	std::vector<Container> _containers;
+	std::size_t _size;
+};
 
-	std::cout << " PID = " << getpid() 
-		<< " main thread TID " << pthread_self() << std::endl;
-		
-	// printing the status of tasks to console
-	while (1) {
-		// wait little bit:
-		// initially, untill tasks will be scheduled
-		// and then - for some delay between outputs
-		sleep(4);		
-		std::list<const Task*> tasks = TasksRegistry::GetRunningTasks();
-		if (tasks.empty())
-			break;
-		std::cout << "\n ---- state:\n";
-		for (const Task* task : tasks) {
-			std::cout << " task " << reinterpret_cast<const void*>(task);			
-			std::cout << " task TID " << task->tid() 
-				<< " processed lines " << task->line_count()
-				<< " elapsed seconds " << task->elapsed_time()
-				<< std::endl;
-		}
-		std::cout << std::endl;
-	}
+/*
+ * Serves lookups into the result table for other processes, over 
+ * Unix domain socket. Single thread, epoll based loop.
+ * 
+ * Binary protocol, integers are in host byte order (the socket is local).
+ * Request:  u32 body length, body is a batch of queries, each one is
+ *           u8 op, u16 length, length bytes of argument
+ *             OP_COUNT   argument is the word
+ *             OP_TOP     argument is u32 k
+ *             OP_PREFIX  argument is u32 limit followed by prefix
+ * Response: u32 body length, body has one answer per query
+ *             OP_COUNT   u64 count
+ *             OP_TOP, OP_PREFIX  u32 n, then n times: u16 length, word, u64 count
+ * */
+class QueryServer final {
+	QueryServer(const QueryServer&) = delete;
+	const QueryServer& operator=(const QueryServer&) = delete;
 	
-	std::cout << "awaiting untill work tasks finished...\n";
-	tp.wait();
+public:
+	enum Op : std::uint8_t {
+		OP_COUNT = 1,
+		OP_TOP = 2,
+		OP_PREFIX = 3
+	};
+	
+	static const std::size_t MAX_REQUEST_SIZE = 1 << 20;
+	
+	// prefix queries are ranges of the sorted table
+	explicit QueryServer(const FrozenTable& table);
+	~QueryServer();
+	
+	bool listen(const char* path);
+	// serves requests untill the flag is dropped
+	void run(const std::atomic<bool>& running);
+	
+private:
+	struct Connection {
+		std::string in;
+		std::string out;
+		std::size_t out_pos = 0;
+	};
+	
+	bool on_readable(int fd, Connection& conn);
+	bool on_writable(int fd, Connection& conn);
+	bool process_requests(Connection& conn);
+	bool execute(std::uint8_t op, const char* arg, std::size_t len, std::string& out);
+	void append_word(const char* w, std::size_t len, std::uint64_t count, std::string& out);
+	void close_connection(int fd);
+	
+	const FrozenTable& _table;
+	std::vector<std::uint32_t> _by_count; // entries indices, for top-K
+	std::string _path;
+	int _listen_fd;
+	int _epoll_fd;
+	std::map<int, Connection> _connections;
+};
 
-	if (::running.load()) {
-		// signals handler thread still working
-		if (pthread_kill(sig_handle_worker, SIGTERM) != 0) {
-			perror("pthread_kill()");
-			std::cerr << "couldn't send signal to terminate thread\n";
-		}
-	}
+/*
+ * Writes the result table sorted by count (descending), then by word. 
+ * The parts of entries are sorted on the pool by LSD radix sort of counts,
+ * stable, so the words of equal count keep their order of the table. Then
+ * the sorted parts are merged by pairs, in parallel too. The order is total,
+ * so the output doesn't depend on the number of parts or threads. The sorted
+ * entries are formatted by batches: each part of the batch into its own 
+ * buffer on the pool, the buffers are written at once by writev().
+ * 
+ * Binary format: "WCR1", u32 0, u64 entries, u64 number of words, then 
+ * entries: u64 count, u32 length, word (little endian).
+ * */
+class ResultWriter final {
+public:
+	enum Format {
+		TEXT, // word count
+		CSV, // word,count with header, the words are quoted if needed
+		BINARY
+	};
 	
-	if (pthread_join(sig_handle_worker, NULL) != 0) {
-		perror("pthread_join()");
-		std::cerr << "couldn't join signals handler thread\n";
-	}
-	std::cout << "done\n";
+	static const std::size_t BATCH_SIZE = 1 << 20; // entries formatted at once
 	
-	// restore original signals mask
-	if (sigprocmask(SIG_SETMASK, &original_sig_set, NULL) != 0) {
-		perror("sigprocmask()");
-		std::cerr << "couldn't restore signals mask\n";
-		std::exit(-1);
+	ResultWriter(const FrozenTable& table, boost::threadpool::pool& tp, std::size_t parts);
+	
+	// returns false if the name is unknown
+	static bool ParseFormat(const char* name, Format& format);
+	
+	void sort();
+	bool write(const char* fname, Format format);
+	
+	// indices of the table's entries, valid after sort()
+	const std::vector<std::uint32_t>& order() const { return _order; }
+	std::uint64_t bytes() const { return _bytes; }
+	double sort_time() const { return _sort_time; }
+	double write_time() const { return _write_time; }
+	
+private:
+	// count descending, then index of the table
+	bool less(std::uint32_t a, std::uint32_t b) const {
+		std::uint64_t ca = _table.count(a), cb = _table.count(b);
+		return ca > cb || (ca == cb && a < b);
 	}
+	void radix_sort(std::uint32_t* data, std::uint32_t* tmp, std::size_t size) const;
+	void format(std::size_t begin, std::size_t end, Format format, std::string& out) const;
 	
-	return 0;
-}
+	const FrozenTable& _table;
+	boost::threadpool::pool& _tp;
+	std::size_t _parts;
+	std::vector<std::uint32_t> _order;
+	std::uint64_t _bytes;
+	double _sort_time;
+	double _write_time;
+};
 
+static int run_query_load(const char* path, std::size_t requests_num, std::size_t batch_size);
+static int run_text_benchmark(char* const* files, std::size_t files_num);
+// loads the stored table, verifies it and answers the queries
+static int run_table_file(const char* path, const std::vector<std::string>& queries);
+// fills the trie from the table, reports how it compares to std::map
+static void compare_key_stores(const FrozenTable& table, BurstTrie& trie);
 
-////////////////////////////////////////////////////////////////////////
-// Task implementation
-Task::Task(const char* fname) 
-	: _fname(fname) 
-	{
-	}
+/*
+ * Key of n-gram: dense ids of its words, packed into 64 or 96 bits.
+ * */
+template <std::size_t N>
+struct NgramKey {
+	std::uint32_t ids[N];
 	
-Task::~Task()
-{
+	bool operator==(const NgramKey& other) const {
+		return std::memcmp(ids, other.ids, sizeof(ids)) == 0;
+	}
+};
+
+template <std::size_t N>
+inline std::uint64_t hash_key(const NgramKey<N>& key) {
+	return hash_bytes(reinterpret_cast<const char*>(key.ids), sizeof(key.ids));
 }
 
-void Task::operator()()
-{
-	TasksRegistry registry_entry(this);
+/*
+ * Open addressing table of counters with integer keys, linear probing.
+ * Slot is just key and count, zero count marks an empty slot.
+ * */
+template <typename Key>
+class IntCounterTable final {
+public:
+	struct Slot {
+		Key key;
+		std::uint32_t count;
+	};
 	
-	_tid = pthread_self();
-	assert(_fname != NULL);	
-	std::ifstream in_file(_fname);
+	IntCounterTable() : _slots(INITIAL_CAPACITY), _size(0) {}
 	
-	if (!in_file) {
-		std::cerr << "couldn't open file " << _fname
-			<< " premature finishing of task, TID = " << _tid << std::endl;
-		return;
+	void add(const Key& key, std::uint32_t n = 1) {
+		Slot& slot = find_slot(key);
+		if (slot.count == 0) {
+			slot.key = key;
+			_size++;
+		}
+		slot.count += n;
+		if (_size * 10 >= _slots.size() * 7)
+			grow();
 	}
-		
-	std::function<void (const std::string&)> count_word = [this](const std::string& w) {
-		std::uint32_t n = _word_counters[w];
-		_word_counters[w] = n + 1;
-	};
 	
-	std::function<void (const std::string&)> split_line_and_count_words =
-			[this, &count_word](const std::string& line) {
-				std::stringstream ss(line);
-				std::string word;
-				while (std::getline(ss, word, ' ')) {
-					count_word(word);
-				}				
-			};
+	std::uint32_t get(const Key& key) const {
+		const Slot& slot = const_cast<IntCounterTable*>(this)->find_slot(key);
+		return slot.count;
+	}
 	
-	_line_count = 0;
-	_start = clock();
+	// removes the counters which are not greater than the threshold
+	std::size_t prune(std::uint32_t threshold) {
+		std::vector<Slot> slots(_slots.size());
+		slots.swap(_slots);
+		std::size_t removed = _size;
+		_size = 0;
+		for (const Slot& slot : slots) {
+			if (slot.count > threshold) {
+				find_slot(slot.key) = slot;
+				_size++;
+			}
+		}
+		return removed - _size;
+	}
 	
-	std::string line;
-	while (!in_file.eof()) {
-		if (!std::getline(in_file, line) || line.empty())
-			continue;
-		_line_count++;
-		split_line_and_count_words(line);
+	const std::vector<Slot>& slots() const { return _slots; }
+	std::size_t size() const { return _size; }
+	std::size_t memory_usage() const { return _slots.size() * sizeof(Slot); }
+	
+private:
+	static const std::size_t INITIAL_CAPACITY = 1024;
+	
+	Slot& find_slot(const Key& key) {
+		std::size_t mask = _slots.size() - 1;
+		std::size_t i = hash_key(key) & mask;
+		while (_slots[i].count != 0 && !(_slots[i].key == key))
+			i = (i + 1) & mask;
+		return _slots[i];
+	}
+	
+	void grow() {
+		std::vector<Slot> slots(_slots.size() * 2);
+		slots.swap(_slots);
+		for (const Slot& slot : slots) {
+			if (slot.count != 0)
+				find_slot(slot.key) = slot;
+		}
 	}
+	
+	std::vector<Slot> _slots;
+	std::size_t _size;
+};
 
-	std::uint32_t words_total = 0;
-	for (const std::pair<std::string, std::uint32_t>& p : _word_counters) {
-		words_total += p.second;
-	}	
+/*
+ * Maps words to dense 32-bit ids, in order of their first occurrence.
+ * */
+class Vocabulary final {
+public:
+	std::uint32_t id(const std::string& w);
+	std::size_t size() const { return _ids.size(); }
+	// for each id - index of the word in the table
+	std::vector<std::uint32_t> translate(const FrozenTable& table) const;
+	std::size_t memory_usage() const;
+	
+private:
+	std::unordered_map<std::string, std::uint32_t> _ids;
+};
+
+/*
+ * Counts n-grams (n is 2 or 3) of consecutive words. N-gram is counted 
+ * as packed integer key of its words ids, without building of 
+ * concatenated strings. The ids are local for the task, merge() 
+ * translates them to indices of words in the result table.
+ * */
+class NgramCounter final {
+public:
+	explicit NgramCounter(std::size_t n = 0);
+	
+	std::size_t n() const { return _n; }
+	
+	void add(std::uint32_t id);
+	// ids maps other's ids to ids of this counter
+	void merge(const NgramCounter& other, const std::vector<std::uint32_t>& ids);
+	
+	std::uint64_t ngrams() const { return _ngrams; }
+	std::size_t distinct() const { return _n == 2 ? _bigrams.size() : _trigrams.size(); }
+	std::size_t memory_usage() const { return _bigrams.memory_usage() + _trigrams.memory_usage(); }
+	
+	// prints the most frequent n-grams, ids must be indices in the table
+	void print_top(std::size_t k, const FrozenTable& table) const;
+	
+private:
+	std::size_t _n;
+	std::uint32_t _window[3]; // ids of the latest words
+	std::size_t _filled;
+	std::uint64_t _ngrams;
+	IntCounterTable<NgramKey<2>> _bigrams;
+	IntCounterTable<NgramKey<3>> _trigrams;
+};
+
+/*
+ * Sparse co-occurrence matrix: counts pairs of distinct words, which occur
+ * within a window of k consecutive words. The pair key is (id_a, id_b), 
+ * id_a < id_b. The memory is bounded by the number of pairs: when it's 
+ * exceeded, the cutoff is chosen by the current counts so that about a 
+ * quarter of the limit becomes free, and the pairs which are not more 
+ * frequent than the cutoff are pruned in a single rebuild. The cutoff isn't 
+ * kept for later pairs, so a pair that becomes frequent later isn't lost, 
+ * but the kept counts may be underestimated by the pruned occurrences.
+ * */
+class CooccurrenceCounter final {
+public:
+	CooccurrenceCounter(std::size_t window = 0, std::size_t max_pairs = 0);
+	
+	std::size_t window() const { return _window; }
+	
+	void add(std::uint32_t id);
+	// ids maps other's ids to ids of this counter
+	void merge(const CooccurrenceCounter& other, const std::vector<std::uint32_t>& ids);
+	
+	std::uint64_t pairs() const { return _pairs; }
+	std::size_t distinct() const { return _matrix.size(); }
+	std::uint64_t pruned() const { return _pruned; }
+	// the highest cutoff of the prunings
+	std::uint32_t threshold() const { return _threshold; }
+	std::size_t memory_usage() const { return _matrix.memory_usage() + _recent.capacity() * sizeof(std::uint32_t); }
+	
+	// prints the most frequent pairs, ids must be indices in the table
+	void print_top(std::size_t k, const FrozenTable& table) const;
+	
+private:
+	void add_pair(std::uint32_t a, std::uint32_t b, std::uint32_t n);
+	void prune();
+	
+	std::size_t _window;
+	std::size_t _max_pairs;
+	std::vector<std::uint32_t> _recent; // ring buffer of k - 1 latest ids
+	std::size_t _recent_pos;
+	std::size_t _recent_filled;
+	std::uint64_t _pairs;
+	std::uint64_t _pruned;
+	std::uint32_t _threshold;
+	IntCounterTable<NgramKey<2>> _matrix;
+};
+
+/*
+ * Inverted index: word -> numbers of lines (1-based), where it occurs.
+ * While counting, the postings of each word (by its vocabulary id) are 
+ * kept as varint encoded deltas. Write() merges the parts of all tasks
+ * and stores the index into a file, which is used by mmap without parsing:
+ *   header, entries sorted by word, string blob, postings.
+ * Postings are deltas, packed by blocks of 128 with per block bit width.
+ * Inside of block the value i is placed in lane i % 4 (as SIMD-BP128
+ * does), so the block could be unpacked by 4-wide SIMD shifts and masks.
+ * The rest of the list, which doesn't fill a block, is varint encoded.
+ * */
+class InvertedIndex final {
+public:
+	struct Header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t words_num;
+		std::uint64_t lines_num;
+		std::uint64_t blob_size;
+		std::uint64_t postings_size;
+	};
+	struct Entry {
+		std::uint32_t offset; // of the word in blob
+		std::uint32_t length;
+		std::uint64_t postings_offset;
+		std::uint32_t postings_num;
+		std::uint32_t reserved;
+	};
+	
+	static const char MAGIC[4];
+	static const std::uint32_t VERSION = 1;
+	static const std::size_t BLOCK_SIZE = 128;
+	
+	// line number is 1-based, counted from beginning of the task's range
+	void add(std::uint32_t id, std::uint32_t line);
+	std::uint64_t postings() const { return _postings; }
+	std::size_t memory_usage() const;
+	
+	// parts[i] is index of i-th task, ids[i] maps its ids to indices in the table,
+	// line_bases[i] is the number of lines before the task's range.
+	// returns size of the file or 0 on failure
+	static std::uint64_t Write(const char* path, const FrozenTable& table, 
+		const std::vector<const InvertedIndex*>& parts,
+		const std::vector<std::vector<std::uint32_t>>& ids,
+		const std::vector<std::uint32_t>& line_bases);
+	
+	// header's sizes are filled and the blob is padded here
+	static std::uint64_t WriteFile(const char* path, Header& header, const std::vector<Entry>& entries,
+		std::string& blob, const std::string& postings);
+	static void EncodePostings(const std::vector<std::uint32_t>& lines, std::string& out);
+	static void DecodePostings(const char* data, std::uint32_t n, std::vector<std::uint32_t>& lines);
+	
+private:
+	struct List {
+		std::uint32_t last = 0;
+		std::string deltas;
+	};
+	
+	std::vector<List> _lists; // by id
+	std::uint64_t _postings = 0;
+};
+
+/*
+ * Read-only view of the inverted index file, mapped into memory.
+ * */
+class InvertedIndexFile final {
+	InvertedIndexFile(const InvertedIndexFile&) = delete;
+	const InvertedIndexFile& operator=(const InvertedIndexFile&) = delete;
+	
+public:
+	InvertedIndexFile();
+	~InvertedIndexFile();
+	
+	bool open(const char* path);
+	// returns false if there is no such word
+	bool lines(const char* w, std::size_t len, std::vector<std::uint32_t>& lines) const;
+	
+	std::uint64_t words_num() const { return _header->words_num; }
+	std::uint64_t lines_num() const { return _header->lines_num; }
+	
+	// access to the entries, sorted by word
+	const char* word(std::size_t i) const { return _blob + _entries[i].offset; }
+	std::size_t word_length(std::size_t i) const { return _entries[i].length; }
+	void postings(std::size_t i, std::vector<std::uint32_t>& lines) const {
+		InvertedIndex::DecodePostings(_postings + _entries[i].postings_offset, _entries[i].postings_num, lines);
+	}
+	
+private:
+	void* _data;
+	std::size_t _size;
+	const InvertedIndex::Header* _header;
+	const InvertedIndex::Entry* _entries;
+	const char* _blob;
+	const char* _postings;
+};
+
+/*
+ * Inverted index, stored in a directory as a set of immutable segments.
+ * Each input file is flushed as new segment, then the segments are
+ * merged in background by tiers (as LSM tree does): tier is the log of
+ * segment size with base MERGE_FACTOR, when there are MERGE_FACTOR 
+ * segments in the same tier, they're merged into one of the next tier.
+ * The line numbers are global for the whole index, each input file 
+ * takes the lines after the ones of previous files, so the segments 
+ * cover disjoint ranges of lines and the merge concatenates postings.
+ * The numbers are 32-bit, a file which doesn't fit into them isn't indexed.
+ * MANIFEST lists the input files and live segments, it's replaced 
+ * atomically by rename, the merged segments are removed after that.
+ * The live segments stay mapped, so a query doesn't open the files, and 
+ * the merged ones are unmapped when the last query using them is done.
+ * */
+class IndexSegments final {
+	IndexSegments(const IndexSegments&) = delete;
+	const IndexSegments& operator=(const IndexSegments&) = delete;
+	
+public:
+	static const std::size_t MERGE_FACTOR = 4;
+	static const std::uint64_t TIER_BASE_SIZE = 64 * 1024;
+	static const std::uint64_t MAX_LINES = 0xffffffffULL;
+	
+	explicit IndexSegments(const std::string& dir);
+	
+	// creates the directory if it's needed, loads the manifest and maps the segments
+	bool open();
+	// writes index of the tasks processed the file as new segment,
+	// line_bases are relative to the beginning of the file,
+	// fails if the lines don't fit into MAX_LINES of the index
+	bool flush(const char* fname, std::uint64_t lines_num, const FrozenTable& table, 
+		const std::vector<const InvertedIndex*>& parts,
+		const std::vector<std::vector<std::uint32_t>>& ids,
+		const std::vector<std::uint32_t>& line_bases);
+	// merges segments while there are ones to merge, invoked by pool's thread
+	void merge();
+	
+	// lines of the word in all live segments
+	void lines(const char* w, std::size_t len, std::vector<std::uint32_t>& lines) const;
+	// name of input file, containing the line, and the line number in it
+	std::string locate(std::uint32_t line, std::uint32_t& file_line) const;
+	
+	void print_state() const;
+	
+private:
+	struct Segment {
+		std::uint64_t id;
+		std::uint32_t first_line;
+		std::uint32_t last_line;
+		std::uint64_t size;
+		bool merging;
+		std::shared_ptr<const InvertedIndexFile> file;
+	};
+	struct InputFile {
+		std::string name;
+		std::uint32_t first_line;
+		std::uint32_t lines_num;
+	};
+	
+	static unsigned Tier(std::uint64_t size);
+	std::string segment_path(std::uint64_t id) const;
+	// returns NULL on failure
+	std::shared_ptr<const InvertedIndexFile> map_segment(std::uint64_t id) const;
+	// with locked mutex
+	bool pick_segments(std::vector<Segment>& inputs);
+	bool save_manifest() const;
+	std::uint64_t write_merged(std::uint64_t id, const std::vector<Segment>& inputs);
+	
+	std::string _dir;
+	mutable boost::mutex _mutex;
+	std::vector<Segment> _segments;
+	std::vector<InputFile> _files;
+	std::uint64_t _next_id;
+	std::uint32_t _next_line;
+	std::uint64_t _bytes_flushed;
+	std::uint64_t _bytes_merged;
+	std::uint64_t _merges;
+};
+
+/*
+ * Bit vector with rank support, the numbers of ones before each
+ * 512 bits block are stored, the rest is counted by popcount.
+ * */
+class RankBitVector final {
+public:
+	RankBitVector() : _size(0) {}
+	
+	void resize(std::size_t n) {
+		_size = n;
+		_bits.assign((n + 63) / 64, 0);
+	}
+	void set(std::size_t i) { _bits[i / 64] |= 1ULL << (i % 64); }
+	bool get(std::size_t i) const { return (_bits[i / 64] >> (i % 64)) & 1; }
+	// must be called after all bits are set
+	void build_rank();
+	// ones in [0, i)
+	std::size_t rank1(std::size_t i) const;
+	std::size_t rank0(std::size_t i) const { return i - rank1(i); }
+	
+	std::size_t size() const { return _size; }
+	std::size_t memory_usage() const { return (_bits.size() + _ranks.size()) * sizeof(std::uint64_t); }
+	
+private:
+	std::vector<std::uint64_t> _bits;
+	std::vector<std::uint64_t> _ranks;
+	std::size_t _size;
+};
+
+/*
+ * FM-index of a text, for count and locate queries of arbitrary patterns.
+ * Suffix array is built by SA-IS (induced sorting), then it's used to get
+ * the BWT, which is kept as wavelet matrix of bytes (8 bit vectors with rank
+ * support), and is sampled at text positions multiple of SA_SAMPLE_RATE.
+ * count() is backward search, locate() goes from each found row by LF 
+ * mapping untill the sampled position. Zero byte is the text terminator,
+ * so zero bytes of the text itself are replaced by ones.
+ * */
+class FmIndex final {
+public:
+	static const std::size_t SA_SAMPLE_RATE = 32;
+	static const std::size_t MAX_TEXT_SIZE = 0x7ffffffe;
+	
+	FmIndex();
+	
+	// the text is consumed, times are in seconds
+	bool build(std::string& text, double& sa_time, double& bwt_time);
+	
+	std::size_t count(const char* p, std::size_t len) const;
+	// positions of the first (in suffix order) occurrences, up to the limit
+	void locate(const char* p, std::size_t len, std::size_t limit, std::vector<std::uint64_t>& positions) const;
+	
+	std::size_t text_size() const { return _n == 0 ? 0 : _n - 1; }
+	std::size_t memory_usage() const;
+	
+private:
+	bool backward_search(const char* p, std::size_t len, std::size_t& sp, std::size_t& ep) const;
+	// occurrences of byte in BWT[0, i)
+	std::size_t rank(std::uint8_t c, std::size_t i) const;
+	std::uint8_t access(std::size_t i) const;
+	
+	std::size_t _n; // including the terminator
+	RankBitVector _levels[8];
+	std::size_t _zeros[8];
+	std::size_t _C[257];
+	RankBitVector _sampled; // rows with sampled positions
+	std::vector<std::uint32_t> _samples;
+};
+
+/*
+ * Sequential reader of a byte range of the file by large chunks, 
+ * the data of the chunk is valid untill the next call of next().
+ * Unlike std::ifstream, it doesn't copy the data line by line.
+ * */
+class ChunkReader final {
+	ChunkReader(const ChunkReader&) = delete;
+	const ChunkReader& operator=(const ChunkReader&) = delete;
+	
+public:
+	static const std::size_t CHUNK_SIZE = 1 << 20;
+	
+	ChunkReader(const char* fname, std::uint64_t begin, std::uint64_t end, std::size_t chunk_size = CHUNK_SIZE);
+	~ChunkReader();
+	
+	bool open();
+	// false at the end of the range or on error
+	bool next(const char*& data, std::size_t& size);
+	// file offset of the latest chunk
+	std::uint64_t offset() const { return _offset; }
+	bool failed() const { return _failed; }
+	
+private:
+	const char* _fname;
+	int _fd;
+	std::uint64_t _pos;
+	std::uint64_t _end;
+	std::uint64_t _offset;
+	std::size_t _chunk_size;
+	bool _failed;
+	std::vector<char> _buffer;
+};
+
+/*
+ * Scans the lines, which begin in a byte range of the file, by fixed size 
+ * blocks, whatever long the lines are. The blocks are copied to the work
+ * area and passed to the visitor as pieces of lines, which may be modified
+ * in place. A line longer than MAX_CARRY is passed by pieces, ending after 
+ * a space, so the words aren't split unless they are longer than MAX_CARRY 
+ * themselves. The rest of the block after the latest line (or piece) is 
+ * carried to the next one, so the memory doesn't depend on lines length.
+ * */
+class BlockScanner final {
+	BlockScanner(const BlockScanner&) = delete;
+	const BlockScanner& operator=(const BlockScanner&) = delete;
+	
+public:
+	static const std::size_t MAX_CARRY = 64 * 1024;
+	// the last piece of a line has line_end set, the newline isn't passed
+	typedef std::function<void (char* data, std::size_t size, bool line_end)> Visitor;
+	
+	explicit BlockScanner(const char* fname);
+	
+	// returns false on failure of reading
+	bool scan(std::uint64_t begin, std::uint64_t end, const Visitor& visitor);
+	
+private:
+	// adds the data to the carried bytes, passes the whole lines and long pieces
+	void feed(const char* data, std::size_t size, const Visitor& visitor);
+	
+	const char* _fname;
+	std::vector<char> _work;
+	std::size_t _carry;
+	bool _line_open; // a piece of the current line has been passed
+};
+
+/*
+ * Aho-Corasick automaton for counting occurrences of many patterns
+ * at once. The goto and failure functions are compiled into complete
+ * DFA over classes of bytes (the bytes, which don't appear in patterns,
+ * share one class), so the scan is a single table lookup per byte.
+ * The scan just counts visits of states which have output, the counts
+ * of patterns are summed up over the tree of failure links afterwards.
+ * */
+class AhoCorasick final {
+public:
+	AhoCorasick();
+	
+	// patterns may repeat, empty ones are ignored
+	void add(const std::string& pattern);
+	// false, if there are no patterns, they have over 255 distinct bytes or too many states
+	bool compile();
+	
+	// the state to start the scan from
+	std::uint32_t start() const { return 0; }
+	// feeds the data without counting
+	std::uint32_t advance(const char* data, std::size_t size, std::uint32_t state) const;
+	// visits must have states_num() elements
+	std::uint32_t scan(const char* data, std::size_t size, std::uint32_t state, std::uint64_t* visits) const;
+	// occurrences of each pattern, by the summed up visits of the scans
+	std::vector<std::uint64_t> counts(const std::vector<std::uint64_t>& visits) const;
+	
+	const std::string& pattern(std::size_t i) const { return _patterns[i]; }
+	std::size_t patterns_num() const { return _patterns.size(); }
+	std::size_t max_length() const { return _max_length; }
+	std::size_t states_num() const { return _fail.size(); }
+	std::size_t memory_usage() const;
+	
+private:
+	// the transitions are offsets of rows, with the flag of output state
+	static const std::uint32_t OUTPUT = 0x80000000U;
+	
+	std::uint8_t _classes[256];
+	std::uint32_t _classes_num;
+	std::vector<std::uint32_t> _delta;
+	std::vector<std::uint32_t> _fail;
+	std::vector<std::uint32_t> _order; // breadth first
+	std::vector<std::uint32_t> _terminals; // state of each pattern
+	std::vector<std::string> _patterns;
+	std::size_t _max_length;
+};
+
+/*
+ * Counters spilled by a task, when its table exceeds the memory budget.
+ * Each spill writes the table as sorted runs, one per hash partition, 
+ * of (varint length, word, varint count) records to the file of the 
+ * partition. The files are unlinked right after creation, so they are
+ * removed with the process. The partitions don't share words, so they
+ * are merged independently, each one from the runs of all tasks.
+ * */
+class SpillFiles final {
+	SpillFiles(const SpillFiles&) = delete;
+	const SpillFiles& operator=(const SpillFiles&) = delete;
+	
+public:
+	static const std::size_t PARTITIONS_NUM = 16;
+	// approximate size of node of std::map<std::string, std::uint32_t> 
+	// or std::map<std::string, std::uint64_t>, with the malloc header
+	static const std::size_t COUNTER_NODE_SIZE = 80;
+	// the runs are written by pieces of the size
+	static const std::size_t PIECE_SIZE = 16 * 1024;
+	// of the chunk reader, the block scanner and the spilled pieces of a 
+	// task, its counters take what is left of the task's memory budget
+	static const std::size_t BUFFERS_SIZE = 2 * ChunkReader::CHUNK_SIZE + BlockScanner::MAX_CARRY 
+		+ PARTITIONS_NUM * PIECE_SIZE;
+	
+	SpillFiles();
+	~SpillFiles();
+	
+	// the counters are written (but the ones of 0) and cleared
+	bool spill(const char* dir, std::map<std::string, std::uint32_t>& counters);
+	
+	// merges the runs of the partition from all spill files into a table
+	static FrozenTable MergePartition(const std::vector<const SpillFiles*>& files, std::size_t partition);
+	
+	std::size_t runs() const { return _runs_num; }
+	std::uint64_t bytes() const { return _bytes; }
+	std::uint64_t words_total() const { return _words_total; }
+	double write_time() const { return _write_time; }
+	
+private:
+	struct Run {
+		std::uint64_t offset;
+		std::uint64_t size;
+	};
+	class RunReader;
+	
+	static std::size_t partition(const std::string& w);
+	
+	std::vector<int> _fds; // per partition
+	std::vector<std::vector<Run>> _runs; // per partition
+	std::vector<std::uint64_t> _sizes; // per partition
+	std::size_t _runs_num;
+	std::uint64_t _bytes;
+	std::uint64_t _words_total;
+	double _write_time;
+};
+
+/*
+ * Count-Min sketch of word frequencies: DEPTH rows of counters, the word
+ * increments one counter per row and its estimate is the minimum of them.
+ * The memory is fixed and the estimate is never less than the true count,
+ * it exceeds the count by at most e / width * total with probability at
+ * least 1 - e^-DEPTH. Conservative update increments only the counters
+ * which are equal to the minimum, that makes the overestimation smaller.
+ * Sketches of the same width are merged by summing up the counters, the
+ * width is a power of two so fold() halves it the same way. The counters
+ * saturate at MAX_COUNT, so the estimate never wraps around to a small one.
+ * */
+class CountMinSketch final {
+public:
+	static const std::size_t DEPTH = 4;
+	static const std::uint32_t MAX_COUNT = 0xffffffffU;
+
+	// width is rounded down to power of two, no counters if 0
+	explicit CountMinSketch(std::size_t width = 0);
+
+	void add(const char* w, std::size_t len, std::uint32_t n = 1);
+	std::uint32_t estimate(const char* w, std::size_t len) const;
+	std::uint32_t estimate(const std::string& w) const { return estimate(w.data(), w.size()); }
+
+	// returns false if the widths differ
+	bool merge(const CountMinSketch& other);
+	// sketch of the same words with half of the width
+	CountMinSketch fold() const;
+
+	std::size_t width() const { return _width; }
+	std::uint64_t total() const { return _total; }
+	// the additive error, which isn't exceeded with probability 1 - e^-DEPTH
+	double error_bound() const;
+	std::size_t memory_usage() const { return _counters.size() * sizeof(std::uint32_t); }
+
+private:
+	// the counter of the word in each row
+	void slots(const char* w, std::size_t len, std::size_t* slots) const;
+	static std::uint32_t SaturatedAdd(std::uint32_t a, std::uint32_t b) {
+		return (a > MAX_COUNT - b) ? MAX_COUNT : a + b;
+	}
+
+	std::size_t _width;
+	std::vector<std::uint32_t> _counters; // row by row
+	std::uint64_t _total;
+};
+
+/*
+ * Set of words (stopwords or dictionary) for filtering of the counted ones. 
+ * Membership is checked by blocked Bloom filter first: the word's hash
+ * selects a block of one cache line, and one bit in each of its 8 lanes
+ * of 64 bits, so a check is a single cache miss and a few independent 
+ * bit tests without branches. The words passing the 
+ * filter are verified by the open addressing table of their hashes, 
+ * so the word is hashed once, and compared only if the hashes are equal.
+ * */
+class WordFilter final {
+	// the blocks point into the bits
+	WordFilter(const WordFilter&) = delete;
+	const WordFilter& operator=(const WordFilter&) = delete;
+	
+public:
+	static const std::size_t LANES = 8;
+	// the number of blocks is rounded up to a power of two, so there are 
+	// 16-32 bits per word, it gives 0.09%-0.002% of false positives
+	static const std::size_t BITS_PER_WORD = 16;
+	
+	WordFilter();
+	
+	// one word per line, empty lines are ignored
+	bool load(const char* fname);
+	
+	// false positives are possible
+	bool may_contain(std::uint64_t h) const;
+	// exact check of the word, which passed the filter
+	bool verify(std::uint64_t h, const char* w, std::size_t len) const;
+	// h is hash_bytes() of the word
+	bool contains(std::uint64_t h, const char* w, std::size_t len) const { return may_contain(h) && verify(h, w, len); }
+	bool contains(const char* w, std::size_t len) const { return contains(hash_bytes(w, len), w, len); }
+	bool contains(const std::string& w) const { return contains(w.data(), w.size()); }
+	
+	std::size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+	std::size_t memory_usage() const;
+	
+private:
+	struct Entry {
+		std::uint64_t hash;
+		std::uint32_t offset; // in words, EMPTY if the slot is free
+		std::uint32_t length;
+	};
+	static const std::uint32_t EMPTY = 0xffffffffU;
+	
+	void insert(std::uint64_t h, std::uint32_t offset, std::uint32_t length);
+	
+	std::vector<std::uint64_t> _bits; // aligned blocks start at _blocks
+	const std::uint64_t* _blocks;
+	std::size_t _blocks_mask;
+	std::vector<Entry> _table;
+	std::string _words;
+	std::size_t _size;
+};
+
+/*
+ * Sampling of a task's range by chunks, for approximate counting. The range
+ * is split into chunks of CHUNK_SIZE (each one has the lines which begin in
+ * it), the fraction of them is read in random order, so the chunks read so
+ * far are always a simple random sample without replacement. The count of
+ * a word is estimated as chunks_num * mean count per sampled chunk, and its
+ * variance by the sample variance of the per chunk counts, with the finite
+ * population correction. The tasks are independent strata of the file, so
+ * their estimates and variances are summed up.
+ * */
+class ChunkSampler final {
+	ChunkSampler(const ChunkSampler&) = delete;
+	const ChunkSampler& operator=(const ChunkSampler&) = delete;
+	
+public:
+	static const std::uint64_t CHUNK_SIZE = 64 * 1024;
+	
+	struct Estimate {
+		double value;
+		double variance;
+		
+		// of 95% confidence interval
+		double margin() const { return 1.96 * std::sqrt(variance); }
+		Estimate& operator+=(const Estimate& other) {
+			value += other.value;
+			variance += other.variance;
+			return *this;
+		}
+	};
+	
+	ChunkSampler();
+	
+	// picks the chunks of the range to read, at least two if there are
+	void plan(std::uint64_t begin, std::uint64_t end, double fraction, std::uint32_t seed);
+	
+	std::size_t chunks_num() const { return _chunks_num; }
+	// the chunks to read, in order of reading
+	std::size_t planned() const { return _order.size(); }
+	std::uint64_t chunk_begin(std::size_t i) const { return _begin + _order[i] * CHUNK_SIZE; }
+	std::uint64_t chunk_end(std::size_t i) const { return std::min(_end, chunk_begin(i) + CHUNK_SIZE); }
+	
+	// adds the counts of the chunk just read to the counters, the chunk is cleared
+	void add_chunk(WordCounters& chunk, WordCounters& counters);
+	
+	// may be called while the chunks are sampled, for progress reports
+	std::size_t sampled() const { return _sampled.load(); }
+	Estimate words_total() const;
+	// sum is the count of the word in the sampled chunks
+	Estimate word(const std::string& w, std::uint64_t sum) const;
+	
+private:
+	Estimate estimate(std::size_t n, double sum, double squares) const;
+	
+	std::uint64_t _begin;
+	std::uint64_t _end;
+	std::size_t _chunks_num;
+	std::vector<std::uint64_t> _order;
+	std::atomic<std::size_t> _sampled;
+	std::atomic<std::uint64_t> _words_sum;
+	std::atomic<std::uint64_t> _words_squares;
+	// sums of squares of the per chunk counts
+	std::unordered_map<std::string, std::uint64_t> _squares;
+};
+
+/*
+ * Splits UTF-8 text into words: maximal runs of characters, which are
+ * not whitespace, punctuation or symbols (as listed in the range table,
+ * other code points are letters, digits and marks). Apostrophes inside
+ * of a word don't split it, at the ends they are dropped. Blocks of 16
+ * bytes without high bytes take SIMD fast path, both for validation and
+ * splitting, other ones are decoded one character at a time.
+ * */
+class Utf8Tokenizer final {
+public:
+	typedef std::function<void (const char*, std::size_t)> Visitor;
+	
+	static bool Validate(const char* data, std::size_t size);
+	// invalid bytes are separators
+	static void Split(const char* data, std::size_t size, const Visitor& visitor);
+	
+	static bool IsSeparator(std::uint32_t cp);
+	// length of valid sequence at the beginning or 0
+	static std::size_t SequenceLength(const unsigned char* s, std::size_t size);
+};
+
+/*
+ * Analysis running as a stage of the task's single pass over its range:
+ * the stages get the pieces of lines (as BlockScanner passes them, before
+ * normalization) and the words (as they are counted). Each task has its 
+ * own instances, so the stages don't share any state while counting, the
+ * instances of all the tasks are merged afterwards. The word frequencies,
+ * n-grams and co-occurrences are built into the task, as they share its
+ * vocabulary and result table, the others are the stages chosen by -A.
+ * An analyzer may read the task's range by itself instead of the pass
+ * (the modes of patterns, lines and FM-index are such ones), or replace
+ * the counting of the words into the table (as the sketch does).
+ * */
+class Analyzer {
+public:
+	virtual ~Analyzer() {}
+	
+	// NULL if there is no such analyzer
+	static std::unique_ptr<Analyzer> Create(const std::string& name);
+	// the stages, which may be chosen by -A
+	static const std::vector<std::string>& Names();
+	
+	virtual const char* name() const = 0;
+	// the lines of the range, which are read, are counted into the given
+	// numbers, as the task counts them, for logging of the task's state
+	virtual bool reads_range() const { return false; }
+	virtual void read_range(const char* /*fname*/, std::uint64_t /*begin*/, std::uint64_t /*end*/,
+		std::size_t& /*line_count*/, std::size_t& /*lines_read*/) {}
+	// false, if the words are counted by the analyzer instead of the table
+	virtual bool needs_table() const { return true; }
+	virtual void add_text(const char* /*data*/, std::size_t /*size*/, bool /*line_end*/) {}
+	virtual void add_word(const std::string& /*w*/) {}
+	// prints the state of the task's instance, when the task is finished
+	virtual void print_task(pthread_t /*tid*/, double /*elapsed*/) const {}
+	// the other one is the analyzer of the same name
+	virtual void merge(const Analyzer& other) = 0;
+	// result is the merged table of the words, if they are counted,
+	// elapsed is the time of the tasks
+	virtual void report(const FrozenTable* result, double elapsed) const = 0;
+};
+
+/*
+ * Histogram of bytes of the text, but newlines. Repeated bytes (spaces,
+ * runs of the same letter) would make each increment wait for the store
+ * of the previous one, so the bytes of each 8 byte word are counted in 
+ * 4 sub-histograms in turn. The sub-histograms have 32-bit counters, 
+ * they are added to the 64-bit ones before any of them can overflow.
+ * */
+class ByteHistogram final : public Analyzer {
+public:
+	ByteHistogram() : _counts(), _lanes(), _pending(0) {}
+	
+	// the kernel, the data may be of any size
+	void add(const char* data, std::size_t size);
+	std::uint64_t count(std::uint8_t c) const;
+	
+	const char* name() const override { return "bytes"; }
+	void add_text(const char* data, std::size_t size, bool /*line_end*/) override { add(data, size); }
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	static const std::size_t LANES_NUM = 4;
+	static const std::uint64_t FLUSH_BYTES = 1ULL << 31;
+	
+	void flush();
+	
+	std::uint64_t _counts[256];
+	std::uint32_t _lanes[LANES_NUM][256];
+	std::uint64_t _pending; // bytes counted by the sub-histograms
+};
+
+// histogram of UTF-8 characters, the invalid bytes are counted apart
+class CharHistogram final : public Analyzer {
+public:
+	CharHistogram() : _invalid(0) {}
+	
+	const char* name() const override { return "chars"; }
+	void add_text(const char* data, std::size_t size, bool line_end) override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	ByteHistogram _ascii; // the runs of ASCII are counted by the bytes kernel
+	std::unordered_map<std::uint32_t, std::uint64_t> _others;
+	std::uint64_t _invalid;
+};
+
+// distribution of lengths of lines (in bytes), by powers of two
+class LineLengths final : public Analyzer {
+public:
+	static const std::size_t BUCKETS_NUM = 64;
+	
+	LineLengths() : _current(0), _max(0), _total(0), _buckets() {}
+	
+	const char* name() const override { return "lines"; }
+	void add_text(const char* data, std::size_t size, bool line_end) override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	std::uint64_t _current; // of the line, which isn't finished yet
+	std::uint64_t _max;
+	std::uint64_t _total;
+	std::uint64_t _buckets[BUCKETS_NUM]; // k-th one has lengths in [2^(k-1), 2^k)
+};
+
+// distribution of lengths of words (in bytes)
+class WordLengths final : public Analyzer {
+public:
+	static const std::size_t MAX_LENGTH = 32; // the longer ones share the last bucket
+	
+	WordLengths() : _counts() {}
+	
+	const char* name() const override { return "word-lengths"; }
+	void add_word(const std::string& w) override { _counts[w.size() < MAX_LENGTH ? w.size() : MAX_LENGTH]++; }
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	std::uint64_t _counts[MAX_LENGTH + 1];
+};
+
+// occurrences of the patterns of -a, in the lines
+class PatternMatches final : public Analyzer {
+public:
+	explicit PatternMatches(const AhoCorasick& matcher);
+	
+	const char* name() const override { return "patterns"; }
+	void add_text(const char* data, std::size_t size, bool line_end) override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	const AhoCorasick& _matcher;
+	std::uint32_t _state;
+	std::vector<std::uint64_t> _visits;
+};
+
+// occurrences of the patterns of -a in the bytes of the range, instead of 
+// counting words, the occurrences ending in the range belong to the task
+class PatternCounts final : public Analyzer {
+public:
+	explicit PatternCounts(const AhoCorasick& matcher);
+	
+	const char* name() const override { return "pattern-counts"; }
+	bool reads_range() const override { return true; }
+	void read_range(const char* fname, std::uint64_t begin, std::uint64_t end,
+		std::size_t& line_count, std::size_t& lines_read) override;
+	void print_task(pthread_t tid, double elapsed) const override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	const AhoCorasick& _matcher;
+	std::vector<std::uint64_t> _visits;
+	std::uint64_t _bytes_scanned;
+};
+
+// numbers of lines and words, without counting of each word (as wc does)
+class LineWordCounts final : public Analyzer {
+public:
+	LineWordCounts() : _line_count(0), _lines_read(0), _words(0), _bytes_scanned(0) {}
+	
+	const char* name() const override { return "count-only"; }
+	bool reads_range() const override { return true; }
+	void read_range(const char* fname, std::uint64_t begin, std::uint64_t end,
+		std::size_t& line_count, std::size_t& lines_read) override;
+	void print_task(pthread_t tid, double elapsed) const override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	std::uint64_t _line_count;
+	std::uint64_t _lines_read;
+	std::uint64_t _words;
+	std::uint64_t _bytes_scanned;
+};
+
+// FM-index of the whole file, built by the single task of the file
+class FmIndexes final : public Analyzer {
+public:
+	FmIndexes() : _text_size(0), _sa_time(0), _bwt_time(0) {}
+	
+	const char* name() const override { return "fm-index"; }
+	bool reads_range() const override { return true; }
+	void read_range(const char* fname, std::uint64_t begin, std::uint64_t end,
+		std::size_t& line_count, std::size_t& lines_read) override;
+	void print_task(pthread_t tid, double elapsed) const override;
+	void merge(const Analyzer& other) override;
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	struct File {
+		std::shared_ptr<const FmIndex> index;
+		std::vector<std::string> samples; // of text to benchmark the queries
+	};
+	
+	std::vector<File> _files; // the merged ones share the indices
+	std::uint64_t _text_size;
+	double _sa_time;
+	double _bwt_time;
+};
+
+// estimated frequencies of the words by Count-Min sketch of -c
+class WordSketch final : public Analyzer {
+public:
+	explicit WordSketch(std::size_t width) : _sketch(width) {}
+	
+	const char* name() const override { return "sketch"; }
+	// the words are counted exactly too, to report the sketch's accuracy
+	bool needs_table() const override;
+	void add_word(const std::string& w) override { _sketch.add(w.data(), w.size()); }
+	void print_task(pthread_t tid, double elapsed) const override;
+	void merge(const Analyzer& other) override { _sketch.merge(static_cast<const WordSketch&>(other)._sketch); }
+	void report(const FrozenTable* result, double elapsed) const override;
+	
+private:
+	CountMinSketch _sketch;
+};
+
+/*
+ * Map-reduce over the lines of files, run by the tasks on the pool.
+ * Each map task reads the lines of its range, passes them to the mapper
+ * and combines the emitted pairs in its own table, the table is split 
+ * into hash partitions, when the task is finished. Then a reduce task 
+ * per partition combines the partitions of all the map tasks and passes
+ * the table to the reducer. The tasks see the job by this interface, 
+ * MapReduce implements it by the given functions.
+ * */
+class MapReduceJob {
+public:
+	virtual ~MapReduceJob() {}
+	
+	virtual std::size_t partitions_num() const = 0;
+	// called before the map tasks are started
+	virtual void start(std::size_t map_tasks) = 0;
+	// the pieces of lines, as BlockScanner passes them
+	virtual void map(std::size_t task, char* data, std::size_t size, bool line_end) = 0;
+	virtual void finish_map(std::size_t task) = 0;
+	// called, when all the map tasks are finished
+	virtual void reduce(std::size_t partition) = 0;
+};
+
+template <typename Key, typename Value, typename Combiner = std::plus<Value>, typename Hash = std::hash<Key>>
+class MapReduce final : public MapReduceJob {
+public:
+	typedef std::unordered_map<Key, Value, Hash> Table;
+	typedef std::vector<std::pair<Key, Value>> Partition;
+	
+	// combines the pairs emitted by the mapper into the table of map task
+	class Emitter {
+	public:
+		Emitter(Table& table, const Combiner& combine) : _table(table), _combine(combine) {}
+		
+		void emit(const Key& key, const Value& value) {
+			typename Table::iterator it = _table.find(key);
+			if (it != _table.end())
+				it->second = _combine(it->second, value);
+			else
+				_table.emplace(key, value);
+		}
+		
+	private:
+		Table& _table;
+		const Combiner& _combine;
+	};
+	
+	typedef std::function<void (char*, std::size_t, bool, Emitter&)> Mapper;
+	// gets the combined table of the partition
+	typedef std::function<void (std::size_t, Table&)> Reducer;
+	
+	MapReduce(std::size_t partitions_num, const Mapper& mapper, const Reducer& reducer, 
+		const Combiner& combine = Combiner())
+		: _partitions_num(partitions_num), _mapper(mapper), _reducer(reducer), _combine(combine)
+		{
+		}
+	
+	std::size_t partitions_num() const override { return _partitions_num; }
+	
+	void start(std::size_t map_tasks) override {
+		_tables.assign(map_tasks, Table());
+		_shuffled.assign(map_tasks, std::vector<Partition>(_partitions_num));
+	}
+	
+	void map(std::size_t task, char* data, std::size_t size, bool line_end) override {
+		Emitter out(_tables[task], _combine);
+		_mapper(data, size, line_end, out);
+	}
+	
+	void finish_map(std::size_t task) override {
+		Hash hash;
+		for (const std::pair<const Key, Value>& entry : _tables[task]) {
+			_shuffled[task][hash(entry.first) % _partitions_num].push_back(entry);
+		}
+		Table().swap(_tables[task]);
+	}
+	
+	void reduce(std::size_t partition) override {
+		Table table;
+		Emitter out(table, _combine);
+		for (std::vector<Partition>& shuffled : _shuffled) {
+			for (const std::pair<Key, Value>& entry : shuffled[partition]) {
+				out.emit(entry.first, entry.second);
+			}
+			Partition().swap(shuffled[partition]);
+		}
+		_reducer(partition, table);
+	}
+	
+private:
+	std::size_t _partitions_num;
+	Mapper _mapper;
+	Reducer _reducer;
+	Combiner _combine;
+	std::vector<Table> _tables; // of each map task
+	std::vector<std::vector<Partition>> _shuffled; // by map task and partition
+};
+
+/* 
+ * The class emulates task, which is running during long term of time.
+ * Its job is:
+ * 1. open text file
+ * 2. read the lines which begin in range [begin, end) of the file,
+ *    by fixed size blocks
+ * 3. count the frequency of occurency of each word, and pass
+ *    the lines and words to the analyzers, if there are any
+ * 4. freeze the counters into compact read-only table
+ * Or it runs the analyzer, which reads the range by itself, if there is
+ * such one, or map or reduce task of the job, if it is given.
+ * 
+ * The job is performed by method operator()(), invoked
+ * in scope of separate thread from the pool of threads.
+ * */
+class Task final {
+
+public:
+	Task(const char* fname, std::uint64_t begin, std::uint64_t end);
+	// map task of the job, if fname is set, or reduce task of partition
+	Task(MapReduceJob& job, std::size_t index, const char* fname = NULL, std::uint64_t begin = 0, std::uint64_t end = 0);
+	~Task();
+	
+	void operator()();
+	
+	// valid after the task has been finished
+	const FrozenTable& result() const { return _result; }
+	const Vocabulary& vocabulary() const { return _vocabulary; }
+	const NgramCounter& ngrams() const { return _ngrams; }
+	const CooccurrenceCounter& cooccurrences() const { return _cooccurrences; }
+	const InvertedIndex& index() const { return _index; }
+	std::uint64_t bytes_scanned() const { return _bytes_scanned; }
+	// lines which are not valid UTF-8, if words are split by Unicode rules
+	std::size_t invalid_lines() const { return _invalid_lines; }
+	// words dropped by stopwords or dictionary
+	std::uint64_t words_filtered() const { return _words_filtered; }
+	// not empty, if the counters exceeded the memory budget
+	const SpillFiles& spill_files() const { return _spill_files; }
+	// chunks of the range to read, if the counts are estimated by sampling
+	const ChunkSampler& sampler() const { return _sampler; }
+	// of ::options.analyzers
+	const std::vector<std::unique_ptr<Analyzer>>& analyzers() const { return _analyzers; }
+
+	// unsafe acccess to internal variables.
+	// not serious mistake in given context, 
+	// because they are used just for logging of task's state
+	
+	pthread_t tid() const { return _tid; }
+	
+	double elapsed_time() const {
+		clock_t t = clock();
+		return static_cast<double>(t - _start) / CLOCKS_PER_SEC;
+	}
+	
+	std::size_t line_count() const { return _line_count; }
+	// including empty lines
+	std::size_t lines_read() const { return _lines_read; }
+	// set when the task is finished or cancelled
+	bool finished() const { return _finished.load(); }
+	
+private:
+	void run_job();
+	// spills the counters, if they may exceed the memory budget
+	void check_memory_budget();
+	
+	const char* _fname;
+	std::uint64_t _begin;
+	std::uint64_t _end;
+	std::atomic<bool> _finished;
+	pthread_t _tid;
+	clock_t _start;
+	std::size_t _line_count;	
+	std::size_t _lines_read;
+	WordCounters _word_counters;
+	PreAggregator _pre_aggregator;
+	FrozenTable _result;
+	// used by n-grams, co-occurrences counting and indexing only
+	Vocabulary _vocabulary;
+	NgramCounter _ngrams;
+	CooccurrenceCounter _cooccurrences;
+	InvertedIndex _index;
+	std::uint64_t _bytes_scanned;
+	std::uint64_t _words_counted; // passed the filters
+	std::size_t _invalid_lines;
+	std::uint64_t _words_filtered;
+	std::uint64_t _filter_false_positives; // passed Bloom filter, but not verified
+	SpillFiles _spill_files;
+	std::size_t _spill_check_size; // counters size of the next budget check
+	bool _spill_disabled; // the counters stay in memory, after spilling failed
+	ChunkSampler _sampler;
+	std::vector<std::unique_ptr<Analyzer>> _analyzers;
+	MapReduceJob* _job;
+	std::size_t _job_index; // of map task or partition
+};
+
+
+class TasksRegistry {
+	TasksRegistry(const TasksRegistry&) = delete;
+	const TasksRegistry& operator=(const TasksRegistry&) = delete;
+	
+public:
+	explicit TasksRegistry(const Task* task);
+	~TasksRegistry();
+	
+	static std::list<const Task*> GetRunningTasks();
+		
+private:
+	static std::map<pthread_t, const Task*> _tasks;
+	static boost::mutex _mutex;
+};
+
+
+////////////////////////////////////////////////////////////////////////
+// 
+
+static sigset_t sig_set;
+
+static std::atomic<int> sig_num{ 0 }; // number of the latest received signal
+static std::atomic<bool> running{ true };
+
+// settings from the command line, are read-only when tasks are running
+struct Options {
+	bool pre_aggregate = true;
+	bool perfect_hash = false;
+	bool trie = false;
+	std::size_t ngram = 0; // count n-grams if not 0
+	std::size_t cooccurrence_window = 0; // count co-occurrences if not 0
+	std::size_t cooccurrence_max_pairs = 1 << 20;
+	const char* index_path = NULL; // directory of inverted index, if set
+	bool fm_index = false; // build FM-index instead of counting words
+	std::vector<std::string> patterns;
+	const AhoCorasick* matcher = NULL; // count patterns instead of words, if set
+	bool count_only = false; // count lines and words without the table
+	bool normalize = false; // lowercase and replace punctuation by spaces before splitting
+	bool unicode = false; // split words by Unicode whitespace and punctuation
+	bool text_benchmark = false; // of normalization and tokenization
+	// of each task running at once (the budget given is shared by them): 
+	// its counters, pre-aggregation table and buffers, not limited if 0
+	std::size_t memory_budget = 0;
+	const char* spill_path = "/tmp"; // directory of spill files
+	std::size_t sketch_width = 0; // count words by Count-Min sketch if not 0
+	bool sketch_exact = false; // count exactly too, to report the sketch's accuracy
+	double sample_fraction = 0; // read the fraction of chunks and estimate counts, if not 0
+	const WordFilter* stopwords = NULL; // words which aren't counted, if set
+	const WordFilter* dictionary = NULL; // the only words which are counted, if set
+	const char* output_path = NULL; // of the sorted result, if set
+	const char* table_path = NULL; // the result table is stored to, if set
+	ResultWriter::Format output_format = ResultWriter::TEXT;
+	unsigned threads = 0; // of the pool, hardware concurrency if 0
+	bool compare = false; // compare vocabularies of two files
+	bool map_reduce = false; // count words by map-reduce job
+	std::vector<std::string> analyzers; // names of the stages of tasks
+	const AhoCorasick* stage_matcher = NULL; // patterns of "patterns" stage
+	std::vector<std::string> queries;
+	const char* server_socket = NULL;
+	const char* load_socket = NULL;
+	std::size_t load_requests = 100000;
+	std::size_t load_batch = 16;
+};
+
+static Options options;
+
+static void* sig_handle_worker_routine(void* arg) {
+	int sig_num = 0;
+	bool emergency = false;
+	while (::running.load()) {
+		if (sigwait(&::sig_set, &sig_num) < 0) {
+			perror("sigwait()");
+			emergency = true;
+		} else {
+			::sig_num.store(sig_num);
+			std::cout << "received signal: " << sig_num << std::endl;
+		}
+		
+		if (emergency || 
+			sig_num == SIGINT || sig_num == SIGABRT || sig_num == SIGTERM) {
+			std::cout << "cancel running tasks (if any)\n";
+			// cancel tasks which are running
+			std::list<const Task*> tasks = TasksRegistry::GetRunningTasks();
+			for (const Task* task : tasks) {
+				if (pthread_cancel(task->tid()) != 0) {
+					perror("pthread_cancel()");
+					std::cerr << "canceliing of task TID " 
+						<< task->tid() << " failed\n";
+				}
+			}
+			break;
+		}
+	}
+	/*
+	::running = 0;
+	* */
+	::running.store(false);
+	return NULL;
+}
+
+// reports latency of the FM-index queries for the given and sample patterns
+static void run_fm_queries(const FmIndex& index, const std::vector<std::string>& samples) {
+	if (index.text_size() == 0)
+		return;
+	struct timespec start;
+	std::vector<std::uint64_t> positions;
+	for (const std::string& p : ::options.patterns) {
+		// it would match every suffix, the terminator's one too
+		if (p.empty()) {
+			std::cerr << "empty pattern is ignored\n";
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		std::size_t n = index.count(p.data(), p.size());
+		double count_time = seconds_since(start);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		index.locate(p.data(), p.size(), 10, positions);
+		double locate_time = seconds_since(start);
+		std::cout << "  '" << p << "' occurrences " << n 
+			<< " (count " << count_time * 1e6 << " usec, locate " << positions.size() 
+			<< " in " << locate_time * 1e6 << " usec):";
+		std::sort(positions.begin(), positions.end());
+		for (std::uint64_t pos : positions) {
+			std::cout << " " << pos;
+		}
+		std::cout << std::endl;
+	}
+	
+	if (samples.empty())
+		return;
+	std::uint64_t occurrences = 0, located = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (const std::string& p : samples) {
+		occurrences += index.count(p.data(), p.size());
+	}
+	double count_time = seconds_since(start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (const std::string& p : samples) {
+		index.locate(p.data(), p.size(), 100, positions);
+		located += positions.size();
+	}
+	double locate_time = seconds_since(start);
+	std::cout << "fm-index queries: " << samples.size() << " patterns of " << samples.front().size()
+		<< " bytes, occurrences " << occurrences
+		<< ", count " << count_time / samples.size() * 1e6 << " usec per pattern"
+		<< ", locate " << (located == 0 ? 0.0 : locate_time / located * 1e6) << " usec per occurrence\n";
+}
+
+// estimated count of the word, summed up over the tasks
+static ChunkSampler::Estimate estimate_word(const std::deque<Task>& tasks, const std::string& w) {
+	ChunkSampler::Estimate e = { 0, 0 };
+	for (const Task& task : tasks) {
+		std::size_t i = task.result().find(w);
+		e += task.sampler().word(w, i == FrozenTable::npos ? 0 : task.result().count(i));
+	}
+	return e;
+}
+
+// prints estimates of the counts of the most frequent words in the sample and of the queried ones
+static void report_sample_estimates(const std::deque<Task>& tasks, const FrozenTable& sample) {
+	ChunkSampler::Estimate total = { 0, 0 };
+	std::size_t sampled = 0, chunks_num = 0;
+	for (const Task& task : tasks) {
+		total += task.sampler().words_total();
+		sampled += task.sampler().sampled();
+		chunks_num += task.sampler().chunks_num();
+	}
+	std::cout << "result: sampled chunks " << sampled << " of " << chunks_num
+		<< " distinct words in sample " << sample.size()
+		<< " number of words " << static_cast<std::uint64_t>(total.value) 
+		<< " +/- " << static_cast<std::uint64_t>(total.margin()) << " (95% confidence)\n";
+	
+	std::vector<std::uint32_t> order(sample.size());
+	for (std::size_t i = 0; i < order.size(); i++) {
+		order[i] = static_cast<std::uint32_t>(i);
+	}
+	std::size_t top = std::min<std::size_t>(20, order.size());
+	std::partial_sort(order.begin(), order.begin() + top, order.end(), 
+		[&sample](std::uint32_t a, std::uint32_t b) { return sample.count(a) > sample.count(b); });
+	order.resize(top);
+	std::vector<std::string> words;
+	for (std::uint32_t i : order) {
+		words.push_back(sample.word_str(i));
+	}
+	words.insert(words.end(), ::options.queries.begin(), ::options.queries.end());
+	for (const std::string& w : words) {
+		ChunkSampler::Estimate e = estimate_word(tasks, w);
+		std::cout << "  '" << w << "' ~" << static_cast<std::uint64_t>(e.value) 
+			<< " +/- " << static_cast<std::uint64_t>(e.margin()) << std::endl;
+	}
+}
+
+// compares the estimates of the sketch and of its folds with the exact counts
+static void report_sketch_accuracy(const CountMinSketch& sketch, const FrozenTable& exact) {
+	static const std::size_t MIN_WIDTH = 64;
+	std::cout << "sketch accuracy, distinct words " << exact.size()
+		<< " exact table " << exact.memory_usage() << " bytes\n";
+	for (CountMinSketch s = sketch; s.width() != 0; s = s.fold()) {
+		std::uint64_t errors = 0, max_error = 0;
+		std::size_t exact_num = 0, over_bound = 0;
+		double relative = 0, bound = s.error_bound();
+		for (std::size_t i = 0; i < exact.size(); i++) {
+			std::uint64_t count = exact.count(i);
+			std::uint64_t estimate = s.estimate(exact.word(i), exact.word_length(i));
+			std::uint64_t error = estimate > count ? estimate - count : count - estimate;
+			errors += error;
+			max_error = std::max(max_error, error);
+			relative += static_cast<double>(error) / count;
+			exact_num += (error == 0);
+			over_bound += (error > bound);
+		}
+		std::size_t n = std::max<std::size_t>(1, exact.size());
+		std::cout << "  size " << s.memory_usage() << " bytes"
+			<< " width " << s.width()
+			<< ": exact " << 100.0 * exact_num / n << "%"
+			<< " mean error " << static_cast<double>(errors) / n
+			<< " mean relative error " << relative / n
+			<< " max error " << max_error
+			<< " bound " << bound << " exceeded by " << 100.0 * over_bound / n << "%\n";
+		if (s.width() <= MIN_WIDTH)
+			break;
+	}
+}
+
+// merges the partitions of spilled counters in parallel
+static void merge_spill_files(boost::threadpool::pool& tp, const std::deque<Task>& tasks,
+	std::vector<FrozenTable>& partitions) {
+	std::vector<const SpillFiles*> files;
+	std::uint64_t bytes = 0;
+	std::size_t runs = 0;
+	double write_time = 0;
+	for (const Task& task : tasks) {
+		const SpillFiles& f = task.spill_files();
+		if (f.runs() == 0)
+			continue;
+		files.push_back(&f);
+		bytes += f.bytes();
+		runs += f.runs();
+		write_time += f.write_time();
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (files.empty()) {
+		std::cout << "counters fit in memory budget, peak memory " << usage.ru_maxrss * 1024 << " bytes\n";
+		return;
+	}
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	partitions.resize(SpillFiles::PARTITIONS_NUM);
+	for (std::size_t k = 0; k < partitions.size(); k++) {
+		tp.schedule([&partitions, &files, k]() { 
+			partitions[k] = SpillFiles::MergePartition(files, k); 
+		});
+	}
+	tp.wait();
+	double merge_time = seconds_since(start);
+	
+	std::cout << "spilled counters: runs " << runs
+		<< " bytes " << bytes
+		<< " write time " << write_time << " sec"
+		<< " peak memory of counting " << usage.ru_maxrss * 1024 << " bytes"
+		<< ", partitions " << partitions.size()
+		<< " merged in " << merge_time << " sec\n";
+}
+
+// measures false positive rate and check time of the filter by the words, which aren't in it
+static void report_word_filter(const char* fname, const WordFilter& filter) {
+	// the probes aren't in the filter, they are hashed with different seeds 
+	// to reach all the blocks, as the words of a text do
+	static const std::size_t CHECKS_NUM = 1 << 20;
+	std::vector<std::string> probes(1024);
+	for (std::size_t i = 0; i < probes.size(); i++) {
+		probes[i] = "#probe" + std::to_string(i);
+	}
+	std::vector<std::uint64_t> hashes(CHECKS_NUM);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t i = 0; i < CHECKS_NUM; i++) {
+		const std::string& w = probes[i % probes.size()];
+		hashes[i] = hash_bytes(w.data(), w.size(), i / probes.size());
+	}
+	double hash_time = seconds_since(start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::size_t passed = 0;
+	for (std::size_t i = 0; i < CHECKS_NUM; i++) {
+		passed += filter.may_contain(hashes[i]);
+	}
+	double check_time = seconds_since(start);
+	std::cout << "words filter " << fname
+		<< " words " << filter.size()
+		<< " memory " << filter.memory_usage() << " bytes"
+		<< " false positive rate " << static_cast<double>(passed) / CHECKS_NUM
+		<< " check time " << check_time * 1e9 / CHECKS_NUM << " ns"
+		<< " (hash " << hash_time * 1e9 / CHECKS_NUM << " ns)\n";
+}
+
+// the part of the merge join of two tables, by ranges of words
+struct VocabularyDiff {
+	static const std::uint32_t NONE = 0xffffffffU;
+	struct Ranked {
+		double score;
+		std::uint32_t a; // indices in the tables or NONE
+		std::uint32_t b;
+	};
+	std::size_t common = 0;
+	std::size_t only_a = 0;
+	std::size_t only_b = 0;
+	std::uint64_t common_tokens_a = 0;
+	std::uint64_t common_tokens_b = 0;
+	// top words by log-ratio of frequencies, both ways
+	std::vector<Ranked> rising;
+	std::vector<Ranked> falling;
+};
+
+static void add_ranked(std::vector<VocabularyDiff::Ranked>& top, std::size_t k, 
+	const VocabularyDiff::Ranked& r, const std::function<bool (const VocabularyDiff::Ranked&, const VocabularyDiff::Ranked&)>& better) {
+	// min-heap by the order, its top is the worst of k best
+	if (top.size() < k) {
+		top.push_back(r);
+		std::push_heap(top.begin(), top.end(), better);
+	} else if (better(r, top.front())) {
+		std::pop_heap(top.begin(), top.end(), better);
+		top.back() = r;
+		std::push_heap(top.begin(), top.end(), better);
+	}
+}
+
+static void compare_vocabularies(boost::threadpool::pool& tp, std::size_t parts,
+	const char* name_a, const FrozenTable& a, const char* name_b, const FrozenTable& b) {
+	static const std::size_t TOP_NUM = 20;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	// log2 of the ratio of frequencies in b and a, add-one smoothed
+	const double total_a = static_cast<double>(a.words_total()) + 1;
+	const double total_b = static_cast<double>(b.words_total()) + 1;
+	auto score = [&a, &b, total_a, total_b](std::uint32_t i, std::uint32_t j) {
+		double ca = (i == VocabularyDiff::NONE) ? 0 : static_cast<double>(a.count(i));
+		double cb = (j == VocabularyDiff::NONE) ? 0 : static_cast<double>(b.count(j));
+		return std::log2(((cb + 1) / total_b) / ((ca + 1) / total_a));
+	};
+	auto word = [&a, &b](const VocabularyDiff::Ranked& r) {
+		return (r.a != VocabularyDiff::NONE) ? a.word_str(r.a) : b.word_str(r.b);
+	};
+	auto word_less = [&a, &b](const VocabularyDiff::Ranked& x, const VocabularyDiff::Ranked& y) {
+		const FrozenTable& tx = (x.a != VocabularyDiff::NONE) ? a : b;
+		const FrozenTable& ty = (y.a != VocabularyDiff::NONE) ? a : b;
+		std::size_t ix = (x.a != VocabularyDiff::NONE) ? x.a : x.b, iy = (y.a != VocabularyDiff::NONE) ? y.a : y.b;
+		std::size_t lx = tx.word_length(ix), ly = ty.word_length(iy);
+		int r = std::memcmp(tx.word(ix), ty.word(iy), std::min(lx, ly));
+		return r < 0 || (r == 0 && lx < ly);
+	};
+	// ties are broken by word, so the ranking doesn't depend on the parts
+	std::function<bool (const VocabularyDiff::Ranked&, const VocabularyDiff::Ranked&)> rising = 
+		[&word_less](const VocabularyDiff::Ranked& x, const VocabularyDiff::Ranked& y) {
+			return x.score > y.score || (x.score == y.score && word_less(x, y));
+		};
+	std::function<bool (const VocabularyDiff::Ranked&, const VocabularyDiff::Ranked&)> falling = 
+		[&word_less](const VocabularyDiff::Ranked& x, const VocabularyDiff::Ranked& y) {
+			return x.score < y.score || (x.score == y.score && word_less(x, y));
+		};
+	
+	// both tables are sorted by word, the ranges of parts are split by
+	// the words of the larger one, and found in the other by binary search
+	const FrozenTable& large = (a.size() >= b.size()) ? a : b;
+	const FrozenTable& small = (a.size() >= b.size()) ? b : a;
+	std::vector<std::size_t> large_bounds, small_bounds;
+	for (std::size_t k = 0; k <= parts; k++) {
+		std::size_t i = large.size() * k / parts;
+		large_bounds.push_back(i);
+		small_bounds.push_back(i == large.size() ? small.size() : small.lower_bound(large.word(i), large.word_length(i)));
+	}
+	const std::vector<std::size_t>& a_bounds = (&large == &a) ? large_bounds : small_bounds;
+	const std::vector<std::size_t>& b_bounds = (&large == &a) ? small_bounds : large_bounds;
+	
+	std::vector<VocabularyDiff> diffs(parts);
+	for (std::size_t k = 0; k < parts; k++) {
+		tp.schedule([&, k]() {
+			VocabularyDiff& d = diffs[k];
+			std::size_t i = a_bounds[k], j = b_bounds[k];
+			while (i < a_bounds[k + 1] || j < b_bounds[k + 1]) {
+				int r;
+				if (i == a_bounds[k + 1])
+					r = 1;
+				else if (j == b_bounds[k + 1])
+					r = -1;
+				else {
+					std::size_t la = a.word_length(i), lb = b.word_length(j);
+					r = std::memcmp(a.word(i), b.word(j), std::min(la, lb));
+					if (r == 0)
+						r = (la < lb) ? -1 : (la > lb ? 1 : 0);
+				}
+				VocabularyDiff::Ranked ranked;
+				ranked.a = (r <= 0) ? static_cast<std::uint32_t>(i++) : VocabularyDiff::NONE;
+				ranked.b = (r >= 0) ? static_cast<std::uint32_t>(j++) : VocabularyDiff::NONE;
+				if (r == 0) {
+					d.common++;
+					d.common_tokens_a += a.count(ranked.a);
+					d.common_tokens_b += b.count(ranked.b);
+				} else if (r < 0) {
+					d.only_a++;
+				} else {
+					d.only_b++;
+				}
+				ranked.score = score(ranked.a, ranked.b);
+				add_ranked(d.rising, TOP_NUM, ranked, rising);
+				add_ranked(d.falling, TOP_NUM, ranked, falling);
+			}
+		});
+	}
+	tp.wait();
+	
+	VocabularyDiff total;
+	for (const VocabularyDiff& d : diffs) {
+		total.common += d.common;
+		total.only_a += d.only_a;
+		total.only_b += d.only_b;
+		total.common_tokens_a += d.common_tokens_a;
+		total.common_tokens_b += d.common_tokens_b;
+		for (const VocabularyDiff::Ranked& r : d.rising) {
+			add_ranked(total.rising, TOP_NUM, r, rising);
+		}
+		for (const VocabularyDiff::Ranked& r : d.falling) {
+			add_ranked(total.falling, TOP_NUM, r, falling);
+		}
+	}
+	std::sort(total.rising.begin(), total.rising.end(), rising);
+	std::sort(total.falling.begin(), total.falling.end(), falling);
+	double join_time = seconds_since(start);
+	
+	std::size_t union_size = total.common + total.only_a + total.only_b;
+	std::cout << "result: vocabulary of " << name_a << " distinct words " << a.size() 
+		<< " number of words " << a.words_total() << std::endl
+		<< "        vocabulary of " << name_b << " distinct words " << b.size() 
+		<< " number of words " << b.words_total() << std::endl
+		<< "  common words " << total.common
+		<< " (" << total.common_tokens_a << " and " << total.common_tokens_b << " occurrences)"
+		<< " only in first " << total.only_a
+		<< " only in second " << total.only_b
+		<< " Jaccard similarity " << (union_size != 0 ? static_cast<double>(total.common) / union_size : 1.0)
+		<< " merge join time " << join_time << " sec\n";
+	std::function<void (const char*, const std::vector<VocabularyDiff::Ranked>&)> print = 
+		[&a, &b, &word](const char* title, const std::vector<VocabularyDiff::Ranked>& top) {
+			std::cout << "  " << title << " (log2 ratio of frequencies, second to first):\n";
+			for (const VocabularyDiff::Ranked& r : top) {
+				std::cout << "    '" << word(r) << "' " << r.score
+					<< " counts " << (r.a != VocabularyDiff::NONE ? a.count(r.a) : 0)
+					<< " " << (r.b != VocabularyDiff::NONE ? b.count(r.b) : 0) << std::endl;
+			}
+		};
+	print("rising", total.rising);
+	print("falling", total.falling);
+	for (const std::string& q : ::options.queries) {
+		std::size_t i = a.find(q), j = b.find(q);
+		std::uint32_t ia = (i == FrozenTable::npos) ? VocabularyDiff::NONE : static_cast<std::uint32_t>(i);
+		std::uint32_t jb = (j == FrozenTable::npos) ? VocabularyDiff::NONE : static_cast<std::uint32_t>(j);
+		std::cout << "  '" << q << "' " << (i == FrozenTable::npos ? 0 : a.count(i))
+			<< " " << (j == FrozenTable::npos ? 0 : b.count(j)) 
+			<< " log2 ratio " << score(ia, jb) << std::endl;
+	}
+}
+
+// prints the summary (without new line), if top is 0, or the top patterns by count
+static void print_top_patterns(const AhoCorasick& matcher, const std::vector<std::uint64_t>& visits, std::size_t top = 0) {
+	std::vector<std::uint64_t> counts = matcher.counts(visits);
+	std::vector<std::uint32_t> order(counts.size());
+	std::uint64_t total = 0;
+	for (std::size_t i = 0; i < counts.size(); i++) {
+		order[i] = static_cast<std::uint32_t>(i);
+		total += counts[i];
+	}
+	if (top == 0) {
+		std::cout << "patterns " << counts.size() << " occurrences " << total;
+		return;
+	}
+	top = std::min<std::size_t>(top, order.size());
+	std::partial_sort(order.begin(), order.begin() + top, order.end(), 
+		[&counts](std::uint32_t a, std::uint32_t b) { 
+			return counts[a] > counts[b] || (counts[a] == counts[b] && a < b); 
+		});
+	for (std::size_t i = 0; i < top; i++) {
+		std::cout << "  '" << matcher.pattern(order[i]) << "' " << counts[order[i]] << std::endl;
+	}
+}
+
+// merges the analyzers of the tasks and reports them, result is the merged table of
+// the words, if they are counted
+static void report_analyzers(const std::deque<Task>& tasks, const FrozenTable* result, double elapsed) {
+	for (std::size_t k = 0; k < ::options.analyzers.size() && !tasks.empty(); k++) {
+		std::unique_ptr<Analyzer> total = Analyzer::Create(::options.analyzers[k]);
+		for (const Task& task : tasks) {
+			total->merge(*task.analyzers()[k]);
+		}
+		total->report(result, elapsed);
+	}
+}
+
+// prints the state of running tasks, untill the tasks starting from given one are finished
+static void wait_for_tasks(const std::deque<Task>& tasks, std::size_t from) {
+	static const unsigned int POLL_PERIOD_MS = 50;
+	static const unsigned int STATE_PERIOD_MS = 4000;
+	for (unsigned int waited_ms = POLL_PERIOD_MS; ; waited_ms += POLL_PERIOD_MS) {
+		bool finished = true;
+		for (std::size_t i = from; i < tasks.size(); i++) {
+			finished = finished && tasks[i].finished();
+		}
+		if (finished)
+			break;
+		usleep(POLL_PERIOD_MS * 1000);
+		if (waited_ms % STATE_PERIOD_MS != 0)
+			continue;
+		
+		// printing the status of tasks to console
+		std::list<const Task*> running = TasksRegistry::GetRunningTasks();
+		std::cout << "\n ---- state:\n";
+		for (const Task* task : running) {
+			std::cout << " task " << reinterpret_cast<const void*>(task);			
+			std::cout << " task TID " << task->tid() 
+				<< " processed lines " << task->line_count()
+				<< " elapsed seconds " << task->elapsed_time()
+				<< std::endl;
+		}
+		if (::options.sample_fraction != 0) {
+			// the estimate tightens as more chunks are sampled
+			ChunkSampler::Estimate total = { 0, 0 };
+			std::size_t sampled = 0, planned = 0;
+			for (std::size_t i = from; i < tasks.size(); i++) {
+				total += tasks[i].sampler().words_total();
+				sampled += tasks[i].sampler().sampled();
+				planned += tasks[i].sampler().planned();
+			}
+			std::cout << " sampled chunks " << sampled << " of " << planned
+				<< " estimated number of words " << static_cast<std::uint64_t>(total.value)
+				<< " +/- " << static_cast<std::uint64_t>(total.margin()) << std::endl;
+		}
+		std::cout << std::endl;
+	}
+}
+
+// runs map tasks over the parts of the files, then reduce task of each partition,
+// false if the job is cancelled
+static bool run_map_reduce(boost::threadpool::pool& tp, MapReduceJob& job, 
+	char* const* files, std::size_t files_num, std::size_t tasks_per_file) {
+	std::deque<Task> tasks;
+	for (std::size_t f = 0; f < files_num; f++) {
+		struct stat file_stat;
+		if (stat(files[f], &file_stat) != 0) {
+			perror("stat()");
+			std::cerr << "couldn't get size of file " << files[f] << std::endl;
+			continue;
+		}
+		for (std::size_t i = 0; i < tasks_per_file; i++) {
+			tasks.emplace_back(job, tasks.size(), files[f], 
+				file_stat.st_size * i / tasks_per_file, file_stat.st_size * (i + 1) / tasks_per_file);
+		}
+	}
+	job.start(tasks.size());
+	for (Task& task : tasks) {
+		tp.schedule(boost::ref(task));
+	}
+	wait_for_tasks(tasks, 0);
+	tp.wait();
+	if (!::running.load())
+		return false;
+	
+	// the map tasks are done, their pairs are shuffled to the partitions
+	tasks.clear();
+	for (std::size_t p = 0; p < job.partitions_num(); p++) {
+		tasks.emplace_back(job, p);
+	}
+	for (Task& task : tasks) {
+		tp.schedule(boost::ref(task));
+	}
+	wait_for_tasks(tasks, 0);
+	tp.wait();
+	return ::running.load();
+}
+
+// the reference job: the words are counted as by the tasks, 
+// each partition is frozen into its own table
+static void count_words_by_map_reduce(boost::threadpool::pool& tp, char* const* files, std::size_t files_num,
+	std::size_t partitions_num, std::vector<FrozenTable>& partitions) {
+	typedef MapReduce<std::string, std::uint64_t> WordCount;
+	WordCount::Mapper mapper = [](char* data, std::size_t size, bool /*line_end*/, WordCount::Emitter& out) {
+		if (size == 0)
+			return;
+		if (::options.normalize)
+			normalize_text(data, size);
+		std::string word;
+		if (::options.unicode) {
+			Utf8Tokenizer::Split(data, size, [&out, &word](const char* w, std::size_t len) {
+				word.assign(w, len);
+				out.emit(word, 1);
+			});
+			return;
+		}
+		// as the tasks split the lines, see Task::operator()()
+		const char* p = data;
+		const char* end = data + size;
+		while (p != end) {
+			const char* sp = static_cast<const char*>(std::memchr(p, ' ', end - p));
+			word.assign(p, (sp != NULL ? sp : end) - p);
+			if (!word.empty() || !::options.normalize)
+				out.emit(word, 1);
+			p = (sp != NULL) ? sp + 1 : end;
+		}
+	};
+	partitions.resize(partitions_num);
+	WordCount::Reducer reducer = [&partitions](std::size_t partition, WordCount::Table& table) {
+		std::vector<const FrozenTable::Counter*> counters;
+		counters.reserve(table.size());
+		for (const FrozenTable::Counter& entry : table) {
+			counters.push_back(&entry);
+		}
+		std::sort(counters.begin(), counters.end(), 
+			[](const FrozenTable::Counter* a, const FrozenTable::Counter* b) { return a->first < b->first; });
+		partitions[partition] = FrozenTable::Freeze(counters);
+	};
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	WordCount job(partitions_num, mapper, reducer);
+	if (!run_map_reduce(tp, job, files, files_num, 4)) {
+		partitions.clear();
+		return;
+	}
+	std::cout << "map-reduce: partitions " << partitions_num 
+		<< " done in " << seconds_since(start) << " sec\n";
+}
+
+// writes the index built by the tasks starting from given one as new segment
+static void flush_index_segment(IndexSegments& segments, const char* fname, 
+	const std::deque<Task>& tasks, std::size_t from) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::vector<const FrozenTable*> results;
+	for (std::size_t i = from; i < tasks.size(); i++) {
+		results.push_back(&tasks[i].result());
+	}
+	FrozenTable table = FrozenTable::Merge(results);
+	
+	std::vector<const InvertedIndex*> parts;
+	std::vector<std::vector<std::uint32_t>> ids;
+	std::vector<std::uint32_t> line_bases;
+	std::uint64_t lines = 0;
+	for (std::size_t i = from; i < tasks.size(); i++) {
+		parts.push_back(&tasks[i].index());
+		ids.push_back(tasks[i].vocabulary().translate(table));
+		line_bases.push_back(static_cast<std::uint32_t>(lines));
+		lines += tasks[i].lines_read();
+	}
+	if (segments.flush(fname, lines, table, parts, ids, line_bases)) {
+		std::cout << "index segment of " << fname << " is written in " 
+			<< seconds_since(start) << " sec\n";
+	}
+}
+
+// merges the tables of the tasks and partitions, reports them, the analyzers
+// and the results built by the ids of words, serves the queries, if asked
+static void report_word_counts(boost::threadpool::pool& tp, std::size_t parts, const std::deque<Task>& tasks,
+	std::vector<FrozenTable>& partitions, IndexSegments& segments, double elapsed) {
+	std::vector<const FrozenTable*> results;
+	for (const Task& task : tasks) {
+		results.push_back(&task.result());
+	}
+	if (::options.memory_budget != 0 && ::running.load())
+		merge_spill_files(tp, tasks, partitions);
+	for (const FrozenTable& t : partitions) {
+		results.push_back(&t);
+	}
+	FrozenTable result = FrozenTable::Merge(results);
+	if (::options.perfect_hash && !result.build_perfect_hash()) {
+		std::cerr << "couldn't build perfect hash, binary search is used\n";
+	}
+	if (::options.sample_fraction != 0) {
+		report_sample_estimates(tasks, result);
+	} else if (::options.sketch_width == 0 || ::options.sketch_exact) {
+		std::cout << "result: distinct words " << result.size()
+			<< " number of words " << result.words_total()
+			<< " table size " << result.memory_usage() << " bytes\n";
+		// the entries with 64-bit counts would be 16 bytes, with alignment
+		std::cout << "  counts: wide " << result.wide_counts()
+			<< " entries " << result.size() * sizeof(FrozenTable::Entry) 
+				+ result.wide_counts() * sizeof(std::pair<std::uint32_t, std::uint64_t>) << " bytes"
+			<< ", with uniform 64-bit counts " << result.size() * 2 * sizeof(std::uint64_t) << " bytes\n";
+		for (const std::string& q : ::options.queries) {
+			std::size_t i = result.find(q);
+			std::cout << "  '" << q << "' " << (i == FrozenTable::npos ? 0 : result.count(i)) << std::endl;
+		}
+	}
+	
+	if (::options.table_path != NULL && ::running.load()) {
+		std::uint64_t size = result.write(::options.table_path);
+		if (size != 0)
+			std::cout << "result table stored to " << ::options.table_path << " bytes " << size << std::endl;
+	}
+	
+	if (::options.output_path != NULL && ::running.load()) {
+		// a few parts per thread to balance them
+		ResultWriter writer(result, tp, parts);
+		writer.sort();
+		if (!writer.write(::options.output_path, ::options.output_format)) {
+			std::cerr << "couldn't write result to " << ::options.output_path << std::endl;
+		} else {
+			std::cout << "result written to " << ::options.output_path
+				<< " bytes " << writer.bytes()
+				<< " sort time " << writer.sort_time() << " sec"
+				<< " write time " << writer.write_time() << " sec\n";
+		}
+	}
+	
+	report_analyzers(tasks, &result, elapsed);
+	
+	// ids of words in each task -> indices in the result table
+	std::vector<std::vector<std::uint32_t>> tasks_ids;
+	for (const Task& task : tasks) {
+		tasks_ids.push_back(task.vocabulary().translate(result));
+	}
+	
+	if (::options.ngram != 0) {
+		NgramCounter ngrams(::options.ngram);
+		for (std::size_t i = 0; i < tasks.size(); i++) {
+			ngrams.merge(tasks[i].ngrams(), tasks_ids[i]);
+		}
+		std::cout << "result: " << ngrams.n() << "-grams " << ngrams.ngrams()
+			<< " distinct " << ngrams.distinct() 
+			<< " table size " << ngrams.memory_usage() << " bytes\n";
+		ngrams.print_top(10, result);
+	}
+	
+	if (::options.cooccurrence_window != 0) {
+		CooccurrenceCounter cooccurrences(::options.cooccurrence_window, ::options.cooccurrence_max_pairs);
+		for (std::size_t i = 0; i < tasks.size(); i++) {
+			cooccurrences.merge(tasks[i].cooccurrences(), tasks_ids[i]);
+		}
+		std::cout << "result: co-occurring pairs " << cooccurrences.pairs()
+			<< " distinct " << cooccurrences.distinct()
+			<< " pruned " << cooccurrences.pruned()
+			<< " (count threshold " << cooccurrences.threshold() << ")"
+			<< " table size " << cooccurrences.memory_usage() << " bytes\n";
+		cooccurrences.print_top(10, result);
+	}
+	
+	if (::options.index_path != NULL) {
+		segments.print_state();
+		std::vector<std::uint32_t> found;
+		for (const std::string& q : ::options.queries) {
+			segments.lines(q.data(), q.size(), found);
+			std::cout << "  '" << q << "' lines (" << found.size() << ")";
+			for (std::size_t i = 0; i < found.size() && i < 10; i++) {
+				std::uint32_t file_line = 0;
+				std::string name = segments.locate(found[i], file_line);
+				std::cout << " " << name << ":" << file_line;
+			}
+			std::cout << (found.size() > 10 ? " ...\n" : "\n");
+		}
+	}
+	
+	if (::options.trie) {
+		BurstTrie trie;
+		compare_key_stores(result, trie);
+	}
+	
+	if (::options.server_socket != NULL && ::running.load()) {
+		QueryServer server(result);
+		if (server.listen(::options.server_socket)) {
+			std::cout << "serving queries on " << ::options.server_socket 
+				<< ", send SIGINT or SIGTERM to stop\n";
+			server.run(::running);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	
+	const char* patterns_fname = NULL;
+	const char* stopwords_fname = NULL;
+	const char* dictionary_fname = NULL;
+	const char* table_fname = NULL;
+	std::size_t memory_budget = 0;
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "PHTNUVMbg:w:W:i:xp:a:A:Lm:d:c:Cr:S:D:o:f:j:B:t:q:s:l:n:k:")) != -1) {
+		switch (opt) {
+		case 'P':
+			::options.pre_aggregate = false;
+			break;
+		case 'H':
+			::options.perfect_hash = true;
+			break;
+		case 'T':
+			::options.trie = true;
+			break;
+		case 'N':
+			::options.normalize = true;
+			break;
+		case 'U':
+			::options.unicode = true;
+			break;
+		case 'b':
+			::options.text_benchmark = true;
+			break;
+		case 'V':
+			::options.compare = true;
+			break;
+		case 'M':
+			::options.map_reduce = true;
+			break;
+		case 'g':
+			::options.ngram = std::strtoul(optarg, NULL, 10);
+			if (::options.ngram != 2 && ::options.ngram != 3) {
+				std::cerr << "only bigrams and trigrams are supported\n";
+				optind = argc;
+			}
+			break;
+		case 'w':
+			::options.cooccurrence_window = std::strtoul(optarg, NULL, 10);
+			break;
+		case 'W':
+			::options.cooccurrence_max_pairs = std::max(1UL, std::strtoul(optarg, NULL, 10));
+			break;
+		case 'i':
+			::options.index_path = optarg;
+			break;
+		case 'x':
+			::options.fm_index = true;
+			break;
+		case 'p':
+			::options.patterns.push_back(optarg);
+			break;
+		case 'a':
+			patterns_fname = optarg;
+			break;
+		case 'A':
+			if (std::find(Analyzer::Names().begin(), Analyzer::Names().end(), optarg) == Analyzer::Names().end()) {
+				std::cerr << "unknown analyzer " << optarg << std::endl;
+				optind = argc;
+			}
+			::options.analyzers.push_back(optarg);
+			break;
+		case 'L':
+			::options.count_only = true;
+			break;
+		case 'm':
+			memory_budget = std::strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'd':
+			::options.spill_path = optarg;
+			break;
+		case 'c':
+			::options.sketch_width = (std::strtoul(optarg, NULL, 10) << 10) 
+				/ (CountMinSketch::DEPTH * sizeof(std::uint32_t));
+			break;
+		case 'C':
+			::options.sketch_exact = true;
+			break;
+		case 'r':
+			::options.sample_fraction = std::strtod(optarg, NULL);
+			if (::options.sample_fraction <= 0 || ::options.sample_fraction > 1) {
+				std::cerr << "sampled fraction must be in (0, 1]\n";
+				optind = argc;
+			}
+			break;
+		case 'S':
+			stopwords_fname = optarg;
+			break;
+		case 'D':
+			dictionary_fname = optarg;
+			break;
+		case 'o':
+			::options.output_path = optarg;
+			break;
+		case 'f':
+			if (!ResultWriter::ParseFormat(optarg, ::options.output_format)) {
+				std::cerr << "unknown output format " << optarg << std::endl;
+				optind = argc;
+			}
+			break;
+		case 'j':
+			::options.threads = std::strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			::options.table_path = optarg;
+			break;
+		case 't':
+			table_fname = optarg;
+			break;
+		case 'q':
+			::options.queries.push_back(optarg);
+			break;
+		case 's':
+			::options.server_socket = optarg;
+			break;
+		case 'l':
+			::options.load_socket = optarg;
+			break;
+		case 'n':
+			::options.load_requests = std::strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			::options.load_batch = std::max(1UL, std::strtoul(optarg, NULL, 10));
+			break;
+		default:
+			optind = argc; // force usage message
+			break;
+		}
+	}
+	
+	if (table_fname != NULL && argc == optind) {
+		return run_table_file(table_fname, ::options.queries);
+	}
+	
+	if (::options.load_socket != NULL && argc == optind) {
+		return run_query_load(::options.load_socket, 
+			::options.load_requests, ::options.load_batch);
+	}
+	
+	if (argc - optind < 1) {
+		std::cout << "usage: " << argv[0] << " [-P] [-H] [-T] [-N] [-U] [-g n] [-w k [-W pairs]] [-i index-dir] [-m MB [-d spill-dir]] [-c KB [-C]] [-r fraction] [-S stopwords-file] [-D dictionary-file] [-A analyzer]... [-o output-file [-f format]] [-B table-file] [-j threads] [-q word]... [-s socket] <file-to-process>...\n"
+			<< "       " << argv[0] << " -x [-p pattern]... <file-to-process>\n"
+			<< "       " << argv[0] << " -a patterns-file <file-to-process>...\n"
+			<< "       " << argv[0] << " -L <file-to-process>...\n"
+			<< "       " << argv[0] << " -b <file-to-process>...\n"
+			<< "       " << argv[0] << " -V [-N] [-U] [-S stopwords-file] [-D dictionary-file] [-q word]... <first-file> <second-file>\n"
+			<< "       " << argv[0] << " -M [-N] [-U] [-o output-file [-f format]] [-B table-file] [-j threads] [-q word]... <file-to-process>...\n"
+			<< "       " << argv[0] << " -t table-file [-q word]...\n"
+			<< "       " << argv[0] << " -l socket [-n requests] [-k batch]\n"
+			<< "  -P  don't pre-aggregate words before inserting into counters table\n"
+			<< "  -H  build minimal perfect hash over the result table\n"
+			<< "  -T  build trie over the result table, compare its prefix queries with std::map\n"
+			<< "  -N  lowercase the words and split them on punctuation too\n"
+			<< "  -U  split words of UTF-8 text by Unicode whitespace and punctuation\n"
+			<< "  -V  count two files at once, compare their vocabularies and frequencies\n"
+			<< "  -M  count words by map-reduce job: map tasks, hash partitioned shuffle, reduce tasks\n"
+			<< "  -b  benchmark the normalization, UTF-8 tokenization and byte histogram of the files\n"
+			<< "  -g  count n-grams of words too, n is 2 or 3\n"
+			<< "  -w  count co-occurrences of words within window of k words\n"
+			<< "  -W  max number of co-occurring pairs per task, 1048576 by default\n"
+			<< "  -i  add inverted index (word -> line numbers) of the files to the directory\n"
+			<< "  -x  build FM-index of the file instead of counting words\n"
+			<< "  -p  count and locate the pattern with FM-index\n"
+			<< "  -a  count occurrences of the patterns (one per line) instead of words\n"
+			<< "  -A  run the analyzer in the same pass: bytes, chars, lines, word-lengths or patterns (of -a)\n"
+			<< "  -L  count lines and words only, without counting of each word\n"
+			<< "  -m  memory budget (MB) of counting: counters, pre-aggregation and buffers of the tasks, \n"
+			<< "      spill the counters to files when it's exceeded; the merged result and the process itself aren't in it\n"
+			<< "  -d  directory of spill files, /tmp by default\n"
+			<< "  -c  estimate frequencies by Count-Min sketch of given size per task instead of counting\n"
+			<< "  -C  count exactly too and report accuracy of the sketch\n"
+			<< "  -r  read the fraction of randomly chosen chunks, estimate counts with confidence intervals\n"
+			<< "  -S  don't count the words of the file (one per line)\n"
+			<< "  -D  count only the words of the file (one per line)\n"
+			<< "  -o  write the words sorted by count, then by word, to the file\n"
+			<< "  -f  format of the output: text (default), csv or binary\n"
+			<< "  -B  store the result table (with perfect hash, if it's built) in binary format\n"
+			<< "  -t  load the stored table and print the counts of the words\n"
+			<< "  -j  number of threads, hardware concurrency by default\n"
+			<< "  -q  print the count of the word when the counting is finished\n"
+			<< "  -s  serve queries on the socket when the counting is finished\n"
+			<< "  -l  generate load on query server, listening on the socket\n"
+			<< "  -n  number of requests to send, 100000 by default\n"
+			<< "  -k  number of lookups per request, 16 by default\n";
+		std::exit(-1);
+	}
+	
+	if (::options.text_benchmark) {
+		return run_text_benchmark(argv + optind, argc - optind);
+	}
+	
+	AhoCorasick matcher;
+	if (patterns_fname != NULL) {
+		std::ifstream patterns_file(patterns_fname);
+		std::string pattern;
+		while (std::getline(patterns_file, pattern)) {
+			matcher.add(pattern);
+		}
+		if (!patterns_file.eof() || !matcher.compile()) {
+			std::cerr << "couldn't compile patterns from " << patterns_fname << std::endl;
+			std::exit(-1);
+		}
+		std::cout << "patterns " << matcher.patterns_num()
+			<< " automaton states " << matcher.states_num()
+			<< " size " << matcher.memory_usage() << " bytes\n";
+		// the patterns are counted with words, if they are a stage
+		if (std::find(::options.analyzers.begin(), ::options.analyzers.end(), "patterns") != ::options.analyzers.end())
+			::options.stage_matcher = &matcher;
+		else
+			::options.matcher = &matcher;
+	}
+	if (!::options.analyzers.empty() && (::options.fm_index || ::options.matcher != NULL || ::options.count_only 
+		|| ::options.compare || ::options.sample_fraction != 0)) {
+		std::cerr << "analyzers run with counting of words of the whole files only\n";
+		std::exit(-1);
+	}
+	for (const std::string& name : ::options.analyzers) {
+		if (Analyzer::Create(name) == NULL) {
+			std::cerr << "analyzer " << name << " needs patterns (-a)\n";
+			std::exit(-1);
+		}
+	}
+	
+	WordFilter stopwords, dictionary;
+	if (stopwords_fname != NULL || dictionary_fname != NULL) {
+		if (::options.matcher != NULL || ::options.fm_index || ::options.count_only) {
+			std::cerr << "stopwords and dictionary are supported by counting of words only\n";
+			std::exit(-1);
+		}
+		const char* fnames[] = { stopwords_fname, dictionary_fname };
+		WordFilter* filters[] = { &stopwords, &dictionary };
+		for (std::size_t i = 0; i < 2; i++) {
+			if (fnames[i] == NULL)
+				continue;
+			if (!filters[i]->load(fnames[i])) {
+				std::cerr << "couldn't load words from " << fnames[i] << std::endl;
+				std::exit(-1);
+			}
+			report_word_filter(fnames[i], *filters[i]);
+		}
+		::options.stopwords = (stopwords_fname != NULL) ? &stopwords : NULL;
+		::options.dictionary = (dictionary_fname != NULL) ? &dictionary : NULL;
+	}
+	
+	if (sigemptyset(&::sig_set) < 0) {
+		perror("sigemptyset()");
+		std::exit(-1);
+	}
+	
+	// fill the signal's mask and block signals, which we are going to handle
+	std::array<int, 7> sig_nums{ SIGINT, SIGTERM, SIGILL, 
+								SIGFPE, SIGBUS, SIGTRAP, SIGABRT };
+	for (std::size_t i = 0; i < sig_nums.size(); i++) {
+		if (sigaddset(&::sig_set, sig_nums[i]) < 0) {
+			perror("sigaddset()");
+			std::cerr << "couldn't add signal " << sig_nums[i] << " to mask\n";
+			std::exit(-1);
+		}
+	}
+	
+	sigset_t original_sig_set;	
+	if (sigprocmask(SIG_BLOCK, &sig_set, &original_sig_set) != 0) {
+		perror("sigprocmask()");
+		std::cerr << "couldn't block signals\n";
+		std::exit(-1);
+	}
+		
+	// start thread, responsible for receiving and handling of signals
+	pthread_t sig_handle_worker;
+	if (pthread_create(&sig_handle_worker, NULL, sig_handle_worker_routine, NULL) != 0) {
+		perror("pthread_create()");
+		std::cerr << "couldn't create thread to handle signals\n";
+		std::exit(-1);
+	}
+	
+
+	unsigned int num_of_threads = (::options.threads != 0) ? ::options.threads : std::thread::hardware_concurrency();
+	std::cout << "able to run " << num_of_threads << " concurrent threads\n";
+	
+	boost::threadpool::pool tp(num_of_threads);	
+	
+	if (memory_budget != 0) {
+		if (::options.index_path != NULL) {
+			std::cerr << "memory budget isn't supported with inverted index\n";
+			std::exit(-1);
+		}
+		// the budget is shared by the tasks running at once
+		::options.memory_budget = memory_budget / std::max(1U, std::min<unsigned>(num_of_threads, 4));
+		if (::options.memory_budget < 2 * SpillFiles::BUFFERS_SIZE) {
+			std::cerr << "memory budget is too small, each task running at once needs at least "
+				<< (2 * SpillFiles::BUFFERS_SIZE + (1 << 20) - 1) / (1 << 20) << " MB\n";
+			std::exit(-1);
+		}
+	}
+	
+	if (::options.sketch_width != 0 && (::options.ngram != 0 || ::options.cooccurrence_window != 0 
+		|| ::options.index_path != NULL || ::options.memory_budget != 0)) {
+		std::cerr << "count-min sketch isn't supported with n-grams, co-occurrences, index or memory budget\n";
+		std::exit(-1);
+	}
+	if ((::options.output_path != NULL || ::options.table_path != NULL) && (::options.sample_fraction != 0 
+		|| (::options.sketch_width != 0 && !::options.sketch_exact))) {
+		std::cerr << "output of the result isn't supported with sampling or sketch only\n";
+		std::exit(-1);
+	}
+	if (::options.sample_fraction != 0 && (::options.ngram != 0 || ::options.cooccurrence_window != 0 
+		|| ::options.index_path != NULL || ::options.memory_budget != 0 || ::options.sketch_width != 0)) {
+		std::cerr << "sampling isn't supported with n-grams, co-occurrences, index, memory budget or sketch\n";
+		std::exit(-1);
+	}
+	
+	if (::options.map_reduce && (::options.ngram != 0 || ::options.cooccurrence_window != 0 
+		|| ::options.index_path != NULL || ::options.memory_budget != 0 || ::options.sketch_width != 0 
+		|| ::options.sample_fraction != 0 || ::options.fm_index || ::options.matcher != NULL || ::options.count_only
+		|| ::options.compare || !::options.analyzers.empty() || ::options.stopwords != NULL || ::options.dictionary != NULL)) {
+		std::cerr << "map-reduce job counts words only\n";
+		std::exit(-1);
+	}
+	if (::options.compare && (argc - optind != 2 || ::options.ngram != 0 || ::options.cooccurrence_window != 0 
+		|| ::options.index_path != NULL || ::options.memory_budget != 0 || ::options.sketch_width != 0 
+		|| ::options.sample_fraction != 0 || ::options.fm_index || ::options.matcher != NULL || ::options.count_only)) {
+		std::cerr << "comparison of vocabularies needs two files and counting of words only\n";
+		std::exit(-1);
+	}
+	
+	// the modes and the sketch are analyzers of the tasks, the first mode 
+	// reading the files replaces counting of the words
+	if (::options.matcher != NULL)
+		::options.analyzers.push_back("pattern-counts");
+	else if (::options.count_only)
+		::options.analyzers.push_back("count-only");
+	else if (::options.fm_index)
+		::options.analyzers.push_back("fm-index");
+	else if (::options.sketch_width != 0)
+		::options.analyzers.push_back("sketch");
+	bool reads_range = false;
+	for (const std::string& name : ::options.analyzers) {
+		reads_range = reads_range || Analyzer::Create(name)->reads_range();
+	}
+	
+	IndexSegments segments(::options.index_path != NULL ? ::options.index_path : "");
+	if (::options.index_path != NULL && !segments.open()) {
+		std::cerr << "couldn't open index " << ::options.index_path << std::endl;
+		std::exit(-1);
+	}
+
+	std::cout << " PID = " << getpid() 
+		<< " main thread TID " << pthread_self() << std::endl;
+
+	// merged with the results of tasks: the partitions of spilled counters,
+	// or of the map-reduce job
+	std::vector<FrozenTable> partitions;
+	if (::options.map_reduce)
+		count_words_by_map_reduce(tp, argv + optind, argc - optind, 4 * num_of_threads, partitions);
+	
+	// each input file is processed by a batch of tasks, each task processes
+	// its own part of the file, the results of all tasks are merged.
+	// tasks are passed to the pool by reference, to keep their results
+	static const std::size_t TASKS_NUM = 4;
+	std::deque<Task> tasks;
+	std::vector<std::size_t> batches; // the first task of each file
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int f = optind; f < argc && ::running.load() && !::options.map_reduce; f++) {
+		const char* fname = argv[f];
+		struct stat file_stat;
+		if (stat(fname, &file_stat) != 0) {
+			perror("stat()");
+			std::cerr << "couldn't get size of file " << fname << std::endl;
+			continue;
+		}
+		
+		const std::size_t batch = tasks.size();
+		batches.push_back(batch);
+		// FM-index is built over the whole file by single task
+		for (std::size_t i = 0; i < (::options.fm_index ? 1 : TASKS_NUM); i++) {
+			tasks.emplace_back(fname, file_stat.st_size * i / TASKS_NUM, file_stat.st_size * (i + 1) / TASKS_NUM);
+		}
+		for (std::size_t i = batch; i < tasks.size(); i++) {
+			tp.schedule(boost::ref(tasks[i]));
+		}
+		// the compared files are counted at once
+		if (!::options.compare)
+			wait_for_tasks(tasks, batch);
+		
+		if (::options.index_path != NULL && ::running.load()) {
+			flush_index_segment(segments, fname, tasks, batch);
+			// merges are running on pool's threads, while next files are processed
+			tp.schedule([&segments]() { segments.merge(); });
+		}
+	}
+	
+	if (::options.compare)
+		wait_for_tasks(tasks, 0);
+	std::cout << "awaiting untill work tasks finished...\n";
+	tp.wait();
+	
+	if (::options.compare) {
+		if (batches.size() == 2 && ::running.load()) {
+			std::vector<const FrozenTable*> results[2];
+			for (std::size_t i = 0; i < tasks.size(); i++) {
+				results[i < batches[1] ? 0 : 1].push_back(&tasks[i].result());
+			}
+			FrozenTable first = FrozenTable::Merge(results[0]);
+			FrozenTable second = FrozenTable::Merge(results[1]);
+			compare_vocabularies(tp, 4 * num_of_threads, argv[optind], first, argv[optind + 1], second);
+		}
+		tasks.clear();
+	}
+	
+	// the analyzers, which read the files, have no word table to report
+	if (reads_range)
+		report_analyzers(tasks, NULL, seconds_since(start));
+	else if (!::options.compare)
+		report_word_counts(tp, 4 * num_of_threads, tasks, partitions, segments, seconds_since(start));
+	
+	if (::running.load()) {
+		// signals handler thread still working
+		if (pthread_kill(sig_handle_worker, SIGTERM) != 0) {
+			perror("pthread_kill()");
+			std::cerr << "couldn't send signal to terminate thread\n";
+		}
+	}
+	
+	if (pthread_join(sig_handle_worker, NULL) != 0) {
+		perror("pthread_join()");
+		std::cerr << "couldn't join signals handler thread\n";
+	}
+	std::cout << "done\n";
+	
+	// restore original signals mask
+	if (sigprocmask(SIG_SETMASK, &original_sig_set, NULL) != 0) {
+		perror("sigprocmask()");
+		std::cerr << "couldn't restore signals mask\n";
+		std::exit(-1);
+	}
+	
+	return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Analyzer implementation
+std::unique_ptr<Analyzer> Analyzer::Create(const std::string& name) {
+	if (name == "bytes")
+		return std::unique_ptr<Analyzer>(new ByteHistogram());
+	if (name == "chars")
+		return std::unique_ptr<Analyzer>(new CharHistogram());
+	if (name == "lines")
+		return std::unique_ptr<Analyzer>(new LineLengths());
+	if (name == "word-lengths")
+		return std::unique_ptr<Analyzer>(new WordLengths());
+	if (name == "patterns" && ::options.stage_matcher != NULL)
+		return std::unique_ptr<Analyzer>(new PatternMatches(*::options.stage_matcher));
+	// the modes of the options, they aren't chosen by -A
+	if (name == "pattern-counts" && ::options.matcher != NULL)
+		return std::unique_ptr<Analyzer>(new PatternCounts(*::options.matcher));
+	if (name == "count-only")
+		return std::unique_ptr<Analyzer>(new LineWordCounts());
+	if (name == "fm-index")
+		return std::unique_ptr<Analyzer>(new FmIndexes());
+	if (name == "sketch" && ::options.sketch_width != 0)
+		return std::unique_ptr<Analyzer>(new WordSketch(::options.sketch_width));
+	return NULL;
+}
+
+const std::vector<std::string>& Analyzer::Names() {
+	static const std::vector<std::string> names = { "bytes", "chars", "lines", "word-lengths", "patterns" };
+	return names;
+}
+
+void ByteHistogram::add(const char* data, std::size_t size) {
+	const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(data);
+	std::uint32_t* c0 = _lanes[0];
+	std::uint32_t* c1 = _lanes[1];
+	std::uint32_t* c2 = _lanes[2];
+	std::uint32_t* c3 = _lanes[3];
+	while (size != 0) {
+		std::size_t n = (size < FLUSH_BYTES - _pending) ? size : FLUSH_BYTES - _pending;
+		std::size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			std::uint64_t w;
+			std::memcpy(&w, p + i, 8);
+			c0[w & 0xff]++;
+			c1[(w >> 8) & 0xff]++;
+			c2[(w >> 16) & 0xff]++;
+			c3[(w >> 24) & 0xff]++;
+			c0[(w >> 32) & 0xff]++;
+			c1[(w >> 40) & 0xff]++;
+			c2[(w >> 48) & 0xff]++;
+			c3[w >> 56]++;
+		}
+		for (; i < n; i++) {
+			_lanes[i % LANES_NUM][p[i]]++;
+		}
+		p += n;
+		size -= n;
+		_pending += n;
+		if (_pending == FLUSH_BYTES)
+			flush();
+	}
+}
+
+std::uint64_t ByteHistogram::count(std::uint8_t c) const {
+	std::uint64_t n = _counts[c];
+	for (std::size_t k = 0; k < LANES_NUM; k++) {
+		n += _lanes[k][c];
+	}
+	return n;
+}
+
+void ByteHistogram::flush() {
+	for (std::size_t c = 0; c < 256; c++) {
+		_counts[c] = count(static_cast<std::uint8_t>(c));
+	}
+	std::memset(_lanes, 0, sizeof(_lanes));
+	_pending = 0;
+}
+
+void ByteHistogram::merge(const Analyzer& other) {
+	const ByteHistogram& h = static_cast<const ByteHistogram&>(other);
+	for (std::size_t c = 0; c < 256; c++) {
+		_counts[c] += h.count(static_cast<std::uint8_t>(c));
+	}
+}
+
+void ByteHistogram::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	std::uint64_t counts[256];
+	std::uint64_t total = 0, ascii = 0, distinct = 0;
+	std::vector<std::uint32_t> order;
+	for (std::uint32_t i = 0; i < 256; i++) {
+		counts[i] = count(static_cast<std::uint8_t>(i));
+		total += counts[i];
+		if (i < 0x80)
+			ascii += counts[i];
+		if (counts[i] != 0) {
+			distinct++;
+			order.push_back(i);
+		}
+	}
+	std::size_t top = std::min<std::size_t>(10, order.size());
+	std::partial_sort(order.begin(), order.begin() + top, order.end(), 
+		[&counts](std::uint32_t a, std::uint32_t b) { 
+			return counts[a] > counts[b] || (counts[a] == counts[b] && a < b); 
+		});
+	std::cout << "result: analyzer bytes " << total 
+		<< " distinct " << distinct
+		<< " ascii " << ascii << std::endl;
+	for (std::size_t i = 0; i < top; i++) {
+		std::cout << "  0x" << std::hex << std::setw(2) << std::setfill('0') << order[i] 
+			<< std::dec << std::setfill(' ') << " " << counts[order[i]] << std::endl;
+	}
+}
+
+void CharHistogram::add_text(const char* data, std::size_t size, bool /*line_end*/) {
+	// the pieces of lines are cut at the beginnings of sequences
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+	std::size_t i = 0;
+	while (i < size) {
+		std::size_t j = i;
+#ifdef __SSE2__
+		for (; j + 16 <= size; j += 16) {
+			int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + j)));
+			if (mask != 0) {
+				j += __builtin_ctz(mask);
+				break;
+			}
+		}
+#endif
+		while (j < size && s[j] < 0x80)
+			j++;
+		_ascii.add(data + i, j - i);
+		if (j == size)
+			break;
+		std::size_t len = Utf8Tokenizer::SequenceLength(s + j, size - j);
+		if (len == 0) {
+			_invalid++;
+			i = j + 1;
+			continue;
+		}
+		std::uint32_t cp = s[j] & (0x7f >> len);
+		for (std::size_t k = 1; k < len; k++) {
+			cp = (cp << 6) | (s[j + k] & 0x3f);
+		}
+		_others[cp]++;
+		i = j + len;
+	}
+}
+
+void CharHistogram::merge(const Analyzer& other) {
+	const CharHistogram& h = static_cast<const CharHistogram&>(other);
+	_ascii.merge(h._ascii);
+	for (const auto& entry : h._others) {
+		_others[entry.first] += entry.second;
+	}
+	_invalid += h._invalid;
+}
+
+void CharHistogram::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	std::vector<std::pair<std::uint32_t, std::uint64_t>> counts(_others.begin(), _others.end());
+	std::uint64_t ascii = 0;
+	for (std::uint32_t c = 0; c < 0x80; c++) {
+		std::uint64_t n = _ascii.count(static_cast<std::uint8_t>(c));
+		if (n != 0)
+			counts.emplace_back(c, n);
+		ascii += n;
+	}
+	std::uint64_t total = ascii;
+	for (const auto& entry : _others) {
+		total += entry.second;
+	}
+	std::size_t top = std::min<std::size_t>(20, counts.size());
+	std::partial_sort(counts.begin(), counts.begin() + top, counts.end(), 
+		[](const std::pair<std::uint32_t, std::uint64_t>& a, const std::pair<std::uint32_t, std::uint64_t>& b) { 
+			return a.second > b.second || (a.second == b.second && a.first < b.first); 
+		});
+	std::cout << "result: analyzer chars " << total 
+		<< " distinct " << counts.size()
+		<< " non-ASCII " << total - ascii
+		<< " invalid bytes " << _invalid << std::endl;
+	for (std::size_t i = 0; i < top; i++) {
+		std::cout << "  U+" << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << counts[i].first 
+			<< std::dec << std::nouppercase << std::setfill(' ') << " " << counts[i].second << std::endl;
+	}
+}
+
+void LineLengths::add_text(const char* /*data*/, std::size_t size, bool line_end) {
+	_current += size;
+	if (!line_end)
+		return;
+	std::size_t k = 0;
+	for (std::uint64_t n = _current; n != 0; n >>= 1) {
+		k++;
+	}
+	_buckets[k]++;
+	_total += _current;
+	_max = std::max(_max, _current);
+	_current = 0;
+}
+
+void LineLengths::merge(const Analyzer& other) {
+	const LineLengths& l = static_cast<const LineLengths&>(other);
+	for (std::size_t i = 0; i < BUCKETS_NUM; i++) {
+		_buckets[i] += l._buckets[i];
+	}
+	_total += l._total;
+	_max = std::max(_max, l._max);
+}
+
+void LineLengths::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	std::uint64_t lines = 0;
+	for (std::size_t i = 0; i < BUCKETS_NUM; i++) {
+		lines += _buckets[i];
+	}
+	std::cout << "result: analyzer lines " << lines
+		<< " mean length " << (lines != 0 ? static_cast<double>(_total) / lines : 0.0)
+		<< " max " << _max << std::endl;
+	for (std::size_t i = 0; i < BUCKETS_NUM; i++) {
+		if (_buckets[i] == 0)
+			continue;
+		std::uint64_t low = (i != 0) ? std::uint64_t(1) << (i - 1) : 0;
+		std::uint64_t high = (i != 0) ? (low << 1) - 1 : 0;
+		std::cout << "  [" << low << ", " << high << "] " << _buckets[i] << std::endl;
+	}
+}
+
+void WordLengths::merge(const Analyzer& other) {
+	const WordLengths& l = static_cast<const WordLengths&>(other);
+	for (std::size_t i = 0; i <= MAX_LENGTH; i++) {
+		_counts[i] += l._counts[i];
+	}
+}
+
+void WordLengths::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	std::uint64_t words = 0, bytes = 0;
+	for (std::size_t i = 0; i <= MAX_LENGTH; i++) {
+		words += _counts[i];
+		bytes += i * _counts[i];
+	}
+	std::cout << "result: analyzer word-lengths words " << words
+		<< " mean length " << (words != 0 ? static_cast<double>(bytes) / words : 0.0)
+		<< " (" << MAX_LENGTH << " for the longer ones)" << std::endl;
+	for (std::size_t i = 0; i <= MAX_LENGTH; i++) {
+		if (_counts[i] != 0)
+			std::cout << "  " << i << (i == MAX_LENGTH ? "+ " : " ") << _counts[i] << std::endl;
+	}
+}
+
+PatternMatches::PatternMatches(const AhoCorasick& matcher)
+	: _matcher(matcher), _state(matcher.start()), _visits(matcher.states_num(), 0)
+	{
+	}
+
+void PatternMatches::add_text(const char* data, std::size_t size, bool line_end) {
+	// the patterns don't span lines, as they are lines themselves
+	_state = _matcher.scan(data, size, _state, _visits.data());
+	if (line_end)
+		_state = _matcher.start();
+}
+
+void PatternMatches::merge(const Analyzer& other) {
+	const PatternMatches& m = static_cast<const PatternMatches&>(other);
+	for (std::size_t i = 0; i < _visits.size(); i++) {
+		_visits[i] += m._visits[i];
+	}
+}
+
+void PatternMatches::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	std::cout << "result: analyzer ";
+	print_top_patterns(_matcher, _visits);
+	std::cout << std::endl;
+	print_top_patterns(_matcher, _visits, 20);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Task implementation
+Task::Task(const char* fname, std::uint64_t begin, std::uint64_t end) 
+	: _fname(fname), _begin(begin), _end(end), _finished(false), _tid(0), _start(clock()), _line_count(0), _lines_read(0),
+	_ngrams(::options.ngram), 
+	_cooccurrences(::options.cooccurrence_window, ::options.cooccurrence_max_pairs),
+	_bytes_scanned(0),
+	_words_counted(0),
+	_invalid_lines(0),
+	_words_filtered(0),
+	_filter_false_positives(0),
+	_spill_check_size(0),
+	_spill_disabled(false),
+	_job(NULL),
+	_job_index(0)
+	{
+		if (::options.sample_fraction != 0)
+			_sampler.plan(begin, end, ::options.sample_fraction, static_cast<std::uint32_t>(begin) ^ 2463534242U);
+		for (const std::string& name : ::options.analyzers) {
+			_analyzers.push_back(Analyzer::Create(name));
+		}
+	}
+
+Task::Task(MapReduceJob& job, std::size_t index, const char* fname, std::uint64_t begin, std::uint64_t end)
+	: Task(fname, begin, end)
+	{
+		_job = &job;
+		_job_index = index;
+	}
+	
+Task::~Task()
+{
+}
+
+void Task::operator()()
+{
+	// the flag is set on cancellation too, when the stack is unwound
+	struct FinishedFlag {
+		std::atomic<bool>& flag;
+		~FinishedFlag() { flag.store(true); }
+	} finished_flag = { _finished };
+	
+	// the task has been scheduled, but the work is cancelled already
+	if (!::running.load())
+		return;
+	
+	TasksRegistry registry_entry(this);
+	
+	_tid = pthread_self();
+	if (_job != NULL) {
+		run_job();
+		return;
+	}
+	for (const std::unique_ptr<Analyzer>& a : _analyzers) {
+		if (!a->reads_range())
+			continue;
+		_start = clock();
+		a->read_range(_fname, _begin, _end, _line_count, _lines_read);
+		a->print_task(_tid, elapsed_time());
+		return;
+	}
+	
+	assert(_fname != NULL);	
+	std::ifstream in_file(_fname);
+	
+	if (!in_file) {
+		std::cerr << "couldn't open file " << _fname
+			<< " premature finishing of task, TID = " << _tid << std::endl;
+		return;
+	}
+		
+	// the word is hashed once for both filters
+	std::function<bool (const std::string&)> filtered_out = [this](const std::string& w) {
+		std::uint64_t h = hash_bytes(w.data(), w.size());
+		const WordFilter* filters[] = { ::options.stopwords, ::options.dictionary };
+		for (const WordFilter* filter : filters) {
+			if (filter == NULL)
+				continue;
+			bool found = filter->may_contain(h);
+			if (found && !filter->verify(h, w.data(), w.size())) {
+				_filter_false_positives++;
+				found = false;
+			}
+			if (found == (filter == ::options.stopwords))
+				return true;
+		}
+		return false;
+	};
+	
+	bool filtering = (::options.stopwords != NULL || ::options.dictionary != NULL);
+	// the analyzers may count the words instead of the table
+	bool count_table = true;
+	for (const std::unique_ptr<Analyzer>& a : _analyzers) {
+		count_table = count_table && a->needs_table();
+	}
+	std::function<void (const std::string&)> count_word = [this, filtering, count_table, &filtered_out](const std::string& w) {
+		if (filtering && filtered_out(w)) {
+			_words_filtered++;
+			return;
+		}
+		_words_counted++;
+		for (const std::unique_ptr<Analyzer>& a : _analyzers) {
+			a->add_word(w);
+		}
+		if (_ngrams.n() != 0 || _cooccurrences.window() != 0 || ::options.index_path != NULL) {
+			std::uint32_t id = _vocabulary.id(w);
+			if (_ngrams.n() != 0)
+				_ngrams.add(id);
+			if (_cooccurrences.window() != 0)
+				_cooccurrences.add(id);
+			if (::options.index_path != NULL)
+				_index.add(id, static_cast<std::uint32_t>(_lines_read));
+		}
+		if (!count_table)
+			return;
+		if (::options.pre_aggregate) {
+			_pre_aggregator.add(w, _word_counters);
+			return;
+		}
+		_word_counters.add(w);
+	};
+	
+	// the piece of line ends after a space or with the line
+	std::function<void (const char*, std::size_t)> split_line_and_count_words =
+			[this, &count_word](const char* data, std::size_t size) {
+				std::string word;
+				if (::options.unicode) {
+					if (!Utf8Tokenizer::Validate(data, size))
+						_invalid_lines++;
+					Utf8Tokenizer::Split(data, size, 
+						[&count_word, &word](const char* w, std::size_t len) {
+							word.assign(w, len);
+							count_word(word);
+						});
+					return;
+				}
+				// as std::getline splits: the empty words between spaces 
+				// are counted, but there is no word after the last space
+				const char* end = data + size;
+				while (data != end) {
+					const char* sp = static_cast<const char*>(std::memchr(data, ' ', end - data));
+					word.assign(data, (sp != NULL ? sp : end) - data);
+					// punctuation is replaced by spaces, it doesn't make words
+					if (!word.empty() || !::options.normalize)
+						count_word(word);
+					data = (sp != NULL) ? sp + 1 : end;
+				}
+			};
+	
+	_line_count = 0;
+	_lines_read = 0;
+	_start = clock();
+	
+	BlockScanner scanner(_fname);
+	bool line_open = false, line_empty = true;
+	BlockScanner::Visitor count_piece = 
+			[this, &split_line_and_count_words, &line_open, &line_empty](char* data, std::size_t size, bool line_end) {
+				if (!line_open) {
+					_lines_read++;
+					line_open = true;
+					line_empty = true;
+				}
+				for (const std::unique_ptr<Analyzer>& a : _analyzers) {
+					a->add_text(data, size, line_end);
+				}
+				if (size != 0) {
+					if (line_empty)
+						_line_count++;
+					line_empty = false;
+					if (::options.normalize)
+						normalize_text(data, size);
+					split_line_and_count_words(data, size);
+					if (::options.memory_budget != 0 && !_spill_disabled)
+						check_memory_budget();
+				}
+				line_open = !line_end;
+			};
+	
+	// counts words of the lines, which begin in range [begin, end)
+	std::function<void (std::uint64_t, std::uint64_t)> count_lines =
+			[this, &scanner, &count_piece](std::uint64_t begin, std::uint64_t end) {
+				if (!scanner.scan(begin, end, count_piece)) {
+					std::cerr << "couldn't read file " << _fname << " TID = " << _tid << std::endl;
+				}
+				_pre_aggregator.flush(_word_counters);
+			};
+	
+	if (_sampler.planned() != 0) {
+		// the counters of the sampled chunks are summed up here,
+		// the counters table keeps the counts of current chunk
+		WordCounters sample;
+		for (std::size_t i = 0; i < _sampler.planned() && ::running.load(); i++) {
+			count_lines(_sampler.chunk_begin(i), _sampler.chunk_end(i));
+			_sampler.add_chunk(_word_counters, sample);
+		}
+		_word_counters.swap(sample);
+	} else {
+		count_lines(_begin, _end);
+	}
+	
+	// once something is spilled, all the counters are merged from files
+	if (_spill_files.runs() != 0 && !_word_counters.empty() 
+		&& !_spill_files.spill(::options.spill_path, _word_counters.narrow())) {
+		std::cerr << "couldn't spill counters to " << ::options.spill_path << " TID = " << _tid << std::endl;
+	}
+	_result = FrozenTable::Freeze(_word_counters);
+	_word_counters.clear();
+
+	std::uint64_t words_total = count_table ? _result.words_total() + _spill_files.words_total() : _words_counted;
 	std::cout << "task finished, TID = " << tid()
 		<< " lines processed " << line_count()
 		<< " number of words " << words_total
 		<< " elapsed time " << elapsed_time() << " sec\n";
+	if (::options.pre_aggregate && _pre_aggregator.table_ops() != 0) {
+		std::cout << "pre-aggregation, TID = " << tid()
+			<< " tokens " << _pre_aggregator.tokens()
+			<< " counters table operations " << _pre_aggregator.table_ops()
+			<< " reduction factor " 
+			<< static_cast<double>(_pre_aggregator.tokens()) / _pre_aggregator.table_ops()
+			<< std::endl;
+	}
+	for (const std::unique_ptr<Analyzer>& a : _analyzers) {
+		a->print_task(tid(), elapsed_time());
+	}
+	if (::options.stopwords != NULL || ::options.dictionary != NULL) {
+		std::cout << "word filters, TID = " << tid()
+			<< " words dropped " << _words_filtered
+			<< " Bloom filter false positives " << _filter_false_positives
+			<< std::endl;
+	}
+	if (_invalid_lines != 0) {
+		std::cout << "invalid UTF-8, TID = " << tid()
+			<< " lines " << _invalid_lines << std::endl;
+	}
+	if (_sampler.planned() != 0) {
+		ChunkSampler::Estimate total = _sampler.words_total();
+		std::cout << "sampling, TID = " << tid()
+			<< " chunks " << _sampler.sampled() << " of " << _sampler.chunks_num()
+			<< " estimated number of words " << static_cast<std::uint64_t>(total.value)
+			<< " +/- " << static_cast<std::uint64_t>(total.margin())
+			<< std::endl;
+	}
+	if (_spill_files.runs() != 0) {
+		std::cout << "spilled counters, TID = " << tid()
+			<< " runs " << _spill_files.runs()
+			<< " bytes " << _spill_files.bytes()
+			<< " write time " << _spill_files.write_time() << " sec\n";
+	}
+	if (_ngrams.n() != 0) {
+		std::cout << "n-grams, TID = " << tid()
+			<< " n " << _ngrams.n()
+			<< " counted " << _ngrams.ngrams()
+			<< " distinct " << _ngrams.distinct()
+			<< " memory " << _ngrams.memory_usage() + _vocabulary.memory_usage() << " bytes"
+			<< " n-grams per second " << _ngrams.ngrams() / elapsed_time()
+			<< std::endl;
+	}
+	if (_cooccurrences.window() != 0) {
+		std::cout << "co-occurrences, TID = " << tid()
+			<< " window " << _cooccurrences.window()
+			<< " pairs " << _cooccurrences.pairs()
+			<< " distinct " << _cooccurrences.distinct()
+			<< " pruned " << _cooccurrences.pruned()
+			<< " memory " << _cooccurrences.memory_usage() << " bytes"
+			<< std::endl;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Vocabulary implementation
+std::uint32_t Vocabulary::id(const std::string& w) {
+	std::unordered_map<std::string, std::uint32_t>::iterator it = _ids.find(w);
+	if (it == _ids.end()) {
+		std::uint32_t id = static_cast<std::uint32_t>(_ids.size());
+		it = _ids.emplace(w, id).first;
+	}
+	return it->second;
+}
+
+std::vector<std::uint32_t> Vocabulary::translate(const FrozenTable& table) const {
+	std::vector<std::uint32_t> ids(_ids.size());
+	for (const std::pair<const std::string, std::uint32_t>& p : _ids) {
+		ids[p.second] = static_cast<std::uint32_t>(table.find(p.first));
+	}
+	return ids;
+}
+
+std::size_t Vocabulary::memory_usage() const {
+	// approximation for the nodes of std::unordered_map
+	std::size_t size = _ids.bucket_count() * sizeof(void*)
+		+ _ids.size() * (sizeof(std::pair<const std::string, std::uint32_t>) + 2 * sizeof(void*));
+	for (const std::pair<const std::string, std::uint32_t>& p : _ids) {
+		if (p.first.capacity() > 15)
+			size += p.first.capacity() + 1;
+	}
+	return size;
+}
+
+void Task::run_job() {
+	_start = clock();
+	if (_fname == NULL) {
+		_job->reduce(_job_index);
+		return;
+	}
+	
+	BlockScanner scanner(_fname);
+	bool line_open = false, line_empty = true;
+	BlockScanner::Visitor map_piece = 
+			[this, &line_open, &line_empty](char* data, std::size_t size, bool line_end) {
+				if (!line_open) {
+					_lines_read++;
+					line_open = true;
+					line_empty = true;
+				}
+				if (size != 0) {
+					if (line_empty)
+						_line_count++;
+					line_empty = false;
+					_bytes_scanned += size;
+				}
+				_job->map(_job_index, data, size, line_end);
+				line_open = !line_end;
+			};
+	if (!scanner.scan(_begin, _end, map_piece)) {
+		std::cerr << "couldn't read file " << _fname << " TID = " << _tid << std::endl;
+	}
+	_job->finish_map(_job_index);
+}
+
+void Task::check_memory_budget() {
+	if (_word_counters.size() < _spill_check_size)
+		return;
+	const std::size_t budget = ::options.memory_budget - SpillFiles::BUFFERS_SIZE;
+	std::size_t used = (_word_counters.size() + _word_counters.wide().size()) * SpillFiles::COUNTER_NODE_SIZE
+		+ _pre_aggregator.memory_usage();
+	for (const std::pair<const std::string, std::uint32_t>& p : _word_counters.narrow()) {
+		// not in the small string buffer
+		if (p.first.capacity() > 15)
+			used += p.first.capacity() + 1;
+	}
+	for (const std::pair<const std::string, std::uint64_t>& p : _word_counters.wide()) {
+		if (p.first.capacity() > 15)
+			used += p.first.capacity() + 1;
+	}
+	if (used >= budget) {
+		if (!_spill_files.spill(::options.spill_path, _word_counters.narrow())) {
+			std::cerr << "couldn't spill counters to " << ::options.spill_path << " TID = " << _tid << std::endl;
+			_spill_disabled = true;
+			return;
+		}
+		// the wide counters and the pre-aggregation table stay
+		used = _word_counters.wide().size() * SpillFiles::COUNTER_NODE_SIZE + _pre_aggregator.memory_usage();
+	}
+	// the counters can't exceed the budget untill the next check, 
+	// if the new words are twice as large as the average one
+	std::size_t average = (_word_counters.size() == 0) ? SpillFiles::COUNTER_NODE_SIZE : used / _word_counters.size();
+	_spill_check_size = _word_counters.size() 
+		+ std::max<std::size_t>(1, (budget > used ? budget - used : 0) / (2 * average));
+}
+
+////////////////////////////////////////////////////////////////////////
+// PatternCounts implementation
+PatternCounts::PatternCounts(const AhoCorasick& matcher)
+	: _matcher(matcher), _visits(matcher.states_num(), 0), _bytes_scanned(0)
+	{
+	}
+
+void PatternCounts::read_range(const char* fname, std::uint64_t begin, std::uint64_t end,
+	std::size_t& /*line_count*/, std::size_t& /*lines_read*/) {
+	// the occurrences ending in the range belong to the task, so
+	// the automaton is fed with the preceding bytes of the longest pattern
+	std::uint64_t overlap = std::min<std::uint64_t>(begin, _matcher.max_length() - 1);
+	ChunkReader reader(fname, begin - overlap, end);
+	if (!reader.open()) {
+		std::cerr << "couldn't open file " << fname
+			<< " premature finishing of task, TID = " << pthread_self() << std::endl;
+		return;
+	}
+	std::uint32_t state = _matcher.start();
+	const char* data = NULL;
+	std::size_t size = 0;
+	while (reader.next(data, size)) {
+		std::size_t skip = 0;
+		if (reader.offset() < begin)
+			skip = std::min<std::uint64_t>(size, begin - reader.offset());
+		state = _matcher.advance(data, skip, state);
+		state = _matcher.scan(data + skip, size - skip, state, _visits.data());
+		_bytes_scanned += size - skip;
+	}
+	if (reader.failed()) {
+		std::cerr << "couldn't read file " << fname << " TID = " << pthread_self() << std::endl;
+	}
+}
+
+void PatternCounts::print_task(pthread_t tid, double elapsed) const {
+	std::cout << "task finished, TID = " << tid
+		<< " bytes scanned " << _bytes_scanned
+		<< " elapsed time " << elapsed << " sec\n";
+}
+
+void PatternCounts::merge(const Analyzer& other) {
+	const PatternCounts& c = static_cast<const PatternCounts&>(other);
+	for (std::size_t i = 0; i < _visits.size(); i++) {
+		_visits[i] += c._visits[i];
+	}
+	_bytes_scanned += c._bytes_scanned;
+}
+
+void PatternCounts::report(const FrozenTable* /*result*/, double elapsed) const {
+	std::cout << "result: ";
+	print_top_patterns(_matcher, _visits);
+	std::cout << " bytes scanned " << _bytes_scanned
+		<< " in " << elapsed << " sec (" << _bytes_scanned / elapsed / (1 << 30) << " GB/s)\n";
+	print_top_patterns(_matcher, _visits, 20);
+}
+
+////////////////////////////////////////////////////////////////////////
+// LineWordCounts implementation
+// bit i of the masks is set if byte i is newline or space, 64 bytes
+static inline void newline_space_masks(const char* data, std::uint64_t& newlines, std::uint64_t& spaces) {
+	newlines = 0;
+	spaces = 0;
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' ');
+	for (unsigned k = 0; k < 4; k++) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * k));
+		newlines |= static_cast<std::uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) & 0xffff) << (16 * k);
+		spaces |= static_cast<std::uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) & 0xffff) << (16 * k);
+	}
+#else
+	for (unsigned k = 0; k < 64; k++) {
+		newlines |= static_cast<std::uint64_t>(data[k] == '\n') << k;
+		spaces |= static_cast<std::uint64_t>(data[k] == ' ') << k;
+	}
+#endif
+}
+
+// counts newlines, non-empty lines and words of the text the same way as
+// the lines are split into words by spaces, prev is the byte before the text.
+// a non-empty line has as many words as spaces, plus one if it doesn't end 
+// with space, so only the newlines need to look at the preceding byte.
+static void count_text(const char* data, std::size_t size, char& prev, 
+	std::uint64_t& newlines, std::uint64_t& lines, std::uint64_t& words) {
+	std::uint64_t prev_nl = (prev == '\n'), prev_sp = (prev == ' ');
+	std::size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		std::uint64_t nl = 0, sp = 0;
+		newline_space_masks(data + i, nl, sp);
+		std::uint64_t line_ends = nl & ~((nl << 1) | prev_nl);
+		newlines += __builtin_popcountll(nl);
+		lines += __builtin_popcountll(line_ends);
+		words += __builtin_popcountll(sp) + __builtin_popcountll(line_ends & ~((sp << 1) | prev_sp));
+		prev_nl = nl >> 63;
+		prev_sp = sp >> 63;
+	}
+	char p = (i == 0) ? prev : data[i - 1];
+	for (; i < size; p = data[i], i++) {
+		if (data[i] == ' ') {
+			words++;
+		} else if (data[i] == '\n') {
+			newlines++;
+			lines += (p != '\n');
+			words += (p != '\n' && p != ' ');
+		}
+	}
+	if (size != 0)
+		prev = data[size - 1];
+}
+
+
+void LineWordCounts::read_range(const char* fname, std::uint64_t begin, std::uint64_t end,
+	std::size_t& line_count, std::size_t& lines_read) {
+	// the lines which begin in the range are counted up to their ends
+	ChunkReader reader(fname, begin != 0 ? begin - 1 : 0, INT64_MAX);
+	if (!reader.open()) {
+		std::cerr << "couldn't open file " << fname
+			<< " premature finishing of task, TID = " << pthread_self() << std::endl;
+		return;
+	}
+	std::uint64_t newlines = 0, lines = 0;
+	// the line, which begins before the range, belongs to previous task
+	bool skip = (begin != 0);
+	char prev = '\n';
+	const char* data = NULL;
+	std::size_t size = 0;
+	bool done = false;
+	while (!done && reader.next(data, size)) {
+		const char* p = data;
+		const char* last = data + size;
+		if (skip) {
+			p = static_cast<const char*>(std::memchr(data, '\n', size));
+			if (p == NULL) {
+				done = (reader.offset() + size >= end);
+				continue;
+			}
+			p++;
+			skip = false;
+		}
+		if (reader.offset() + size >= end) {
+			// p is either a beginning of line or a continuation of the latest one
+			std::uint64_t pos = reader.offset() + (p - data);
+			if (pos >= end && prev == '\n') {
+				last = p;
+				done = true;
+			} else {
+				// the latest line of the range begins at end - 1 at most
+				const char* from = data + (std::max<std::uint64_t>(pos, end - 1) - reader.offset());
+				const char* nl = static_cast<const char*>(std::memchr(from, '\n', last - from));
+				if (nl != NULL) {
+					last = nl + 1;
+					done = true;
+				}
+			}
+		}
+		count_text(p, last - p, prev, newlines, lines, _words);
+		_bytes_scanned += last - p;
+		lines_read = newlines;
+		line_count = lines;
+	}
+	if (reader.failed()) {
+		std::cerr << "couldn't read file " << fname << " TID = " << pthread_self() << std::endl;
+	}
+	// the last line of the file may have no newline
+	if (!done && prev != '\n') {
+		count_text("\n", 1, prev, newlines, lines, _words);
+	}
+	lines_read = newlines;
+	line_count = lines;
+	_lines_read = newlines;
+	_line_count = lines;
+}
+
+void LineWordCounts::print_task(pthread_t tid, double elapsed) const {
+	std::cout << "task finished, TID = " << tid
+		<< " lines processed " << _line_count
+		<< " number of words " << _words
+		<< " elapsed time " << elapsed << " sec\n";
+}
+
+void LineWordCounts::merge(const Analyzer& other) {
+	const LineWordCounts& c = static_cast<const LineWordCounts&>(other);
+	_line_count += c._line_count;
+	_lines_read += c._lines_read;
+	_words += c._words;
+	_bytes_scanned += c._bytes_scanned;
+}
+
+void LineWordCounts::report(const FrozenTable* /*result*/, double elapsed) const {
+	std::cout << "result: lines processed " << _line_count
+		<< " (including empty " << _lines_read << ")"
+		<< " number of words " << _words
+		<< " bytes scanned " << _bytes_scanned
+		<< " in " << elapsed << " sec (" << _bytes_scanned / elapsed / (1 << 30) << " GB/s)\n";
+}
+
+////////////////////////////////////////////////////////////////////////
+// FmIndexes implementation
+void FmIndexes::read_range(const char* fname, std::uint64_t /*begin*/, std::uint64_t /*end*/,
+	std::size_t& /*line_count*/, std::size_t& /*lines_read*/) {
+	std::ifstream in_file(fname);
+	if (!in_file) {
+		std::cerr << "couldn't open file " << fname
+			<< " premature finishing of task, TID = " << pthread_self() << std::endl;
+		return;
+	}
+	std::string text;
+	in_file.seekg(0, std::ios::end);
+	std::uint64_t size = in_file.tellg();
+	if (size > FmIndex::MAX_TEXT_SIZE) {
+		std::cerr << "file " << fname << " is too large for FM-index, TID = " << pthread_self() << std::endl;
+		return;
+	}
+	text.resize(size);
+	in_file.seekg(0);
+	if (size != 0 && !in_file.read(&text[0], size)) {
+		std::cerr << "couldn't read file " << fname << " TID = " << pthread_self() << std::endl;
+		return;
+	}
+	
+	// sample patterns, for benchmark of queries
+	static const std::size_t PATTERNS_NUM = 1000, PATTERN_LENGTH = 8;
+	File file;
+	std::uint32_t rnd = 2463534242U;
+	for (std::size_t i = 0; i < PATTERNS_NUM && size > PATTERN_LENGTH; i++) {
+		rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5;
+		file.samples.push_back(text.substr(rnd % (size - PATTERN_LENGTH), PATTERN_LENGTH));
+	}
+	
+	std::shared_ptr<FmIndex> index(new FmIndex());
+	if (!index->build(text, _sa_time, _bwt_time))
+		return;
+	file.index = index;
+	_files.push_back(file);
+	_text_size = size;
+}
+
+void FmIndexes::print_task(pthread_t tid, double /*elapsed*/) const {
+	if (_files.empty())
+		return;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	std::size_t memory = _files.back().index->memory_usage();
+	std::cout << "fm-index built, TID = " << tid
+		<< " text " << _text_size << " bytes"
+		<< " suffix array " << _sa_time << " sec"
+		<< " bwt and wavelet matrix " << _bwt_time << " sec"
+		<< " (" << _text_size / (_sa_time + _bwt_time) / (1 << 20) << " MB/s)"
+		<< " index " << memory << " bytes"
+		<< " (" << static_cast<double>(memory) / std::max<std::uint64_t>(_text_size, 1) 
+		<< " of text)"
+		<< " peak memory " << usage.ru_maxrss * 1024 << " bytes\n";
+}
+
+void FmIndexes::merge(const Analyzer& other) {
+	const FmIndexes& f = static_cast<const FmIndexes&>(other);
+	_files.insert(_files.end(), f._files.begin(), f._files.end());
+}
+
+void FmIndexes::report(const FrozenTable* /*result*/, double /*elapsed*/) const {
+	for (const File& file : _files) {
+		run_fm_queries(*file.index, file.samples);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// WordSketch implementation
+bool WordSketch::needs_table() const {
+	return ::options.sketch_exact;
+}
+
+void WordSketch::print_task(pthread_t tid, double /*elapsed*/) const {
+	std::cout << "count-min sketch, TID = " << tid
+		<< " words " << _sketch.total()
+		<< " width " << _sketch.width()
+		<< " memory " << _sketch.memory_usage() << " bytes"
+		<< " error bound " << _sketch.error_bound()
+		<< std::endl;
+}
+
+void WordSketch::report(const FrozenTable* result, double /*elapsed*/) const {
+	std::cout << "result: count-min sketch, number of words " << _sketch.total()
+		<< " width " << _sketch.width() << " depth " << CountMinSketch::DEPTH
+		<< " size " << _sketch.memory_usage() << " bytes"
+		<< " error bound " << _sketch.error_bound() << std::endl;
+	for (const std::string& q : ::options.queries) {
+		std::cout << "  '" << q << "' ~" << _sketch.estimate(q) << std::endl;
+	}
+	if (needs_table() && result != NULL && ::running.load()) {
+		report_sketch_accuracy(_sketch, *result);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// NgramCounter implementation
+NgramCounter::NgramCounter(std::size_t n)
+	: _n(n), _filled(0), _ngrams(0)
+	{
+	}
+
+void NgramCounter::add(std::uint32_t id) {
+	_window[0] = _window[1];
+	_window[1] = _window[2];
+	_window[2] = id;
+	if (_filled < _n) {
+		_filled++;
+		if (_filled < _n)
+			return;
+	}
+	_ngrams++;
+	if (_n == 2) {
+		NgramKey<2> key = { { _window[1], _window[2] } };
+		_bigrams.add(key);
+	} else {
+		NgramKey<3> key = { { _window[0], _window[1], _window[2] } };
+		_trigrams.add(key);
+	}
+}
+
+void NgramCounter::merge(const NgramCounter& other, const std::vector<std::uint32_t>& ids) {
+	for (const IntCounterTable<NgramKey<2>>::Slot& slot : other._bigrams.slots()) {
+		if (slot.count == 0)
+			continue;
+		NgramKey<2> key = { { ids[slot.key.ids[0]], ids[slot.key.ids[1]] } };
+		_bigrams.add(key, slot.count);
+	}
+	for (const IntCounterTable<NgramKey<3>>::Slot& slot : other._trigrams.slots()) {
+		if (slot.count == 0)
+			continue;
+		NgramKey<3> key = { { ids[slot.key.ids[0]], ids[slot.key.ids[1]], ids[slot.key.ids[2]] } };
+		_trigrams.add(key, slot.count);
+	}
+	_ngrams += other._ngrams;
+}
+
+template <typename Key>
+static std::vector<typename IntCounterTable<Key>::Slot> top_slots(const IntCounterTable<Key>& t, std::size_t k) {
+	std::vector<typename IntCounterTable<Key>::Slot> top;
+	for (const typename IntCounterTable<Key>::Slot& slot : t.slots()) {
+		if (slot.count != 0)
+			top.push_back(slot);
+	}
+	k = std::min(k, top.size());
+	std::partial_sort(top.begin(), top.begin() + k, top.end(), 
+		[](const typename IntCounterTable<Key>::Slot& a, const typename IntCounterTable<Key>::Slot& b) {
+			return a.count > b.count;
+		});
+	top.resize(k);
+	return top;
+}
+
+void NgramCounter::print_top(std::size_t k, const FrozenTable& table) const {
+	if (_n == 2) {
+		for (const IntCounterTable<NgramKey<2>>::Slot& slot : top_slots(_bigrams, k)) {
+			std::cout << "  '" << table.word_str(slot.key.ids[0]) << " " 
+				<< table.word_str(slot.key.ids[1]) << "' " << slot.count << std::endl;
+		}
+	} else {
+		for (const IntCounterTable<NgramKey<3>>::Slot& slot : top_slots(_trigrams, k)) {
+			std::cout << "  '" << table.word_str(slot.key.ids[0]) << " " 
+				<< table.word_str(slot.key.ids[1]) << " " 
+				<< table.word_str(slot.key.ids[2]) << "' " << slot.count << std::endl;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// InvertedIndex implementation
+const char InvertedIndex::MAGIC[4] = { 'W', 'I', 'D', 'X' };
+
+static void append_varint(std::string& out, std::uint32_t v) {
+	while (v >= 0x80) {
+		out.push_back(static_cast<char>(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back(static_cast<char>(v));
+}
+
+static const char* read_varint(const char* in, std::uint32_t& v) {
+	v = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		std::uint8_t b = static_cast<std::uint8_t>(*in++);
+		v |= static_cast<std::uint32_t>(b & 0x7f) << shift;
+		if (b < 0x80)
+			return in;
+	}
+}
+
+// packs 128 values of the given bit width into 4 * bits words, see InvertedIndex
+static void pack_block(const std::uint32_t* in, unsigned bits, std::uint32_t* out) {
+	std::memset(out, 0, 4 * bits * sizeof(std::uint32_t));
+	for (std::size_t i = 0; i < InvertedIndex::BLOCK_SIZE; i++) {
+		std::size_t lane = i % 4;
+		std::size_t bit_pos = (i / 4) * bits;
+		std::size_t word = bit_pos / 32, shift = bit_pos % 32;
+		out[word * 4 + lane] |= in[i] << shift;
+		if (shift + bits > 32)
+			out[(word + 1) * 4 + lane] |= in[i] >> (32 - shift);
+	}
+}
+
+static void unpack_block(const std::uint32_t* in, unsigned bits, std::uint32_t* out) {
+	const std::uint32_t mask = (bits == 32) ? 0xffffffffU : ((1U << bits) - 1);
+	for (std::size_t i = 0; i < InvertedIndex::BLOCK_SIZE; i++) {
+		std::size_t lane = i % 4;
+		std::size_t bit_pos = (i / 4) * bits;
+		std::size_t word = bit_pos / 32, shift = bit_pos % 32;
+		std::uint32_t v = (bits == 0) ? 0 : in[word * 4 + lane] >> shift;
+		if (shift + bits > 32)
+			v |= in[(word + 1) * 4 + lane] << (32 - shift);
+		out[i] = v & mask;
+	}
+}
+
+void InvertedIndex::add(std::uint32_t id, std::uint32_t line) {
+	if (id >= _lists.size())
+		_lists.resize(id + 1);
+	List& list = _lists[id];
+	// the word occurs in the line already
+	if (line == list.last)
+		return;
+	append_varint(list.deltas, line - list.last);
+	list.last = line;
+	_postings++;
+}
+
+std::size_t InvertedIndex::memory_usage() const {
+	std::size_t size = _lists.capacity() * sizeof(List);
+	for (const List& list : _lists) {
+		if (list.deltas.capacity() > 15)
+			size += list.deltas.capacity() + 1;
+	}
+	return size;
+}
+
+void InvertedIndex::EncodePostings(const std::vector<std::uint32_t>& lines, std::string& out) {
+	std::uint32_t deltas[BLOCK_SIZE], packed[BLOCK_SIZE];
+	std::uint32_t prev = 0;
+	std::size_t i = 0;
+	for (; i + BLOCK_SIZE <= lines.size(); i += BLOCK_SIZE) {
+		std::uint32_t all = 0;
+		for (std::size_t j = 0; j < BLOCK_SIZE; j++) {
+			deltas[j] = lines[i + j] - prev;
+			prev = lines[i + j];
+			all |= deltas[j];
+		}
+		unsigned bits = 0;
+		while (bits < 32 && (all >> bits) != 0)
+			bits++;
+		pack_block(deltas, bits, packed);
+		out.push_back(static_cast<char>(bits));
+		out.append(reinterpret_cast<const char*>(packed), 4 * bits * sizeof(std::uint32_t));
+	}
+	for (; i < lines.size(); i++) {
+		append_varint(out, lines[i] - prev);
+		prev = lines[i];
+	}
+}
+
+void InvertedIndex::DecodePostings(const char* data, std::uint32_t n, std::vector<std::uint32_t>& lines) {
+	std::uint32_t packed[BLOCK_SIZE], deltas[BLOCK_SIZE];
+	std::uint32_t prev = 0;
+	lines.clear();
+	lines.reserve(n);
+	while (n >= BLOCK_SIZE) {
+		unsigned bits = static_cast<std::uint8_t>(*data++);
+		// the block isn't aligned in the file
+		std::memcpy(packed, data, 4 * bits * sizeof(std::uint32_t));
+		data += 4 * bits * sizeof(std::uint32_t);
+		unpack_block(packed, bits, deltas);
+		for (std::size_t j = 0; j < BLOCK_SIZE; j++) {
+			prev += deltas[j];
+			lines.push_back(prev);
+		}
+		n -= BLOCK_SIZE;
+	}
+	for (; n != 0; n--) {
+		std::uint32_t delta = 0;
+		data = read_varint(data, delta);
+		prev += delta;
+		lines.push_back(prev);
+	}
+}
+
+static bool write_file(int fd, const void* data, std::size_t size) {
+	const char* p = static_cast<const char*>(data);
+	while (size != 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+std::uint64_t InvertedIndex::Write(const char* path, const FrozenTable& table, 
+	const std::vector<const InvertedIndex*>& parts,
+	const std::vector<std::vector<std::uint32_t>>& ids,
+	const std::vector<std::uint32_t>& line_bases) {
+	// index of word in the table -> id in each part
+	static const std::uint32_t NO_ID = 0xffffffffU;
+	std::vector<std::vector<std::uint32_t>> part_ids(parts.size());
+	for (std::size_t p = 0; p < parts.size(); p++) {
+		part_ids[p].assign(table.size(), NO_ID);
+		for (std::size_t id = 0; id < ids[p].size(); id++) {
+			part_ids[p][ids[p][id]] = static_cast<std::uint32_t>(id);
+		}
+	}
+	
+	Header header;
+	std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+	header.version = VERSION;
+	header.words_num = table.size();
+	header.lines_num = 0;
+	header.blob_size = 0;
+	std::vector<Entry> entries(table.size());
+	std::string postings, blob;
+	std::vector<std::uint32_t> lines;
+	for (std::size_t w = 0; w < table.size(); w++) {
+		lines.clear();
+		for (std::size_t p = 0; p < parts.size(); p++) {
+			std::uint32_t id = part_ids[p][w];
+			if (id == NO_ID || id >= parts[p]->_lists.size())
+				continue;
+			const std::string& deltas = parts[p]->_lists[id].deltas;
+			std::uint32_t line = line_bases[p];
+			for (const char* d = deltas.data(); d != deltas.data() + deltas.size(); ) {
+				std::uint32_t delta = 0;
+				d = read_varint(d, delta);
+				line += delta;
+				lines.push_back(line);
+			}
+		}
+		entries[w].offset = static_cast<std::uint32_t>(blob.size());
+		entries[w].length = static_cast<std::uint32_t>(table.word_length(w));
+		entries[w].postings_offset = postings.size();
+		entries[w].postings_num = static_cast<std::uint32_t>(lines.size());
+		entries[w].reserved = 0;
+		blob.append(table.word(w), table.word_length(w));
+		EncodePostings(lines, postings);
+		if (!lines.empty())
+			header.lines_num = std::max<std::uint64_t>(header.lines_num, lines.back());
+	}
+	return WriteFile(path, header, entries, blob, postings);
+}
+
+std::uint64_t InvertedIndex::WriteFile(const char* path, Header& header, const std::vector<Entry>& entries,
+	std::string& blob, const std::string& postings) {
+	// postings start at 8 bytes boundary
+	blob.resize((blob.size() + 7) / 8 * 8, '\0');
+	header.blob_size = blob.size();
+	header.postings_size = postings.size();
+	
+	int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("open()");
+		std::cerr << "couldn't create index file " << path << std::endl;
+		return 0;
+	}
+	bool ok = write_file(fd, &header, sizeof(header))
+		&& write_file(fd, entries.data(), entries.size() * sizeof(Entry))
+		&& write_file(fd, blob.data(), blob.size())
+		&& write_file(fd, postings.data(), postings.size());
+	if (::close(fd) != 0 || !ok) {
+		perror("write()");
+		std::cerr << "couldn't write index file " << path << std::endl;
+		return 0;
+	}
+	return sizeof(header) + entries.size() * sizeof(Entry) + blob.size() + postings.size();
+}
+
+////////////////////////////////////////////////////////////////////////
+// InvertedIndexFile implementation
+InvertedIndexFile::InvertedIndexFile()
+	: _data(MAP_FAILED), _size(0), _header(NULL), _entries(NULL), _blob(NULL), _postings(NULL)
+	{
+	}
+
+InvertedIndexFile::~InvertedIndexFile()
+{
+	if (_data != MAP_FAILED)
+		munmap(_data, _size);
+}
+
+bool InvertedIndexFile::open(const char* path) {
+	if (_data != MAP_FAILED)
+		return true;
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open()");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(InvertedIndex::Header)) {
+		std::cerr << "wrong index file " << path << std::endl;
+		::close(fd);
+		return false;
+	}
+	_size = st.st_size;
+	_data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (_data == MAP_FAILED) {
+		perror("mmap()");
+		return false;
+	}
+	
+	_header = static_cast<const InvertedIndex::Header*>(_data);
+	const char* base = static_cast<const char*>(_data);
+	std::uint64_t entries_size = _header->words_num * sizeof(InvertedIndex::Entry);
+	if (std::memcmp(_header->magic, InvertedIndex::MAGIC, sizeof(_header->magic)) != 0
+		|| _header->version != InvertedIndex::VERSION
+		|| sizeof(InvertedIndex::Header) + entries_size + _header->blob_size + _header->postings_size != _size) {
+		std::cerr << "wrong index file " << path << std::endl;
+		munmap(_data, _size);
+		_data = MAP_FAILED;
+		return false;
+	}
+	_entries = reinterpret_cast<const InvertedIndex::Entry*>(base + sizeof(InvertedIndex::Header));
+	_blob = base + sizeof(InvertedIndex::Header) + entries_size;
+	_postings = _blob + _header->blob_size;
+	return true;
+}
+
+bool InvertedIndexFile::lines(const char* w, std::size_t len, std::vector<std::uint32_t>& lines) const {
+	lines.clear();
+	// the entries are sorted by word
+	std::size_t lo = 0, hi = _header->words_num;
+	while (lo < hi) {
+		std::size_t mid = lo + (hi - lo) / 2;
+		const InvertedIndex::Entry& e = _entries[mid];
+		int r = std::memcmp(_blob + e.offset, w, std::min<std::size_t>(e.length, len));
+		if (r == 0)
+			r = (e.length < len) ? -1 : (e.length > len ? 1 : 0);
+		if (r == 0) {
+			InvertedIndex::DecodePostings(_postings + e.postings_offset, e.postings_num, lines);
+			return true;
+		}
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////
+// RankBitVector implementation
+void RankBitVector::build_rank() {
+	_ranks.assign(_bits.size() / 8 + 1, 0);
+	std::uint64_t ones = 0;
+	for (std::size_t w = 0; w < _bits.size(); w++) {
+		if (w % 8 == 0)
+			_ranks[w / 8] = ones;
+		ones += __builtin_popcountll(_bits[w]);
+	}
+	if (_bits.size() % 8 == 0)
+		_ranks[_bits.size() / 8] = ones;
+}
+
+std::size_t RankBitVector::rank1(std::size_t i) const {
+	std::size_t w = i / 64;
+	std::size_t r = _ranks[w / 8];
+	for (std::size_t k = w / 8 * 8; k < w; k++) {
+		r += __builtin_popcountll(_bits[k]);
+	}
+	if (i % 64 != 0)
+		r += __builtin_popcountll(_bits[w] & ((1ULL << (i % 64)) - 1));
+	return r;
+}
+
+////////////////////////////////////////////////////////////////////////
+// FmIndex implementation
+
+// SA-IS by G. Nong, S. Zhang and W. H. Chan, "Two efficient algorithms for
+// linear time suffix array construction". s[n - 1] must be the unique 
+// smallest symbol, symbols are in [0, K]. Recursion works on int symbols.
+template <typename T>
+static void sais_buckets(const T* s, std::vector<std::int32_t>& bkt, std::int32_t n, std::int32_t K, bool end) {
+	bkt.assign(K + 1, 0);
+	for (std::int32_t i = 0; i < n; i++) {
+		bkt[s[i]]++;
+	}
+	std::int32_t sum = 0;
+	for (std::int32_t i = 0; i <= K; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+template <typename T>
+static void sais_induce(const std::vector<bool>& t, std::int32_t* SA, const T* s, 
+	std::vector<std::int32_t>& bkt, std::int32_t n, std::int32_t K) {
+	// L-type suffixes from the heads of buckets
+	sais_buckets(s, bkt, n, K, false);
+	for (std::int32_t i = 0; i < n; i++) {
+		std::int32_t j = SA[i] - 1;
+		if (j >= 0 && !t[j])
+			SA[bkt[s[j]]++] = j;
+	}
+	// S-type suffixes from the ends of buckets
+	sais_buckets(s, bkt, n, K, true);
+	for (std::int32_t i = n - 1; i >= 0; i--) {
+		std::int32_t j = SA[i] - 1;
+		if (j >= 0 && t[j])
+			SA[--bkt[s[j]]] = j;
+	}
+}
+
+template <typename T>
+static void sais(const T* s, std::int32_t* SA, std::int32_t n, std::int32_t K) {
+	// types of suffixes: true - S, false - L
+	std::vector<bool> t(n, false);
+	t[n - 1] = true;
+	for (std::int32_t i = n - 3; i >= 0; i--) {
+		t[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1]);
+	}
+	auto is_lms = [&t](std::int32_t i) { return i > 0 && t[i] && !t[i - 1]; };
+	
+	// stage 1: sort LMS substrings
+	std::vector<std::int32_t> bkt;
+	sais_buckets(s, bkt, n, K, true);
+	std::fill(SA, SA + n, -1);
+	for (std::int32_t i = 1; i < n; i++) {
+		if (is_lms(i))
+			SA[--bkt[s[i]]] = i;
+	}
+	sais_induce(t, SA, s, bkt, n, K);
+	
+	std::int32_t n1 = 0;
+	for (std::int32_t i = 0; i < n; i++) {
+		if (is_lms(SA[i]))
+			SA[n1++] = SA[i];
+	}
+	// name LMS substrings
+	std::fill(SA + n1, SA + n, -1);
+	std::int32_t name = 0, prev = -1;
+	for (std::int32_t i = 0; i < n1; i++) {
+		std::int32_t pos = SA[i];
+		bool diff = false;
+		for (std::int32_t d = 0; d < n; d++) {
+			if (prev == -1 || s[pos + d] != s[prev + d] || t[pos + d] != t[prev + d]) {
+				diff = true;
+				break;
+			} else if (d > 0 && (is_lms(pos + d) || is_lms(prev + d))) {
+				break;
+			}
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		SA[n1 + pos / 2] = name - 1;
+	}
+	for (std::int32_t i = n - 1, j = n - 1; i >= n1; i--) {
+		if (SA[i] >= 0)
+			SA[j--] = SA[i];
+	}
+	
+	// stage 2: sort the reduced string, recursively if names aren't unique
+	std::int32_t* SA1 = SA;
+	std::int32_t* s1 = SA + n - n1;
+	if (name < n1) {
+		sais(s1, SA1, n1, name - 1);
+	} else {
+		for (std::int32_t i = 0; i < n1; i++) {
+			SA1[s1[i]] = i;
+		}
+	}
+	
+	// stage 3: induce the suffix array from sorted LMS suffixes
+	sais_buckets(s, bkt, n, K, true);
+	for (std::int32_t i = 1, j = 0; i < n; i++) {
+		if (is_lms(i))
+			s1[j++] = i;
+	}
+	for (std::int32_t i = 0; i < n1; i++) {
+		SA1[i] = s1[SA1[i]];
+	}
+	std::fill(SA + n1, SA + n, -1);
+	for (std::int32_t i = n1 - 1; i >= 0; i--) {
+		std::int32_t j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[s[j]]] = j;
+	}
+	sais_induce(t, SA, s, bkt, n, K);
+}
+
+FmIndex::FmIndex()
+	: _n(0)
+	{
+		std::memset(_zeros, 0, sizeof(_zeros));
+		std::memset(_C, 0, sizeof(_C));
+	}
+
+bool FmIndex::build(std::string& text, double& sa_time, double& bwt_time) {
+	if (text.size() > MAX_TEXT_SIZE)
+		return false;
+	std::replace(text.begin(), text.end(), '\0', '\1');
+	text.push_back('\0');
+	_n = text.size();
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::vector<std::int32_t> SA(_n);
+	sais(reinterpret_cast<const std::uint8_t*>(text.data()), SA.data(), static_cast<std::int32_t>(_n), 255);
+	sa_time = seconds_since(start);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// BWT and samples of suffix array
+	std::string bwt(_n, '\0');
+	_sampled.resize(_n);
+	for (std::size_t i = 0; i < _n; i++) {
+		std::size_t pos = SA[i];
+		bwt[i] = (pos == 0) ? '\0' : text[pos - 1];
+		if (pos % SA_SAMPLE_RATE == 0)
+			_sampled.set(i);
+	}
+	_sampled.build_rank();
+	_samples.clear();
+	_samples.reserve(_n / SA_SAMPLE_RATE + 1);
+	for (std::size_t i = 0; i < _n; i++) {
+		if (SA[i] % SA_SAMPLE_RATE == 0)
+			_samples.push_back(SA[i]);
+	}
+	std::vector<std::int32_t>().swap(SA);
+	
+	std::size_t counts[256] = { 0 };
+	for (char c : text) {
+		counts[static_cast<std::uint8_t>(c)]++;
+	}
+	_C[0] = 0;
+	for (std::size_t c = 0; c < 256; c++) {
+		_C[c + 1] = _C[c] + counts[c];
+	}
+	std::string().swap(text);
+	
+	// wavelet matrix: the bits of level are taken from the most significant one,
+	// then the sequence is stably partitioned by the bit for the next level
+	std::string next(_n, '\0');
+	for (std::size_t level = 0; level < 8; level++) {
+		const unsigned shift = 7 - level;
+		RankBitVector& bits = _levels[level];
+		bits.resize(_n);
+		std::size_t zeros = 0;
+		for (std::size_t i = 0; i < _n; i++) {
+			if ((static_cast<std::uint8_t>(bwt[i]) >> shift) & 1)
+				bits.set(i);
+			else
+				zeros++;
+		}
+		bits.build_rank();
+		_zeros[level] = zeros;
+		std::size_t z = 0, o = zeros;
+		for (std::size_t i = 0; i < _n; i++) {
+			if ((static_cast<std::uint8_t>(bwt[i]) >> shift) & 1)
+				next[o++] = bwt[i];
+			else
+				next[z++] = bwt[i];
+		}
+		bwt.swap(next);
+	}
+	bwt_time = seconds_since(start);
+	return true;
+}
+
+std::size_t FmIndex::rank(std::uint8_t c, std::size_t i) const {
+	std::size_t p = 0;
+	for (std::size_t level = 0; level < 8; level++) {
+		const RankBitVector& bits = _levels[level];
+		if ((c >> (7 - level)) & 1) {
+			p = _zeros[level] + bits.rank1(p);
+			i = _zeros[level] + bits.rank1(i);
+		} else {
+			p = bits.rank0(p);
+			i = bits.rank0(i);
+		}
+	}
+	return i - p;
+}
+
+std::uint8_t FmIndex::access(std::size_t i) const {
+	std::uint8_t c = 0;
+	for (std::size_t level = 0; level < 8; level++) {
+		const RankBitVector& bits = _levels[level];
+		bool bit = bits.get(i);
+		c = (c << 1) | (bit ? 1 : 0);
+		i = bit ? _zeros[level] + bits.rank1(i) : bits.rank0(i);
+	}
+	return c;
+}
+
+bool FmIndex::backward_search(const char* p, std::size_t len, std::size_t& sp, std::size_t& ep) const {
+	sp = 0;
+	ep = _n;
+	for (std::size_t k = len; k > 0 && sp < ep; k--) {
+		std::uint8_t c = static_cast<std::uint8_t>(p[k - 1]);
+		sp = _C[c] + rank(c, sp);
+		ep = _C[c] + rank(c, ep);
+	}
+	return sp < ep;
+}
+
+std::size_t FmIndex::count(const char* p, std::size_t len) const {
+	std::size_t sp = 0, ep = 0;
+	return (_n != 0 && backward_search(p, len, sp, ep)) ? ep - sp : 0;
+}
+
+void FmIndex::locate(const char* p, std::size_t len, std::size_t limit, std::vector<std::uint64_t>& positions) const {
+	positions.clear();
+	std::size_t sp = 0, ep = 0;
+	if (_n == 0 || !backward_search(p, len, sp, ep))
+		return;
+	for (std::size_t row = sp; row < ep && positions.size() < limit; row++) {
+		// LF mapping steps back in the text, untill sampled position
+		std::size_t i = row, steps = 0;
+		while (!_sampled.get(i)) {
+			std::uint8_t c = access(i);
+			i = _C[c] + rank(c, i);
+			steps++;
+		}
+		positions.push_back(_samples[_sampled.rank1(i)] + steps);
+	}
+}
+
+std::size_t FmIndex::memory_usage() const {
+	std::size_t size = _sampled.memory_usage() + _samples.capacity() * sizeof(std::uint32_t) + sizeof(_C);
+	for (const RankBitVector& bits : _levels) {
+		size += bits.memory_usage();
+	}
+	return size;
+}
+
+////////////////////////////////////////////////////////////////////////
+// ChunkReader implementation
+ChunkReader::ChunkReader(const char* fname, std::uint64_t begin, std::uint64_t end, std::size_t chunk_size)
+	: _fname(fname), _fd(-1), _pos(begin), _end(end), _offset(begin), _chunk_size(chunk_size), _failed(false)
+	{
+	}
+
+ChunkReader::~ChunkReader() {
+	if (_fd >= 0)
+		close(_fd);
+}
+
+bool ChunkReader::open() {
+	_fd = ::open(_fname, O_RDONLY);
+	if (_fd < 0)
+		return false;
+	posix_fadvise(_fd, _pos, _end - _pos, POSIX_FADV_SEQUENTIAL);
+	_buffer.resize(_chunk_size);
+	return true;
+}
+
+bool ChunkReader::next(const char*& data, std::size_t& size) {
+	if (_fd < 0 || _failed || _pos >= _end)
+		return false;
+	std::size_t want = (_end - _pos < _chunk_size) ? _end - _pos : _chunk_size;
+	std::size_t got = 0;
+	while (got < want) {
+		ssize_t n = pread(_fd, &_buffer[got], want - got, _pos + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			// the file has been truncated, if not an error
+			_failed = (n < 0);
+			break;
+		}
+		got += n;
+	}
+	if (got == 0)
+		return false;
+	_offset = _pos;
+	_pos += got;
+	if (got < want)
+		_end = _pos;
+	data = _buffer.data();
+	size = got;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// BlockScanner implementation
+BlockScanner::BlockScanner(const char* fname)
+	: _fname(fname), _carry(0), _line_open(false)
+	{
+	}
+
+bool BlockScanner::scan(std::uint64_t begin, std::uint64_t end, const Visitor& visitor) {
+	// the block is added to the carried bytes, which are MAX_CARRY at most
+	_work.resize(ChunkReader::CHUNK_SIZE + MAX_CARRY);
+	_carry = 0;
+	_line_open = false;
+	
+	// the bytes of the range belong to the lines which begin in it, 
+	// but the ones of the line which begins before it
+	ChunkReader reader(_fname, begin != 0 ? begin - 1 : 0, end);
+	if (!reader.open())
+		return false;
+	bool skip = (begin != 0);
+	const char* data = NULL;
+	std::size_t size = 0;
+	while (reader.next(data, size)) {
+		const char* p = data;
+		if (skip) {
+			p = static_cast<const char*>(std::memchr(data, '\n', size));
+			if (p == NULL)
+				continue;
+			p++;
+			skip = false;
+		}
+		feed(p, size - (p - data), visitor);
+	}
+	if (reader.failed())
+		return false;
+	if (skip || (_carry == 0 && !_line_open))
+		return true;
+	
+	// the latest line is read up to its end, it's usually short
+	static const std::size_t TAIL_CHUNK_SIZE = 4096;
+	ChunkReader tail(_fname, end, INT64_MAX, TAIL_CHUNK_SIZE);
+	if (!tail.open())
+		return false;
+	while (tail.next(data, size)) {
+		const char* nl = static_cast<const char*>(std::memchr(data, '\n', size));
+		feed(data, nl != NULL ? nl + 1 - data : size, visitor);
+		if (nl != NULL)
+			return !tail.failed();
+	}
+	// the last line of the file may have no newline
+	if (_carry != 0 || _line_open)
+		visitor(_work.data(), _carry, true);
+	return !tail.failed();
+}
+
+void BlockScanner::feed(const char* data, std::size_t size, const Visitor& visitor) {
+	char* w = _work.data();
+	while (size != 0) {
+		std::size_t n = (size < ChunkReader::CHUNK_SIZE) ? size : ChunkReader::CHUNK_SIZE;
+		std::memcpy(w + _carry, data, n);
+		data += n;
+		size -= n;
+		std::size_t len = _carry + n;
+		std::size_t i = 0;
+		for (char* nl; (nl = static_cast<char*>(std::memchr(w + i, '\n', len - i))) != NULL; ) {
+			visitor(w + i, nl - (w + i), true);
+			_line_open = false;
+			i = nl + 1 - w;
+		}
+		if (len - i > MAX_CARRY) {
+			// too long line, it's cut after the latest space, or the word 
+			// itself is cut at the beginning of UTF-8 sequence
+			const char* sp = static_cast<const char*>(memrchr(w + i, ' ', len - i));
+			std::size_t cut = (sp != NULL) ? sp + 1 - w : len;
+			if (len - cut > MAX_CARRY)
+				cut = len;
+			if (cut == len) {
+				std::size_t k = len;
+				while (k > i && len - k < 4 && (static_cast<unsigned char>(w[k - 1]) & 0xc0) == 0x80)
+					k--;
+				if (k > i && static_cast<unsigned char>(w[k - 1]) >= 0xc0)
+					cut = k - 1;
+			}
+			visitor(w + i, cut - i, false);
+			_line_open = true;
+			i = cut;
+		}
+		_carry = len - i;
+		std::memmove(w, w + i, _carry);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// SpillFiles implementation
+
+// sequential reader of the records of a run
+class SpillFiles::RunReader final {
+public:
+	static const std::size_t BUFFER_SIZE = 64 << 10;
+	
+	RunReader(int fd, const Run& run)
+		: _fd(fd), _pos(run.offset), _end(run.offset + run.size), _begin(0), _failed(false)
+		{
+		}
+	
+	// false at the end of the run
+	bool next() {
+		std::uint32_t len = 0;
+		if (!fill(5))
+			return false;
+		const char* p = read_varint(_buffer.data() + _begin, len);
+		_begin = p - _buffer.data();
+		if (!fill(len + 5))
+			return false;
+		_word.assign(_buffer.data() + _begin, len);
+		p = read_varint(_buffer.data() + _begin + len, count);
+		_begin = p - _buffer.data();
+		return true;
+	}
+	
+	const std::string& word() const { return _word; }
+	bool failed() const { return _failed; }
+	
+	std::uint32_t count;
+	
+private:
+	// makes at least n bytes available in the buffer, if the run has them
+	bool fill(std::size_t n) {
+		std::size_t avail = _buffer.size() - _begin;
+		if (avail >= n || (avail != 0 && _pos == _end))
+			return true;
+		_buffer.erase(0, _begin);
+		_begin = 0;
+		std::size_t want = (n > BUFFER_SIZE) ? n : BUFFER_SIZE;
+		want = std::min<std::uint64_t>(want, _end - _pos);
+		_buffer.resize(avail + want);
+		std::size_t got = 0;
+		while (got < want) {
+			ssize_t r = pread(_fd, &_buffer[avail + got], want - got, _pos + got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				_failed = true;
+				break;
+			}
+			got += r;
+		}
+		_buffer.resize(avail + got);
+		_pos += got;
+		return !_buffer.empty();
+	}
+	
+	int _fd;
+	std::uint64_t _pos;
+	std::uint64_t _end;
+	std::string _buffer;
+	std::size_t _begin;
+	bool _failed;
+	std::string _word;
+};
+
+SpillFiles::SpillFiles()
+	: _runs_num(0), _bytes(0), _words_total(0), _write_time(0)
+	{
+	}
+
+SpillFiles::~SpillFiles() {
+	for (int fd : _fds) {
+		close(fd);
+	}
+}
+
+std::size_t SpillFiles::partition(const std::string& w) {
+	// the higher bits, the lower ones are used by the hash tables
+	return (hash_bytes(w.data(), w.size()) >> 56) % PARTITIONS_NUM;
+}
+
+bool SpillFiles::spill(const char* dir, std::map<std::string, std::uint32_t>& counters) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (_fds.empty()) {
+		for (std::size_t k = 0; k < PARTITIONS_NUM; k++) {
+			std::string path = std::string(dir) + "/spill-XXXXXX";
+			int fd = mkstemp(&path[0]);
+			if (fd < 0) {
+				perror("mkstemp()");
+				return false;
+			}
+			unlink(path.c_str());
+			_fds.push_back(fd);
+		}
+		_runs.resize(PARTITIONS_NUM);
+		_sizes.assign(PARTITIONS_NUM, 0);
+	}
+	
+	// std::map is ordered, so are the runs. The counters are erased as 
+	// they are written, and each run is written by small pieces, so the 
+	// counters and the runs don't take the memory at once
+	std::vector<std::string> runs(PARTITIONS_NUM);
+	std::vector<std::uint64_t> begins(_sizes);
+	for (std::map<std::string, std::uint32_t>::iterator it = counters.begin(); it != counters.end(); 
+		it = counters.erase(it)) {
+		// carried to the wide counter, which stays in the task
+		if (it->second == 0)
+			continue;
+		std::size_t k = partition(it->first);
+		std::string& out = runs[k];
+		append_varint(out, static_cast<std::uint32_t>(it->first.size()));
+		out.append(it->first);
+		append_varint(out, it->second);
+		_words_total += it->second;
+		if (out.size() >= PIECE_SIZE) {
+			if (!write_file(_fds[k], out.data(), out.size()))
+				return false;
+			_sizes[k] += out.size();
+			out.clear();
+		}
+	}
+	
+	for (std::size_t k = 0; k < PARTITIONS_NUM; k++) {
+		if (!write_file(_fds[k], runs[k].data(), runs[k].size()))
+			return false;
+		_sizes[k] += runs[k].size();
+		if (_sizes[k] == begins[k])
+			continue;
+		Run run = { begins[k], _sizes[k] - begins[k] };
+		_runs[k].push_back(run);
+		_bytes += run.size;
+		_runs_num++;
+	}
+	_write_time += seconds_since(start);
+	return true;
+}
+
+FrozenTable SpillFiles::MergePartition(const std::vector<const SpillFiles*>& files, std::size_t partition) {
+	std::vector<std::unique_ptr<RunReader>> readers;
+	for (const SpillFiles* f : files) {
+		if (f->_runs.empty())
+			continue;
+		for (const Run& run : f->_runs[partition]) {
+			readers.emplace_back(new RunReader(f->_fds[partition], run));
+		}
+	}
+	
+	// k-way merge by heap of readers, ordered by their current words
+	auto greater = [&readers](std::size_t a, std::size_t b) {
+		return readers[a]->word() > readers[b]->word();
+	};
+	std::vector<std::size_t> heap;
+	for (std::size_t i = 0; i < readers.size(); i++) {
+		if (readers[i]->next())
+			heap.push_back(i);
+	}
+	std::make_heap(heap.begin(), heap.end(), greater);
+	
+	FrozenTable table;
+	std::string w;
+	std::uint64_t count = 0;
+	bool pending = false;
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), greater);
+		RunReader& r = *readers[heap.back()];
+		if (pending && r.word() != w) {
+			table.append(w.data(), w.size(), count);
+			pending = false;
+		}
+		if (!pending) {
+			w = r.word();
+			count = 0;
+			pending = true;
+		}
+		count += r.count;
+		if (r.next()) {
+			std::push_heap(heap.begin(), heap.end(), greater);
+		} else {
+			if (r.failed())
+				std::cerr << "couldn't read spill file of partition " << partition << std::endl;
+			heap.pop_back();
+		}
+	}
+	if (pending)
+		table.append(w.data(), w.size(), count);
+	return table;
+}
+
+////////////////////////////////////////////////////////////////////////
+// CountMinSketch implementation
+CountMinSketch::CountMinSketch(std::size_t width)
+	: _width(0), _total(0)
+	{
+		if (width != 0) {
+			_width = 1;
+			while (_width * 2 <= width)
+				_width *= 2;
+		}
+		_counters.assign(_width * DEPTH, 0);
+	}
+
+void CountMinSketch::slots(const char* w, std::size_t len, std::size_t* slots) const {
+	// the rows' hashes are combinations of two halves of one hash
+	std::uint64_t h = hash_bytes(w, len);
+	std::uint32_t h1 = static_cast<std::uint32_t>(h), h2 = static_cast<std::uint32_t>(h >> 32) | 1;
+	for (std::size_t r = 0; r < DEPTH; r++) {
+		slots[r] = r * _width + ((h1 + r * h2) & (_width - 1));
+	}
+}
+
+void CountMinSketch::add(const char* w, std::size_t len, std::uint32_t n) {
+	std::size_t s[DEPTH];
+	slots(w, len, s);
+	std::uint32_t min = _counters[s[0]];
+	for (std::size_t r = 1; r < DEPTH; r++) {
+		min = std::min(min, _counters[s[r]]);
+	}
+	// conservative update: no counter is raised above the new estimate
+	std::uint32_t estimate = SaturatedAdd(min, n);
+	for (std::size_t r = 0; r < DEPTH; r++) {
+		_counters[s[r]] = std::max(_counters[s[r]], estimate);
+	}
+	_total += n;
+}
+
+std::uint32_t CountMinSketch::estimate(const char* w, std::size_t len) const {
+	if (_width == 0)
+		return 0;
+	std::size_t s[DEPTH];
+	slots(w, len, s);
+	std::uint32_t min = _counters[s[0]];
+	for (std::size_t r = 1; r < DEPTH; r++) {
+		min = std::min(min, _counters[s[r]]);
+	}
+	return min;
+}
+
+bool CountMinSketch::merge(const CountMinSketch& other) {
+	if (other._width != _width)
+		return false;
+	for (std::size_t i = 0; i < _counters.size(); i++) {
+		_counters[i] = SaturatedAdd(_counters[i], other._counters[i]);
+	}
+	_total += other._total;
+	return true;
+}
+
+CountMinSketch CountMinSketch::fold() const {
+	CountMinSketch folded(_width / 2);
+	folded._total = _total;
+	for (std::size_t r = 0; r < DEPTH && folded._width != 0; r++) {
+		const std::uint32_t* row = &_counters[r * _width];
+		std::uint32_t* folded_row = &folded._counters[r * folded._width];
+		for (std::size_t i = 0; i < folded._width; i++) {
+			folded_row[i] = SaturatedAdd(row[i], row[i + folded._width]);
+		}
+	}
+	return folded;
+}
+
+double CountMinSketch::error_bound() const {
+	static const double E = 2.718281828459045;
+	return _width == 0 ? 0 : E / _width * _total;
+}
+
+////////////////////////////////////////////////////////////////////////
+// WordFilter implementation
+namespace {
+
+// the low bits of the hash select the block, the bits of each lane 
+// are taken by 6 from the remixed hash, so they don't depend on the block
+inline std::uint64_t bloom_lanes_key(std::uint64_t h) {
+	return h * 0x9e3779b97f4a7c15ULL;
+}
+
+} // namespace
+
+WordFilter::WordFilter()
+	: _blocks(NULL), _blocks_mask(0), _size(0)
+	{
+	}
+
+bool WordFilter::load(const char* fname) {
+	std::ifstream in_file(fname);
+	if (!in_file)
+		return false;
+	std::vector<std::pair<std::uint32_t, std::uint32_t> > words;
+	std::string line;
+	while (std::getline(in_file, line)) {
+		if (line.empty())
+			continue;
+		words.emplace_back(static_cast<std::uint32_t>(_words.size()), static_cast<std::uint32_t>(line.size()));
+		_words += line;
+	}
+	if (!in_file.eof())
+		return false;
+	
+	std::size_t blocks_num = 1;
+	while (blocks_num * LANES * 64 < words.size() * BITS_PER_WORD)
+		blocks_num *= 2;
+	// one block more to align them by cache line
+	_bits.assign((blocks_num + 1) * LANES, 0);
+	std::uintptr_t p = reinterpret_cast<std::uintptr_t>(_bits.data());
+	_blocks = _bits.data() + ((64 - p % 64) % 64) / sizeof(std::uint64_t);
+	_blocks_mask = blocks_num - 1;
+	
+	std::size_t slots = 2;
+	while (slots < 2 * words.size())
+		slots *= 2;
+	_table.assign(slots, Entry{ 0, EMPTY, 0 });
+	_size = 0;
+	for (const std::pair<std::uint32_t, std::uint32_t>& w : words) {
+		const char* data = _words.data() + w.first;
+		std::uint64_t h = hash_bytes(data, w.second);
+		if (verify(h, data, w.second))
+			continue;
+		insert(h, w.first, w.second);
+		std::uint64_t* block = const_cast<std::uint64_t*>(_blocks) + (h & _blocks_mask) * LANES;
+		std::uint64_t key = bloom_lanes_key(h);
+		for (std::size_t i = 0; i < LANES; i++) {
+			block[i] |= 1ULL << ((key >> (16 + 6 * i)) & 63);
+		}
+		_size++;
+	}
+	return true;
+}
+
+bool WordFilter::may_contain(std::uint64_t h) const {
+	if (_size == 0)
+		return false;
+	const std::uint64_t* block = _blocks + (h & _blocks_mask) * LANES;
+	std::uint64_t key = bloom_lanes_key(h);
+	// no early exit, all the lanes are tested at once
+	std::uint64_t missed = 0;
+	for (std::size_t i = 0; i < LANES; i++) {
+		missed |= ~block[i] & (1ULL << ((key >> (16 + 6 * i)) & 63));
+	}
+	return missed == 0;
+}
+
+bool WordFilter::verify(std::uint64_t h, const char* w, std::size_t len) const {
+	if (_table.empty())
+		return false;
+	std::size_t mask = _table.size() - 1;
+	for (std::size_t i = (h >> 32) & mask; _table[i].offset != EMPTY; i = (i + 1) & mask) {
+		const Entry& e = _table[i];
+		if (e.hash == h && e.length == len && std::memcmp(_words.data() + e.offset, w, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+void WordFilter::insert(std::uint64_t h, std::uint32_t offset, std::uint32_t length) {
+	std::size_t mask = _table.size() - 1;
+	std::size_t i = (h >> 32) & mask;
+	while (_table[i].offset != EMPTY)
+		i = (i + 1) & mask;
+	_table[i] = Entry{ h, offset, length };
+}
+
+std::size_t WordFilter::memory_usage() const {
+	return _bits.size() * sizeof(std::uint64_t) + _table.size() * sizeof(Entry) + _words.capacity();
+}
+
+////////////////////////////////////////////////////////////////////////
+// ChunkSampler implementation
+ChunkSampler::ChunkSampler()
+	: _begin(0), _end(0), _chunks_num(0), _sampled(0), _words_sum(0), _words_squares(0)
+	{
+	}
+
+void ChunkSampler::plan(std::uint64_t begin, std::uint64_t end, double fraction, std::uint32_t seed) {
+	_begin = begin;
+	_end = end;
+	_chunks_num = static_cast<std::size_t>((end - begin + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	_order.resize(_chunks_num);
+	for (std::size_t i = 0; i < _chunks_num; i++) {
+		_order[i] = i;
+	}
+	// Fisher-Yates shuffle, xorshift32
+	std::uint32_t rnd = seed != 0 ? seed : 2463534242U;
+	for (std::size_t i = _chunks_num; i > 1; i--) {
+		rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5;
+		std::swap(_order[i - 1], _order[rnd % i]);
+	}
+	std::size_t n = static_cast<std::size_t>(std::ceil(fraction * _chunks_num));
+	_order.resize(std::min(_chunks_num, std::max<std::size_t>(n, 2)));
+}
+
+void ChunkSampler::add_chunk(WordCounters& chunk, WordCounters& counters) {
+	std::uint64_t words = 0;
+	// the chunk isn't spilled, so each wide counter has the narrow one
+	for (const std::pair<const std::string, std::uint32_t>& p : chunk.narrow()) {
+		std::uint64_t n = p.second;
+		if (!chunk.wide().empty()) {
+			WordCounters::Wide::const_iterator it = chunk.wide().find(p.first);
+			if (it != chunk.wide().end())
+				n += it->second;
+		}
+		counters.add(p.first, n);
+		_squares[p.first] += n * n;
+		words += n;
+	}
+	chunk.clear();
+	// progress reports read these without locking, they may be off by a chunk
+	_words_sum += words;
+	_words_squares += words * words;
+	_sampled++;
+}
+
+ChunkSampler::Estimate ChunkSampler::estimate(std::size_t n, double sum, double squares) const {
+	Estimate e = { 0, 0 };
+	if (n == 0)
+		return e;
+	double N = static_cast<double>(_chunks_num);
+	e.value = N * sum / n;
+	if (n > 1) {
+		double s2 = std::max(0.0, (squares - sum * sum / n) / (n - 1));
+		e.variance = N * N * (1 - n / N) * s2 / n;
+	}
+	return e;
+}
+
+ChunkSampler::Estimate ChunkSampler::words_total() const {
+	std::size_t n = _sampled.load();
+	return estimate(n, static_cast<double>(_words_sum.load()), static_cast<double>(_words_squares.load()));
+}
+
+ChunkSampler::Estimate ChunkSampler::word(const std::string& w, std::uint64_t sum) const {
+	std::unordered_map<std::string, std::uint64_t>::const_iterator it = _squares.find(w);
+	double squares = it == _squares.end() ? 0 : static_cast<double>(it->second);
+	return estimate(_sampled.load(), static_cast<double>(sum), squares);
+}
+
+////////////////////////////////////////////////////////////////////////
+// AhoCorasick implementation
+AhoCorasick::AhoCorasick()
+	: _classes_num(1), _max_length(0)
+	{
+		std::memset(_classes, 0, sizeof(_classes));
+	}
+
+void AhoCorasick::add(const std::string& pattern) {
+	if (pattern.empty())
+		return;
+	_patterns.push_back(pattern);
+	_max_length = std::max(_max_length, pattern.size());
+}
+
+bool AhoCorasick::compile() {
+	if (_patterns.empty())
+		return false;
+	// class 0 is shared by the bytes, which aren't in patterns, 
+	// so there is a class for 255 distinct bytes of patterns at most
+	_classes_num = 1;
+	std::memset(_classes, 0, sizeof(_classes));
+	std::size_t total = 0;
+	for (const std::string& p : _patterns) {
+		for (char c : p) {
+			std::uint8_t b = static_cast<std::uint8_t>(c);
+			if (_classes[b] != 0)
+				continue;
+			if (_classes_num == 256)
+				return false;
+			_classes[b] = static_cast<std::uint8_t>(_classes_num++);
+		}
+		total += p.size();
+	}
+	if ((total + 1) * _classes_num >= OUTPUT)
+		return false;
+	
+	// goto function, 0 is "no transition" since nothing goes to the root
+	_delta.assign(_classes_num, 0);
+	_terminals.clear();
+	std::vector<bool> output(1, false);
+	for (const std::string& p : _patterns) {
+		std::uint32_t state = 0;
+		for (char c : p) {
+			std::uint32_t& next = _delta[state * _classes_num + _classes[static_cast<std::uint8_t>(c)]];
+			if (next == 0) {
+				next = static_cast<std::uint32_t>(output.size());
+				output.push_back(false);
+				_delta.resize(_delta.size() + _classes_num, 0);
+			}
+			// the reference may be invalidated by resize
+			state = _delta[state * _classes_num + _classes[static_cast<std::uint8_t>(c)]];
+		}
+		output[state] = true;
+		_terminals.push_back(state);
+	}
+	
+	// failure links by breadth first traversal, missing transitions are
+	// taken from the state of failure link, which is processed already
+	const std::size_t states = output.size();
+	_fail.assign(states, 0);
+	_order.clear();
+	_order.reserve(states);
+	_order.push_back(0);
+	for (std::size_t k = 0; k < _order.size(); k++) {
+		std::uint32_t s = _order[k];
+		std::uint32_t* row = &_delta[s * _classes_num];
+		const std::uint32_t* fail_row = &_delta[_fail[s] * _classes_num];
+		for (std::uint32_t c = 0; c < _classes_num; c++) {
+			std::uint32_t child = row[c];
+			if (child == 0) {
+				// no goto transition, the row of root is complete already
+				if (s != 0)
+					row[c] = fail_row[c];
+				continue;
+			}
+			_fail[child] = (s == 0) ? 0 : (fail_row[c] & ~OUTPUT) / _classes_num;
+			output[child] = output[child] || output[_fail[child]];
+			_order.push_back(child);
+			row[c] = child * _classes_num | (output[child] ? OUTPUT : 0);
+		}
+	}
+	return true;
+}
+
+std::uint32_t AhoCorasick::advance(const char* data, std::size_t size, std::uint32_t state) const {
+	const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(data);
+	std::uint32_t row = state * _classes_num;
+	for (std::size_t i = 0; i < size; i++) {
+		row = _delta[row + _classes[p[i]]] & ~OUTPUT;
+	}
+	return row / _classes_num;
+}
+
+std::uint32_t AhoCorasick::scan(const char* data, std::size_t size, std::uint32_t state, std::uint64_t* visits) const {
+	const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(data);
+	const std::uint32_t* delta = _delta.data();
+	const std::uint32_t classes_num = _classes_num;
+	auto step = [delta, visits, classes_num, this](std::uint32_t& row, std::uint8_t c) {
+		std::uint32_t t = delta[row + _classes[c]];
+		row = t & ~OUTPUT;
+		if (t & OUTPUT)
+			visits[row / classes_num]++;
+	};
+	
+	// each lookup depends on the previous one, so the data is split into 
+	// 4 lanes scanned in turn, to keep several lookups in flight. 
+	// the lanes, except the first one, are started from the root after 
+	// the preceding bytes of the longest pattern.
+	std::size_t i = 0;
+	std::uint32_t row = state * classes_num;
+	const std::size_t lane = size / 4;
+	if (_max_length != 0 && lane >= std::max<std::size_t>(_max_length, 4096)) {
+		const std::size_t warm = _max_length - 1;
+		std::uint32_t row1 = advance(data + lane - warm, warm, 0) * classes_num;
+		std::uint32_t row2 = advance(data + 2 * lane - warm, warm, 0) * classes_num;
+		std::uint32_t row3 = advance(data + 3 * lane - warm, warm, 0) * classes_num;
+		const std::uint8_t* p1 = p + lane;
+		const std::uint8_t* p2 = p + 2 * lane;
+		const std::uint8_t* p3 = p + 3 * lane;
+		for (; i < lane; i++) {
+			step(row, p[i]);
+			step(row1, p1[i]);
+			step(row2, p2[i]);
+			step(row3, p3[i]);
+		}
+		i = 4 * lane;
+		row = row3;
+	}
+	for (; i < size; i++) {
+		step(row, p[i]);
+	}
+	return row / classes_num;
+}
+
+std::vector<std::uint64_t> AhoCorasick::counts(const std::vector<std::uint64_t>& visits) const {
+	// a state is visited on each occurrence of every pattern on its failure links chain
+	std::vector<std::uint64_t> sums(visits);
+	for (std::size_t k = _order.size(); k > 1; k--) {
+		std::uint32_t s = _order[k - 1];
+		sums[_fail[s]] += sums[s];
+	}
+	std::vector<std::uint64_t> result(_terminals.size());
+	for (std::size_t i = 0; i < _terminals.size(); i++) {
+		result[i] = sums[_terminals[i]];
+	}
+	return result;
+}
+
+std::size_t AhoCorasick::memory_usage() const {
+	return (_delta.capacity() + _fail.capacity() + _order.capacity() + _terminals.capacity()) 
+		* sizeof(std::uint32_t) + sizeof(_classes);
+}
+
+////////////////////////////////////////////////////////////////////////
+// IndexSegments implementation
+IndexSegments::IndexSegments(const std::string& dir)
+	: _dir(dir), _next_id(1), _next_line(0), _bytes_flushed(0), _bytes_merged(0), _merges(0)
+	{
+	}
+
+unsigned IndexSegments::Tier(std::uint64_t size) {
+	unsigned tier = 0;
+	for (std::uint64_t s = TIER_BASE_SIZE; size >= s; s *= MERGE_FACTOR) {
+		tier++;
+	}
+	return tier;
+}
+
+std::string IndexSegments::segment_path(std::uint64_t id) const {
+	char name[32];
+	std::snprintf(name, sizeof(name), "/seg-%06llu.idx", static_cast<unsigned long long>(id));
+	return _dir + name;
+}
+
+std::shared_ptr<const InvertedIndexFile> IndexSegments::map_segment(std::uint64_t id) const {
+	std::shared_ptr<InvertedIndexFile> file(new InvertedIndexFile());
+	if (!file->open(segment_path(id).c_str()))
+		return NULL;
+	return file;
+}
+
+bool IndexSegments::open() {
+	if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		perror("mkdir()");
+		return false;
+	}
+	std::ifstream manifest(_dir + "/MANIFEST");
+	if (!manifest)
+		return true; // new index
+	
+	std::string line, key;
+	while (std::getline(manifest, line)) {
+		std::istringstream ss(line);
+		ss >> key;
+		if (key == "next_id") {
+			ss >> _next_id;
+		} else if (key == "next_line") {
+			ss >> _next_line;
+		} else if (key == "bytes_flushed") {
+			ss >> _bytes_flushed;
+		} else if (key == "bytes_merged") {
+			ss >> _bytes_merged;
+		} else if (key == "merges") {
+			ss >> _merges;
+		} else if (key == "segment") {
+			Segment seg;
+			ss >> seg.id >> seg.first_line >> seg.last_line >> seg.size;
+			seg.merging = false;
+			_segments.push_back(seg);
+		} else if (key == "file") {
+			InputFile file;
+			ss >> file.first_line >> file.lines_num;
+			ss.ignore(1);
+			std::getline(ss, file.name);
+			_files.push_back(file);
+		}
+		if (!ss && !ss.eof()) {
+			std::cerr << "wrong line in manifest: " << line << std::endl;
+			return false;
+		}
+	}
+	for (Segment& seg : _segments) {
+		seg.file = map_segment(seg.id);
+		if (!seg.file)
+			return false;
+	}
+	return true;
+}
+
+bool IndexSegments::save_manifest() const {
+	const std::string path = _dir + "/MANIFEST";
+	{
+		std::ofstream manifest(path + ".tmp", std::ios::trunc);
+		manifest << "next_id " << _next_id << "\n"
+			<< "next_line " << _next_line << "\n"
+			<< "bytes_flushed " << _bytes_flushed << "\n"
+			<< "bytes_merged " << _bytes_merged << "\n"
+			<< "merges " << _merges << "\n";
+		for (const InputFile& file : _files) {
+			manifest << "file " << file.first_line << " " << file.lines_num << " " << file.name << "\n";
+		}
+		for (const Segment& seg : _segments) {
+			manifest << "segment " << seg.id << " " << seg.first_line << " " 
+				<< seg.last_line << " " << seg.size << "\n";
+		}
+		manifest.flush();
+		if (!manifest) {
+			std::cerr << "couldn't write " << path << ".tmp\n";
+			return false;
+		}
+	}
+	if (rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+		perror("rename()");
+		return false;
+	}
+	return true;
+}
+
+bool IndexSegments::flush(const char* fname, std::uint64_t lines_num, const FrozenTable& table, 
+	const std::vector<const InvertedIndex*>& parts,
+	const std::vector<std::vector<std::uint32_t>>& ids,
+	const std::vector<std::uint32_t>& line_bases) {
+	std::uint64_t id = 0;
+	std::uint32_t first_line = 0;
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		if (_next_line + lines_num > MAX_LINES) {
+			std::cerr << "index is full, " << lines_num << " lines of " << fname 
+				<< " don't fit into " << MAX_LINES - _next_line << " free line numbers, the file isn't indexed\n";
+			return false;
+		}
+		id = _next_id++;
+		first_line = _next_line;
+		_next_line += static_cast<std::uint32_t>(lines_num);
+	}
+	
+	std::vector<std::uint32_t> bases(line_bases);
+	for (std::uint32_t& base : bases) {
+		base += first_line;
+	}
+	std::uint64_t size = InvertedIndex::Write(segment_path(id).c_str(), table, parts, ids, bases);
+	if (size == 0)
+		return false;
+	std::shared_ptr<const InvertedIndexFile> mapped = map_segment(id);
+	if (!mapped)
+		return false;
+	
+	boost::mutex::scoped_lock lock(_mutex);
+	Segment seg = { id, first_line + 1, static_cast<std::uint32_t>(first_line + lines_num), size, false, mapped };
+	_segments.push_back(seg);
+	InputFile file = { fname, first_line, static_cast<std::uint32_t>(lines_num) };
+	_files.push_back(file);
+	_bytes_flushed += size;
+	return save_manifest();
+}
+
+bool IndexSegments::pick_segments(std::vector<Segment>& inputs) {
+	std::map<unsigned, std::vector<Segment*>> tiers;
+	for (Segment& seg : _segments) {
+		if (!seg.merging)
+			tiers[Tier(seg.size)].push_back(&seg);
+	}
+	for (std::pair<const unsigned, std::vector<Segment*>>& tier : tiers) {
+		if (tier.second.size() < MERGE_FACTOR)
+			continue;
+		// the oldest ones
+		for (std::size_t i = 0; i < MERGE_FACTOR; i++) {
+			tier.second[i]->merging = true;
+			inputs.push_back(*tier.second[i]);
+		}
+		return true;
+	}
+	return false;
+}
+
+void IndexSegments::merge() {
+	while (true) {
+		std::vector<Segment> inputs;
+		std::uint64_t id = 0;
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+			if (!pick_segments(inputs))
+				return;
+			id = _next_id++;
+		}
+		
+		std::uint64_t size = write_merged(id, inputs);
+		std::shared_ptr<const InvertedIndexFile> mapped;
+		if (size != 0)
+			mapped = map_segment(id);
+		
+		boost::mutex::scoped_lock lock(_mutex);
+		if (!mapped) {
+			for (Segment& seg : _segments) {
+				seg.merging = false;
+			}
+			return;
+		}
+		Segment merged = { id, inputs.front().first_line, inputs.front().last_line, size, false, mapped };
+		for (const Segment& input : inputs) {
+			merged.first_line = std::min(merged.first_line, input.first_line);
+			merged.last_line = std::max(merged.last_line, input.last_line);
+			for (std::size_t i = 0; i < _segments.size(); i++) {
+				if (_segments[i].id == input.id) {
+					_segments.erase(_segments.begin() + i);
+					break;
+				}
+			}
+		}
+		_segments.push_back(merged);
+		std::sort(_segments.begin(), _segments.end(), 
+			[](const Segment& a, const Segment& b) { return a.first_line < b.first_line; });
+		_bytes_merged += size;
+		_merges++;
+		if (!save_manifest())
+			return;
+		for (const Segment& input : inputs) {
+			unlink(segment_path(input.id).c_str());
+		}
+	}
+}
+
+std::uint64_t IndexSegments::write_merged(std::uint64_t id, const std::vector<Segment>& inputs) {
+	// the segments cover disjoint ranges of lines,
+	// postings are concatenated in order of the ranges
+	std::vector<Segment> segs(inputs);
+	std::sort(segs.begin(), segs.end(), 
+		[](const Segment& a, const Segment& b) { return a.first_line < b.first_line; });
+	std::vector<const InvertedIndexFile*> files;
+	for (const Segment& seg : segs) {
+		files.push_back(seg.file.get());
+	}
+	
+	InvertedIndex::Header header;
+	std::memcpy(header.magic, InvertedIndex::MAGIC, sizeof(header.magic));
+	header.version = InvertedIndex::VERSION;
+	header.words_num = 0;
+	header.lines_num = 0;
+	std::vector<InvertedIndex::Entry> entries;
+	std::string blob, postings;
+	std::vector<std::uint32_t> lines, part;
+	std::vector<std::size_t> heads(files.size(), 0);
+	while (true) {
+		// the least word among heads of the segments
+		const char* w = NULL;
+		std::size_t len = 0;
+		for (std::size_t k = 0; k < files.size(); k++) {
+			if (heads[k] == files[k]->words_num())
+				continue;
+			const char* kw = files[k]->word(heads[k]);
+			std::size_t klen = files[k]->word_length(heads[k]);
+			int r = (w == NULL) ? -1 : std::memcmp(kw, w, std::min(klen, len));
+			if (r < 0 || (r == 0 && klen < len)) {
+				w = kw;
+				len = klen;
+			}
+		}
+		if (w == NULL)
+			break;
+		
+		lines.clear();
+		for (std::size_t k = 0; k < files.size(); k++) {
+			if (heads[k] == files[k]->words_num() || files[k]->word_length(heads[k]) != len
+				|| std::memcmp(files[k]->word(heads[k]), w, len) != 0)
+				continue;
+			files[k]->postings(heads[k], part);
+			lines.insert(lines.end(), part.begin(), part.end());
+			heads[k]++;
+		}
+		InvertedIndex::Entry e;
+		e.offset = static_cast<std::uint32_t>(blob.size());
+		e.length = static_cast<std::uint32_t>(len);
+		e.postings_offset = postings.size();
+		e.postings_num = static_cast<std::uint32_t>(lines.size());
+		e.reserved = 0;
+		entries.push_back(e);
+		blob.append(w, len);
+		InvertedIndex::EncodePostings(lines, postings);
+		if (!lines.empty())
+			header.lines_num = std::max<std::uint64_t>(header.lines_num, lines.back());
+	}
+	header.words_num = entries.size();
+	return InvertedIndex::WriteFile(segment_path(id).c_str(), header, entries, blob, postings);
+}
+
+void IndexSegments::lines(const char* w, std::size_t len, std::vector<std::uint32_t>& lines) const {
+	std::vector<Segment> segs;
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		segs = _segments;
+	}
+	std::sort(segs.begin(), segs.end(), 
+		[](const Segment& a, const Segment& b) { return a.first_line < b.first_line; });
+	lines.clear();
+	std::vector<std::uint32_t> part;
+	// the copies keep the mappings of the segments, merged meanwhile
+	for (const Segment& seg : segs) {
+		if (seg.file->lines(w, len, part))
+			lines.insert(lines.end(), part.begin(), part.end());
+	}
+}
+
+std::string IndexSegments::locate(std::uint32_t line, std::uint32_t& file_line) const {
+	boost::mutex::scoped_lock lock(_mutex);
+	for (const InputFile& file : _files) {
+		if (line > file.first_line && line <= file.first_line + file.lines_num) {
+			file_line = line - file.first_line;
+			return file.name;
+		}
+	}
+	file_line = line;
+	return std::string();
+}
+
+void IndexSegments::print_state() const {
+	boost::mutex::scoped_lock lock(_mutex);
+	std::cout << "index " << _dir << ": files " << _files.size() 
+		<< " live segments " << _segments.size() << " (tiers";
+	for (const Segment& seg : _segments) {
+		std::cout << " " << Tier(seg.size);
+	}
+	std::cout << ") flushed " << _bytes_flushed << " bytes, merged " << _bytes_merged 
+		<< " bytes in " << _merges << " merges, write amplification " 
+		<< (_bytes_flushed == 0 ? 0.0 : static_cast<double>(_bytes_flushed + _bytes_merged) / _bytes_flushed)
+		<< std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////
+// CooccurrenceCounter implementation
+CooccurrenceCounter::CooccurrenceCounter(std::size_t window, std::size_t max_pairs)
+	: _window(window), _max_pairs(max_pairs), 
+	_recent(window > 1 ? window - 1 : 0), _recent_pos(0), _recent_filled(0),
+	_pairs(0), _pruned(0), _threshold(0)
+	{
+	}
+
+void CooccurrenceCounter::add(std::uint32_t id) {
+	for (std::size_t i = 0; i < _recent_filled; i++) {
+		add_pair(_recent[i], id, 1);
+	}
+	if (_recent.empty())
+		return;
+	_recent[_recent_pos] = id;
+	_recent_pos = (_recent_pos + 1) % _recent.size();
+	_recent_filled = std::min(_recent_filled + 1, _recent.size());
+}
+
+void CooccurrenceCounter::add_pair(std::uint32_t a, std::uint32_t b, std::uint32_t n) {
+	if (a == b)
+		return;
+	NgramKey<2> key = { { std::min(a, b), std::max(a, b) } };
+	_matrix.add(key, n);
+	_pairs += n;
+	if (_matrix.size() > _max_pairs)
+		prune();
+}
+
+void CooccurrenceCounter::prune() {
+	std::vector<std::uint32_t> counts;
+	counts.reserve(_matrix.size());
+	for (const IntCounterTable<NgramKey<2>>::Slot& slot : _matrix.slots()) {
+		if (slot.count != 0)
+			counts.push_back(slot.count);
+	}
+	// the cutoff is the largest count of the pairs, which don't fit into 
+	// three quarters of the limit, the equal counts are pruned too
+	std::size_t keep = _max_pairs / 4 * 3;
+	std::vector<std::uint32_t>::iterator cutoff = counts.end() - keep - 1;
+	std::nth_element(counts.begin(), cutoff, counts.end());
+	_pruned += _matrix.prune(*cutoff);
+	_threshold = std::max(_threshold, *cutoff);
+}
+
+void CooccurrenceCounter::merge(const CooccurrenceCounter& other, const std::vector<std::uint32_t>& ids) {
+	std::uint64_t pairs = _pairs + other._pairs;
+	for (const IntCounterTable<NgramKey<2>>::Slot& slot : other._matrix.slots()) {
+		if (slot.count != 0)
+			add_pair(ids[slot.key.ids[0]], ids[slot.key.ids[1]], slot.count);
+	}
+	_pairs = pairs;
+	_pruned += other._pruned;
+	_threshold = std::max(_threshold, other._threshold);
+}
+
+void CooccurrenceCounter::print_top(std::size_t k, const FrozenTable& table) const {
+	for (const IntCounterTable<NgramKey<2>>::Slot& slot : top_slots(_matrix, k)) {
+		std::cout << "  '" << table.word_str(slot.key.ids[0]) << "' '" 
+			<< table.word_str(slot.key.ids[1]) << "' " << slot.count << std::endl;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// FrozenTable implementation
+FrozenTable FrozenTable::Freeze(const WordCounters& counters) {
+	FrozenTable table;
+	std::size_t blob_size = 0;
+	for (const std::pair<const std::string, std::uint32_t>& p : counters.narrow()) {
+		blob_size += p.first.size();
+	}
+	table._blob.reserve(blob_size);
+	table._entries.reserve(counters.size());
+	// std::map is ordered already, the wide counters are merged in, 
+	// the narrow ones may be spilled already
+	WordCounters::Narrow::const_iterator narrow = counters.narrow().begin();
+	WordCounters::Wide::const_iterator wide = counters.wide().begin();
+	while (narrow != counters.narrow().end() || wide != counters.wide().end()) {
+		if (wide == counters.wide().end() 
+			|| (narrow != counters.narrow().end() && narrow->first < wide->first)) {
+			table.append(narrow->first.data(), narrow->first.size(), narrow->second);
+			++narrow;
+		} else if (narrow == counters.narrow().end() || wide->first < narrow->first) {
+			table.append(wide->first.data(), wide->first.size(), wide->second);
+			++wide;
+		} else {
+			table.append(narrow->first.data(), narrow->first.size(), narrow->second + wide->second);
+			++narrow;
+			++wide;
+		}
+	}
+	return table;
+}
+
+FrozenTable FrozenTable::Freeze(const std::vector<const Counter*>& counters) {
+	FrozenTable table;
+	std::size_t blob_size = 0;
+	for (const Counter* c : counters) {
+		blob_size += c->first.size();
+	}
+	table._blob.reserve(blob_size);
+	table._entries.reserve(counters.size());
+	for (const Counter* c : counters) {
+		table.append(c->first.data(), c->first.size(), c->second);
+	}
+	return table;
+}
+
+FrozenTable FrozenTable::Merge(const std::vector<const FrozenTable*>& tables) {
+	FrozenTable table;
+	std::size_t blob_size = 0, entries_num = 0;
+	for (const FrozenTable* t : tables) {
+		blob_size += t->_blob.size();
+		entries_num += t->size();
+	}
+	table._blob.reserve(blob_size);
+	table._entries.reserve(entries_num);
+	
+	// k-way merge, the number of tables is small so the minimum is found by scan
+	std::vector<std::size_t> heads(tables.size(), 0);
+	while (true) {
+		const FrozenTable* min_table = NULL;
+		std::size_t min_idx = 0;
+		for (std::size_t k = 0; k < tables.size(); k++) {
+			const FrozenTable* t = tables[k];
+			if (heads[k] == t->size())
+				continue;
+			if (min_table == NULL 
+				|| t->compare(heads[k], min_table->word(min_idx), min_table->word_length(min_idx)) < 0) {
+				min_table = t;
+				min_idx = heads[k];
+			}
+		}
+		if (min_table == NULL)
+			break;
+		
+		const char* w = min_table->word(min_idx);
+		std::size_t len = min_table->word_length(min_idx);
+		std::uint64_t count = 0;
+		for (std::size_t k = 0; k < tables.size(); k++) {
+			if (heads[k] != tables[k]->size() && tables[k]->compare(heads[k], w, len) == 0) {
+				count += tables[k]->count(heads[k]);
+				heads[k]++;
+			}
+		}
+		table.append(w, len, count);
+	}
+	return table;
+}
+
+void FrozenTable::append(const char* w, std::size_t len, std::uint64_t count) {
+	Entry e;
+	e.offset = static_cast<std::uint32_t>(_blob.size());
+	e.length = static_cast<std::uint32_t>(len);
+	e.count = (count < WIDE_COUNT) ? static_cast<std::uint32_t>(count) : WIDE_COUNT;
+	if (e.count == WIDE_COUNT)
+		_wide_counts.emplace_back(static_cast<std::uint32_t>(_entries.size()), count);
+	_blob.append(w, len);
+	_entries.push_back(e);
+}
+
+std::uint64_t FrozenTable::wide_count(std::size_t i) const {
+	std::vector<std::pair<std::uint32_t, std::uint64_t>>::const_iterator it = std::lower_bound(
+		_wide_counts.begin(), _wide_counts.end(), std::make_pair(static_cast<std::uint32_t>(i), std::uint64_t(0)));
+	return it->second;
+}
+
+int FrozenTable::compare(std::size_t i, const char* w, std::size_t len) const {
+	std::size_t l = word_length(i);
+	int r = std::memcmp(word(i), w, std::min(l, len));
+	if (r != 0)
+		return r;
+	return l < len ? -1 : (l > len ? 1 : 0);
+}
+
+std::size_t FrozenTable::lower_bound(const char* w, std::size_t len) const {
+	std::size_t lo = 0, hi = size();
+	while (lo < hi) {
+		std::size_t mid = lo + (hi - lo) / 2;
+		if (compare(mid, w, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// high bit of displacement marks the bucket of single key, placed directly
+static const std::uint32_t MPH_DIRECT = 0x80000000U;
+
+static inline std::size_t mph_slot(std::uint64_t h, std::uint32_t seed, std::size_t n) {
+	std::uint64_t x = (h + seed) * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 31;
+	return static_cast<std::size_t>(x % n);
+}
+
+std::size_t FrozenTable::find(const char* w, std::size_t len) const {
+	if (!has_perfect_hash()) {
+		std::size_t i = lower_bound(w, len);
+		return (i != size() && compare(i, w, len) == 0) ? i : npos;
+	}
+	std::uint64_t h = hash_bytes(w, len);
+	std::uint32_t seed = _mph_seeds[(h >> 32) % _mph_seeds.size()];
+	std::size_t slot = (seed & MPH_DIRECT) ? (seed & ~MPH_DIRECT) : mph_slot(h, seed, size());
+	std::size_t i = _mph_slots[slot];
+	return compare(i, w, len) == 0 ? i : npos;
+}
+
+bool FrozenTable::build_perfect_hash() {
+	const std::size_t n = size();
+	if (n == 0)
+		return false;
+	
+	// hash and displace: keys are distributed into buckets of ~4 keys,
+	// then starting from the largest bucket the displacement is searched
+	// which puts all keys of the bucket into free slots
+	const std::size_t buckets_num = n / 4 + 1;
+	std::vector<std::uint64_t> hashes(n);
+	std::vector<std::vector<std::uint32_t>> buckets(buckets_num);
+	for (std::size_t i = 0; i < n; i++) {
+		hashes[i] = hash_bytes(word(i), word_length(i));
+		buckets[(hashes[i] >> 32) % buckets_num].push_back(static_cast<std::uint32_t>(i));
+	}
+	std::vector<std::uint32_t> order(buckets_num);
+	for (std::size_t b = 0; b < buckets_num; b++) {
+		order[b] = static_cast<std::uint32_t>(b);
+	}
+	std::sort(order.begin(), order.end(), [&buckets](std::uint32_t a, std::uint32_t b) {
+		return buckets[a].size() > buckets[b].size();
+	});
+	
+	static const std::uint32_t MAX_SEED = 1U << 24;
+	std::vector<std::uint32_t> seeds(buckets_num, 0);
+	std::vector<std::uint32_t> slots(n, 0);
+	std::vector<bool> taken(n, false);
+	std::vector<std::size_t> bucket_slots;
+	std::size_t free_slot = 0;
+	for (std::uint32_t b : order) {
+		const std::vector<std::uint32_t>& keys = buckets[b];
+		if (keys.empty())
+			break;
+		if (keys.size() == 1) {
+			// any free slot fits, no need to search
+			while (taken[free_slot])
+				free_slot++;
+			taken[free_slot] = true;
+			slots[free_slot] = keys[0];
+			seeds[b] = MPH_DIRECT | static_cast<std::uint32_t>(free_slot);
+			continue;
+		}
+		std::uint32_t seed = 0;
+		for (; seed < MAX_SEED; seed++) {
+			bucket_slots.clear();
+			for (std::uint32_t k : keys) {
+				std::size_t slot = mph_slot(hashes[k], seed, n);
+				if (taken[slot] 
+					|| std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end())
+					break;
+				bucket_slots.push_back(slot);
+			}
+			if (bucket_slots.size() == keys.size())
+				break;
+		}
+		if (seed == MAX_SEED)
+			return false;
+		for (std::size_t j = 0; j < keys.size(); j++) {
+			taken[bucket_slots[j]] = true;
+			slots[bucket_slots[j]] = keys[j];
+		}
+		seeds[b] = seed;
+	}
+	_mph_seeds.swap(seeds);
+	_mph_slots.swap(slots);
+	return true;
+}
+
+std::uint64_t FrozenTable::words_total() const {
+	std::uint64_t total = 0;
+	for (const Entry& e : _entries) {
+		if (e.count != WIDE_COUNT)
+			total += e.count;
+	}
+	for (const std::pair<std::uint32_t, std::uint64_t>& p : _wide_counts) {
+		total += p.second;
+	}
+	return total;
+}
+
+std::size_t FrozenTable::memory_usage() const {
+	return _blob.size() + _entries.size() * sizeof(Entry) 
+		+ _wide_counts.size() * sizeof(std::pair<std::uint32_t, std::uint64_t>)
+		+ (_mph_seeds.size() + _mph_slots.size()) * sizeof(std::uint32_t);
+}
+
+std::uint64_t FrozenTable::write(const char* path) const {
+	FrozenTableFile::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, FrozenTableFile::MAGIC, sizeof(header.magic));
+	header.version = FrozenTableFile::VERSION;
+	header.words_num = size();
+	header.words_total = words_total();
+	std::uint64_t max_count = 0;
+	for (std::size_t i = 0; i < size(); i++) {
+		max_count = std::max(max_count, count(i));
+	}
+	header.count_bits = 1;
+	while (header.count_bits < 64 && (max_count >> header.count_bits) != 0)
+		header.count_bits++;
+	header.mph_seeds_num = static_cast<std::uint32_t>(_mph_seeds.size());
+	
+	// the sections are built in memory, each one padded to 8 bytes boundary
+	// and followed by 8 bytes for unaligned loads
+	std::string data;
+	std::function<std::uint64_t (const void*, std::size_t)> add_section = 
+		[&data](const void* p, std::size_t n) {
+			std::uint64_t offset = sizeof(FrozenTableFile::Header) + data.size();
+			data.append(static_cast<const char*>(p), n);
+			data.resize((data.size() + 7) / 8 * 8 + 8, '\0');
+			return offset;
+		};
+	std::vector<std::uint32_t> offsets;
+	offsets.reserve(size() + 1);
+	for (const Entry& e : _entries) {
+		offsets.push_back(e.offset);
+	}
+	offsets.push_back(static_cast<std::uint32_t>(_blob.size()));
+	header.offsets_offset = add_section(offsets.data(), offsets.size() * sizeof(std::uint32_t));
+	header.blob_offset = add_section(_blob.data(), _blob.size());
+	std::vector<std::uint64_t> counts((size() * header.count_bits + 63) / 64, 0);
+	for (std::size_t i = 0; i < size(); i++) {
+		std::uint64_t bit_pos = i * header.count_bits;
+		std::uint64_t v = count(i);
+		counts[bit_pos / 64] |= v << (bit_pos % 64);
+		if (bit_pos % 64 + header.count_bits > 64)
+			counts[bit_pos / 64 + 1] |= v >> (64 - bit_pos % 64);
+	}
+	header.counts_offset = add_section(counts.data(), counts.size() * sizeof(std::uint64_t));
+	if (!_mph_seeds.empty()) {
+		std::vector<std::uint32_t> mph(_mph_seeds);
+		mph.insert(mph.end(), _mph_slots.begin(), _mph_slots.end());
+		header.mph_offset = add_section(mph.data(), mph.size() * sizeof(std::uint32_t));
+	}
+	header.file_size = sizeof(header) + data.size();
+	header.data_checksum = hash_bytes(data.data(), data.size());
+	header.header_checksum = hash_bytes(reinterpret_cast<const char*>(&header), offsetof(FrozenTableFile::Header, header_checksum));
+	
+	int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("open()");
+		std::cerr << "couldn't create table file " << path << std::endl;
+		return 0;
+	}
+	bool ok = write_file(fd, &header, sizeof(header)) && write_file(fd, data.data(), data.size());
+	if (::close(fd) != 0 || !ok) {
+		perror("write()");
+		std::cerr << "couldn't write table file " << path << std::endl;
+		return 0;
+	}
+	return header.file_size;
+}
+
+////////////////////////////////////////////////////////////////////////
+// FrozenTableFile implementation
+const char FrozenTableFile::MAGIC[4] = { 'W', 'C', 'T', 'B' };
+
+FrozenTableFile::FrozenTableFile()
+	: _data(MAP_FAILED), _size(0), _header(NULL), _offsets(NULL), _blob(NULL), _counts(NULL), 
+	_count_mask(0), _mph_seeds(NULL), _mph_slots(NULL)
+	{
+	}
+
+FrozenTableFile::~FrozenTableFile()
+{
+	close();
+}
+
+void FrozenTableFile::close() {
+	if (_data != MAP_FAILED)
+		munmap(_data, _size);
+	_data = MAP_FAILED;
+	_header = NULL;
+}
+
+bool FrozenTableFile::open(const char* path) {
+	if (_data != MAP_FAILED)
+		return true;
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open()");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+		std::cerr << "wrong table file " << path << std::endl;
+		::close(fd);
+		return false;
+	}
+	_size = st.st_size;
+	_data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (_data == MAP_FAILED) {
+		perror("mmap()");
+		return false;
+	}
+	
+	const Header* h = static_cast<const Header*>(_data);
+	// each section has to fit into the file, with the padding after it
+	std::function<bool (std::uint64_t, std::uint64_t)> fits = [this](std::uint64_t offset, std::uint64_t size) {
+		return offset % 8 == 0 && offset >= sizeof(Header) && offset <= _size && size <= _size
+			&& (size + 7) / 8 * 8 + 8 <= _size - offset;
+	};
+	bool valid = std::memcmp(h->magic, MAGIC, sizeof(h->magic)) == 0
+		&& h->version == VERSION
+		&& h->header_checksum == hash_bytes(reinterpret_cast<const char*>(h), offsetof(Header, header_checksum))
+		&& h->file_size == _size
+		&& h->words_num < 0xffffffffULL
+		&& h->count_bits != 0 && h->count_bits <= 64
+		&& fits(h->offsets_offset, (h->words_num + 1) * sizeof(std::uint32_t))
+		&& fits(h->counts_offset, (h->words_num * h->count_bits + 7) / 8)
+		&& (h->mph_seeds_num == 0 || fits(h->mph_offset, (h->mph_seeds_num + h->words_num) * sizeof(std::uint32_t)));
+	if (valid) {
+		const char* base = static_cast<const char*>(_data);
+		_offsets = reinterpret_cast<const std::uint32_t*>(base + h->offsets_offset);
+		// the words are in the order of the blob
+		valid = fits(h->blob_offset, _offsets[h->words_num]);
+	}
+	if (!valid) {
+		std::cerr << "wrong table file " << path << std::endl;
+		close();
+		return false;
+	}
+	_header = h;
+	_blob = static_cast<const char*>(_data) + h->blob_offset;
+	_counts = static_cast<const char*>(_data) + h->counts_offset;
+	_count_mask = (h->count_bits == 64) ? ~0ULL : (1ULL << h->count_bits) - 1;
+	if (h->mph_seeds_num != 0) {
+		_mph_seeds = reinterpret_cast<const std::uint32_t*>(static_cast<const char*>(_data) + h->mph_offset);
+		_mph_slots = _mph_seeds + h->mph_seeds_num;
+	}
+	return true;
+}
+
+bool FrozenTableFile::verify() const {
+	const char* data = static_cast<const char*>(_data) + sizeof(Header);
+	if (hash_bytes(data, _size - sizeof(Header)) != _header->data_checksum)
+		return false;
+	// the words may be accessed by offsets safely
+	for (std::size_t i = 0; i < size(); i++) {
+		if (_offsets[i] > _offsets[i + 1])
+			return false;
+	}
+	if (has_perfect_hash()) {
+		for (std::size_t i = 0; i < size(); i++) {
+			if (_mph_slots[i] >= size())
+				return false;
+		}
+	}
+	return true;
+}
+
+int FrozenTableFile::compare(std::size_t i, const char* w, std::size_t len) const {
+	std::size_t l = word_length(i);
+	int r = std::memcmp(word(i), w, std::min(l, len));
+	if (r != 0)
+		return r;
+	return l < len ? -1 : (l > len ? 1 : 0);
+}
+
+std::size_t FrozenTableFile::find(const char* w, std::size_t len) const {
+	if (size() == 0)
+		return npos;
+	if (has_perfect_hash()) {
+		// as FrozenTable::find()
+		std::uint64_t h = hash_bytes(w, len);
+		std::uint32_t seed = _mph_seeds[(h >> 32) % _header->mph_seeds_num];
+		std::size_t slot = (seed & MPH_DIRECT) ? (seed & ~MPH_DIRECT) : mph_slot(h, seed, size());
+		std::size_t i = (slot < size()) ? _mph_slots[slot] : npos;
+		return (i < size() && compare(i, w, len) == 0) ? i : npos;
+	}
+	std::size_t lo = 0, hi = size();
+	while (lo < hi) {
+		std::size_t mid = lo + (hi - lo) / 2;
+		if (compare(mid, w, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo != size() && compare(lo, w, len) == 0) ? lo : npos;
+}
+
+////////////////////////////////////////////////////////////////////////
+// BurstTrie implementation
+BurstTrie::BurstTrie()
+	: _size(0)
+	{
+		new_node();
+	}
+
+std::size_t BurstTrie::new_node() {
+	_nodes.push_back(Node());
+	Node& node = _nodes.back();
+	std::memset(node.children, 0, sizeof(node.children));
+	node.count = 0;
+	node.has_value = false;
+	return _nodes.size() - 1;
+}
+
+void BurstTrie::insert(const char* w, std::size_t len, std::uint32_t count) {
+	std::size_t node = 0;
+	std::size_t pos = 0;
+	while (true) {
+		if (pos == len) {
+			if (!_nodes[node].has_value)
+				_size++;
+			_nodes[node].has_value = true;
+			_nodes[node].count += count;
+			return;
+		}
+		unsigned char c = static_cast<unsigned char>(w[pos]);
+		std::int32_t child = _nodes[node].children[c];
+		if (child > 0) {
+			node = child - 1;
+			pos++;
+			continue;
+		}
+		if (child == 0) {
+			_containers.push_back(Container());
+			child = ContainerRef(_containers.size() - 1);
+			_nodes[node].children[c] = child;
+		}
+		Container& container = _containers[-child - 1];
+		// suffix length is stored in one byte, longer words go deeper
+		if (len - pos - 1 > UINT8_MAX) {
+			burst(node, c);
+			continue;
+		}
+		insert_into(container, w + pos + 1, len - pos - 1, count);
+		if (container.size() > BURST_THRESHOLD)
+			burst(node, c);
+		return;
+	}
+}
+
+void BurstTrie::insert_into(Container& c, const char* suffix, std::size_t len, std::uint32_t count) {
+	std::size_t pos = 0;
+	while (pos < c.size()) {
+		std::size_t l = static_cast<unsigned char>(c[pos]);
+		int r = std::memcmp(c.data() + pos + 1, suffix, std::min(l, len));
+		if (r == 0)
+			r = (l < len) ? -1 : (l > len ? 1 : 0);
+		if (r == 0) {
+			std::uint32_t n = 0;
+			std::memcpy(&n, c.data() + pos + 1 + l, sizeof(n));
+			n += count;
+			std::memcpy(&c[pos + 1 + l], &n, sizeof(n));
+			return;
+		}
+		if (r > 0)
+			break;
+		pos += 1 + l + sizeof(std::uint32_t);
+	}
+	char entry[1 + UINT8_MAX + sizeof(std::uint32_t)];
+	entry[0] = static_cast<char>(len);
+	std::memcpy(entry + 1, suffix, len);
+	std::memcpy(entry + 1 + len, &count, sizeof(count));
+	c.insert(pos, entry, 1 + len + sizeof(count));
+	_size++;
+}
+
+void BurstTrie::burst(std::size_t node, unsigned char c) {
+	std::size_t container = -_nodes[node].children[c] - 1;
+	Container old;
+	old.swap(_containers[container]);
+	std::size_t child = new_node();
+	_nodes[node].children[c] = NodeRef(child);
+	
+	// the entries are sorted, so appending keeps new containers sorted.
+	// the old container is reused for the first new one
+	bool reused = false;
+	for (std::size_t pos = 0; pos < old.size(); ) {
+		std::size_t l = static_cast<unsigned char>(old[pos]);
+		std::uint32_t n = 0;
+		std::memcpy(&n, old.data() + pos + 1 + l, sizeof(n));
+		if (l == 0) {
+			_nodes[child].has_value = true;
+			_nodes[child].count = n;
+		} else {
+			unsigned char first = static_cast<unsigned char>(old[pos + 1]);
+			std::int32_t ref = _nodes[child].children[first];
+			if (ref == 0) {
+				if (!reused) {
+					ref = ContainerRef(container);
+					reused = true;
+				} else {
+					_containers.push_back(Container());
+					ref = ContainerRef(_containers.size() - 1);
+				}
+				_nodes[child].children[first] = ref;
+			}
+			Container& dst = _containers[-ref - 1];
+			dst.push_back(static_cast<char>(l - 1));
+			dst.append(old.data() + pos + 2, l - 1 + sizeof(n));
+		}
+		pos += 1 + l + sizeof(n);
+	}
+}
+
+bool BurstTrie::find(const char* w, std::size_t len, std::uint32_t& count) const {
+	std::size_t node = 0;
+	for (std::size_t pos = 0; ; pos++) {
+		if (pos == len) {
+			count = _nodes[node].count;
+			return _nodes[node].has_value;
+		}
+		std::int32_t child = _nodes[node].children[static_cast<unsigned char>(w[pos])];
+		if (child == 0)
+			return false;
+		if (child > 0) {
+			node = child - 1;
+			continue;
+		}
+		const Container& c = _containers[-child - 1];
+		const char* suffix = w + pos + 1;
+		std::size_t suffix_len = len - pos - 1;
+		for (std::size_t i = 0; i < c.size(); ) {
+			std::size_t l = static_cast<unsigned char>(c[i]);
+			if (l == suffix_len && std::memcmp(c.data() + i + 1, suffix, l) == 0) {
+				std::memcpy(&count, c.data() + i + 1 + l, sizeof(count));
+				return true;
+			}
+			i += 1 + l + sizeof(count);
+		}
+		return false;
+	}
+}
+
+void BurstTrie::for_each_prefix(const char* prefix, std::size_t len, const Visitor& visitor) const {
+	std::string path;
+	std::size_t node = 0;
+	for (std::size_t pos = 0; pos < len; pos++) {
+		unsigned char c = static_cast<unsigned char>(prefix[pos]);
+		std::int32_t child = _nodes[node].children[c];
+		if (child == 0)
+			return;
+		path.push_back(static_cast<char>(c));
+		if (child < 0) {
+			visit_container(_containers[-child - 1], path, prefix + pos + 1, len - pos - 1, 
+				NULL, NULL, visitor);
+			return;
+		}
+		node = child - 1;
+	}
+	visit_node(node, path, NULL, NULL, visitor);
+}
+
+void BurstTrie::for_each_range(const std::string& lo, const std::string& hi, const Visitor& visitor) const {
+	std::string path;
+	visit_node(0, path, &lo, &hi, visitor);
+}
+
+bool BurstTrie::visit_node(std::size_t node, std::string& path, const std::string* lo, 
+	const std::string* hi, const Visitor& visitor) const {
+	const Node& n = _nodes[node];
+	if (n.has_value && (lo == NULL || path >= *lo)) {
+		if (hi != NULL && path >= *hi)
+			return false;
+		if (!visitor(path, n.count))
+			return false;
+	}
+	for (std::size_t c = 0; c < 256; c++) {
+		std::int32_t child = n.children[c];
+		if (child == 0)
+			continue;
+		path.push_back(static_cast<char>(c));
+		// the whole subtree is less than lower bound
+		bool skip = lo != NULL && path.compare(0, path.size(), *lo, 0, path.size()) < 0;
+		bool proceed = true;
+		if (!skip) {
+			proceed = (child > 0) 
+				? visit_node(child - 1, path, lo, hi, visitor)
+				: visit_container(_containers[-child - 1], path, NULL, 0, lo, hi, visitor);
+		}
+		path.pop_back();
+		if (!proceed)
+			return false;
+	}
+	return true;
+}
+
+bool BurstTrie::visit_container(const Container& c, std::string& path, const char* filter, std::size_t filter_len,
+	const std::string* lo, const std::string* hi, const Visitor& visitor) const {
+	const std::size_t path_len = path.size();
+	for (std::size_t i = 0; i < c.size(); ) {
+		std::size_t l = static_cast<unsigned char>(c[i]);
+		const char* suffix = c.data() + i + 1;
+		std::uint32_t count = 0;
+		std::memcpy(&count, suffix + l, sizeof(count));
+		i += 1 + l + sizeof(count);
+		if (l < filter_len || std::memcmp(suffix, filter, filter_len) != 0)
+			continue;
+		path.append(suffix, l);
+		bool proceed = true;
+		if (lo == NULL || path >= *lo) {
+			proceed = !(hi != NULL && path >= *hi) && visitor(path, count);
+		}
+		path.resize(path_len);
+		if (!proceed)
+			return false;
+	}
+	return true;
+}
+
+std::size_t BurstTrie::memory_usage() const {
+	std::size_t size = _nodes.capacity() * sizeof(Node) + _containers.capacity() * sizeof(Container);
+	for (const Container& c : _containers) {
+		// short strings are stored inside of std::string
+		if (c.capacity() > 15)
+			size += c.capacity() + 1;
+	}
+	return size;
+}
+
+static std::size_t heap_in_use() {
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static double seconds_since(const struct timespec& start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void compare_key_stores(const FrozenTable& table, BurstTrie& trie) {
+	struct timespec start;
+	
+	std::size_t heap = heap_in_use();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// the trie keeps 32-bit counts, the wide ones saturate
+	for (std::size_t i = 0; i < table.size(); i++) {
+		trie.insert(table.word(i), table.word_length(i), 
+			static_cast<std::uint32_t>(std::min<std::uint64_t>(table.count(i), FrozenTable::WIDE_COUNT)));
+	}
+	double trie_build = seconds_since(start);
+	std::size_t trie_memory = heap_in_use() - heap;
+	
+	heap = heap_in_use();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::map<std::string, std::uint32_t> map;
+	for (std::size_t i = 0; i < table.size(); i++) {
+		map.emplace(table.word_str(i), static_cast<std::uint32_t>(std::min<std::uint64_t>(table.count(i), FrozenTable::WIDE_COUNT)));
+	}
+	double map_build = seconds_since(start);
+	std::size_t map_memory = heap_in_use() - heap;
+	
+	// prefixes of 1-3 characters taken from words spread over the table
+	std::vector<std::string> prefixes;
+	for (std::size_t i = 0; i < 1000 && table.size() != 0; i++) {
+		std::size_t idx = (i * 7919) % table.size();
+		prefixes.push_back(std::string(table.word(idx), std::min<std::size_t>(table.word_length(idx), 1 + i % 3)));
+	}
+	std::uint64_t trie_found = 0, map_found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (const std::string& p : prefixes) {
+		trie.for_each_prefix(p.data(), p.size(), [&trie_found](const std::string&, std::uint32_t n) {
+			trie_found += n;
+			return true;
+		});
+	}
+	double trie_query = seconds_since(start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (const std::string& p : prefixes) {
+		for (std::map<std::string, std::uint32_t>::const_iterator it = map.lower_bound(p);
+			it != map.end() && it->first.compare(0, p.size(), p) == 0; ++it) {
+			map_found += it->second;
+		}
+	}
+	double map_query = seconds_since(start);
+	if (trie_found != map_found) {
+		std::cerr << "prefix queries mismatch, trie " << trie_found << " map " << map_found << std::endl;
+	}
+	
+	std::cout << "key stores, " << table.size() << " words, " << prefixes.size() << " prefix queries\n"
+		<< "  trie:     build " << trie_build << " sec, memory " << trie_memory 
+		<< " bytes, prefix query " << trie_query / prefixes.size() * 1e6 << " usec\n"
+		<< "  std::map: build " << map_build << " sec, memory " << map_memory 
+		<< " bytes, prefix query " << map_query / prefixes.size() * 1e6 << " usec\n";
+}
+
+////////////////////////////////////////////////////////////////////////
+// ResultWriter implementation
+namespace {
+
+const char DIGIT_PAIRS[] = 
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// as std::to_chars of C++17, returns the end of the digits
+char* format_decimal(char* out, std::uint64_t v) {
+	char buf[20];
+	char* p = buf + sizeof(buf);
+	while (v >= 100) {
+		p -= 2;
+		std::memcpy(p, DIGIT_PAIRS + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		std::memcpy(p, DIGIT_PAIRS + v * 2, 2);
+	} else {
+		*--p = static_cast<char>('0' + v);
+	}
+	std::size_t n = buf + sizeof(buf) - p;
+	std::memcpy(out, p, n);
+	return out + n;
+}
+
+} // namespace
+
+ResultWriter::ResultWriter(const FrozenTable& table, boost::threadpool::pool& tp, std::size_t parts)
+	: _table(table), _tp(tp), _parts(std::max<std::size_t>(1, parts)), _bytes(0), _sort_time(0), _write_time(0)
+	{
+	}
+
+bool ResultWriter::ParseFormat(const char* name, Format& format) {
+	if (std::strcmp(name, "text") == 0)
+		format = TEXT;
+	else if (std::strcmp(name, "csv") == 0)
+		format = CSV;
+	else if (std::strcmp(name, "binary") == 0)
+		format = BINARY;
+	else
+		return false;
+	return true;
+}
+
+void ResultWriter::radix_sort(std::uint32_t* data, std::uint32_t* tmp, std::size_t size) const {
+	// by descending counts, so the keys are max - count, 
+	// there are as many passes as the bytes of max count
+	std::uint64_t max = 0;
+	for (std::size_t i = 0; i < size; i++) {
+		max = std::max(max, _table.count(data[i]));
+	}
+	for (unsigned shift = 0; shift < 64 && (max >> shift) != 0; shift += 8) {
+		std::size_t offsets[256] = { 0 };
+		for (std::size_t i = 0; i < size; i++) {
+			offsets[((max - _table.count(data[i])) >> shift) & 0xff]++;
+		}
+		// the pass is skipped if all the digits are the same
+		if (offsets[((max - _table.count(data[0])) >> shift) & 0xff] == size)
+			continue;
+		std::size_t sum = 0;
+		for (std::size_t d = 0; d < 256; d++) {
+			std::size_t n = offsets[d];
+			offsets[d] = sum;
+			sum += n;
+		}
+		for (std::size_t i = 0; i < size; i++) {
+			tmp[offsets[((max - _table.count(data[i])) >> shift) & 0xff]++] = data[i];
+		}
+		std::memcpy(data, tmp, size * sizeof(std::uint32_t));
+	}
+}
+
+void ResultWriter::sort() {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::size_t size = _table.size();
+	_order.resize(size);
+	std::vector<std::uint32_t> tmp(size);
+	// the runs of sorted entries, boundaries[k] is the beginning of k-th one
+	std::vector<std::size_t> boundaries;
+	for (std::size_t k = 0; k <= _parts; k++) {
+		boundaries.push_back(size * k / _parts);
+	}
+	for (std::size_t k = 0; k < _parts; k++) {
+		_tp.schedule([this, &tmp, &boundaries, k]() {
+			std::size_t begin = boundaries[k], end = boundaries[k + 1];
+			for (std::size_t i = begin; i < end; i++) {
+				_order[i] = static_cast<std::uint32_t>(i);
+			}
+			radix_sort(_order.data() + begin, tmp.data() + begin, end - begin);
+		});
+	}
+	_tp.wait();
+	
+	std::function<bool (std::uint32_t, std::uint32_t)> less = 
+		[this](std::uint32_t a, std::uint32_t b) { return this->less(a, b); };
+	while (boundaries.size() > 2) {
+		std::vector<std::size_t> merged;
+		for (std::size_t k = 0; k + 1 < boundaries.size(); k += 2) {
+			merged.push_back(boundaries[k]);
+			// the last run without a pair is copied
+			std::size_t begin = boundaries[k], middle = boundaries[k + 1];
+			std::size_t end = boundaries[std::min(k + 2, boundaries.size() - 1)];
+			_tp.schedule([this, &tmp, &less, begin, middle, end]() {
+				std::merge(_order.begin() + begin, _order.begin() + middle, 
+					_order.begin() + middle, _order.begin() + end, tmp.begin() + begin, less);
+			});
+		}
+		merged.push_back(size);
+		_tp.wait();
+		_order.swap(tmp);
+		boundaries.swap(merged);
+	}
+	_sort_time = seconds_since(start);
+}
+
+void ResultWriter::format(std::size_t begin, std::size_t end, Format format, std::string& out) const {
+	std::size_t size = 0;
+	for (std::size_t i = begin; i < end; i++) {
+		// the word may be quoted in CSV, every its char doubled at worst
+		size += 2 * _table.word_length(_order[i]) + 2 + 20 + 1;
+	}
+	out.resize(size);
+	char* p = &out[0];
+	for (std::size_t i = begin; i < end; i++) {
+		std::uint32_t e = _order[i];
+		const char* w = _table.word(e);
+		std::uint32_t len = static_cast<std::uint32_t>(_table.word_length(e));
+		std::uint64_t count = _table.count(e);
+		switch (format) {
+		case TEXT:
+			std::memcpy(p, w, len);
+			p += len;
+			*p++ = ' ';
+			p = format_decimal(p, count);
+			*p++ = '\n';
+			break;
+		case CSV:
+			if (std::find_if(w, w + len, [](char c) { return c == ',' || c == '"' || c == '\r' || c == '\n'; }) == w + len) {
+				std::memcpy(p, w, len);
+				p += len;
+			} else {
+				*p++ = '"';
+				for (const char* c = w; c != w + len; c++) {
+					if (*c == '"')
+						*p++ = '"';
+					*p++ = *c;
+				}
+				*p++ = '"';
+			}
+			*p++ = ',';
+			p = format_decimal(p, count);
+			*p++ = '\n';
+			break;
+		case BINARY:
+			std::memcpy(p, &count, sizeof(count));
+			std::memcpy(p + sizeof(count), &len, sizeof(len));
+			p += sizeof(count) + sizeof(len);
+			std::memcpy(p, w, len);
+			p += len;
+			break;
+		}
+	}
+	out.resize(p - out.data());
+}
+
+bool ResultWriter::write(const char* fname, Format format) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open()");
+		return false;
+	}
+	std::string header;
+	if (format == CSV) {
+		header = "word,count\n";
+	} else if (format == BINARY) {
+		std::uint32_t reserved = 0;
+		std::uint64_t entries = _table.size(), words = _table.words_total();
+		header.append("WCR1", 4);
+		header.append(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+		header.append(reinterpret_cast<const char*>(&entries), sizeof(entries));
+		header.append(reinterpret_cast<const char*>(&words), sizeof(words));
+	}
+	bool ok = write_file(fd, header.data(), header.size());
+	_bytes = header.size();
+	
+	std::vector<std::string> buffers(_parts);
+	std::vector<struct iovec> iov(_parts);
+	for (std::size_t batch = 0; ok && batch < _order.size(); batch += BATCH_SIZE) {
+		std::size_t size = (_order.size() - batch < BATCH_SIZE) ? _order.size() - batch : BATCH_SIZE;
+		for (std::size_t k = 0; k < _parts; k++) {
+			_tp.schedule([this, &buffers, format, batch, size, k]() {
+				this->format(batch + size * k / _parts, batch + size * (k + 1) / _parts, format, buffers[k]);
+			});
+		}
+		_tp.wait();
+		std::size_t iov_num = 0;
+		for (std::size_t k = 0; k < _parts; k++) {
+			if (buffers[k].empty())
+				continue;
+			iov[iov_num].iov_base = &buffers[k][0];
+			iov[iov_num].iov_len = buffers[k].size();
+			iov_num++;
+		}
+		// writev() may write a part of the buffers
+		for (std::size_t i = 0; ok && i < iov_num; ) {
+			ssize_t n = writev(fd, &iov[i], static_cast<int>(std::min<std::size_t>(iov_num - i, IOV_MAX)));
+			if (n < 0) {
+				if (errno != EINTR)
+					ok = false;
+				continue;
+			}
+			_bytes += n;
+			for (std::size_t left = n; left != 0; ) {
+				std::size_t m = std::min(left, iov[i].iov_len);
+				iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + m;
+				iov[i].iov_len -= m;
+				left -= m;
+				if (iov[i].iov_len == 0)
+					i++;
+			}
+		}
+	}
+	if (!ok)
+		perror("writev()");
+	if (::close(fd) != 0)
+		ok = false;
+	_write_time = seconds_since(start);
+	return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+// QueryServer implementation
+QueryServer::QueryServer(const FrozenTable& table)
+	: _table(table), _listen_fd(-1), _epoll_fd(-1)
+	{
+		_by_count.resize(table.size());
+		for (std::size_t i = 0; i < _by_count.size(); i++) {
+			_by_count[i] = static_cast<std::uint32_t>(i);
+		}
+		// stable, so words of equal count stay alphabetically ordered
+		std::stable_sort(_by_count.begin(), _by_count.end(), 
+			[&table](std::uint32_t a, std::uint32_t b) { return table.count(a) > table.count(b); });
+	}
+
+QueryServer::~QueryServer()
+{
+	for (const std::pair<const int, Connection>& p : _connections) {
+		::close(p.first);
+	}
+	if (_epoll_fd != -1)
+		::close(_epoll_fd);
+	if (_listen_fd != -1) {
+		::close(_listen_fd);
+		unlink(_path.c_str());
+	}
+}
+
+bool QueryServer::listen(const char* path) {
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(addr.sun_path)) {
+		std::cerr << "socket path is too long: " << path << std::endl;
+		return false;
+	}
+	std::strcpy(addr.sun_path, path);
+	
+	_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (_listen_fd == -1) {
+		perror("socket()");
+		return false;
+	}
+	unlink(path);
+	if (bind(_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		perror("bind()");
+		std::cerr << "couldn't bind socket to " << path << std::endl;
+		return false;
+	}
+	_path = path;
+	if (::listen(_listen_fd, SOMAXCONN) != 0) {
+		perror("listen()");
+		return false;
+	}
+	
+	_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epoll_fd == -1) {
+		perror("epoll_create1()");
+		return false;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = _listen_fd;
+	if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &ev) != 0) {
+		perror("epoll_ctl()");
+		return false;
+	}
+	return true;
+}
+
+void QueryServer::run(const std::atomic<bool>& running) {
+	static const int MAX_EVENTS = 64;
+	// signals are handled by separate thread, so the flag is polled
+	static const int TIMEOUT_MS = 100;
+	struct epoll_event events[MAX_EVENTS];
+	
+	while (running.load()) {
+		int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, TIMEOUT_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == _listen_fd) {
+				int conn_fd = -1;
+				while ((conn_fd = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.fd = conn_fd;
+					if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) != 0) {
+						perror("epoll_ctl()");
+						::close(conn_fd);
+						continue;
+					}
+					_connections[conn_fd];
+				}
+				continue;
+			}
+			
+			std::map<int, Connection>::iterator it = _connections.find(fd);
+			if (it == _connections.end())
+				continue;
+			bool ok = true;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ok = on_readable(fd, it->second);
+			if (ok && (events[i].events & EPOLLOUT))
+				ok = on_writable(fd, it->second);
+			if (!ok)
+				close_connection(fd);
+		}
+	}
+}
+
+bool QueryServer::on_readable(int fd, Connection& conn) {
+	char buffer[64 * 1024];
+	while (true) {
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n > 0) {
+			conn.in.append(buffer, n);
+			continue;
+		}
+		if (n == 0)
+			return false; // peer closed connection
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		return false;
+	}
+	if (!process_requests(conn))
+		return false;
+	return on_writable(fd, conn);
+}
+
+bool QueryServer::on_writable(int fd, Connection& conn) {
+	while (conn.out_pos < conn.out.size()) {
+		ssize_t n = write(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos);
+		if (n >= 0) {
+			conn.out_pos += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		break;
+	}
+	
+	bool pending = conn.out_pos < conn.out.size();
+	if (!pending) {
+		conn.out.clear();
+		conn.out_pos = 0;
+	}
+	struct epoll_event ev;
+	ev.events = pending ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+bool QueryServer::process_requests(Connection& conn) {
+	std::size_t pos = 0;
+	while (conn.in.size() - pos >= sizeof(std::uint32_t)) {
+		std::uint32_t body_len = 0;
+		std::memcpy(&body_len, conn.in.data() + pos, sizeof(body_len));
+		if (body_len > MAX_REQUEST_SIZE)
+			return false;
+		if (conn.in.size() - pos - sizeof(body_len) < body_len)
+			break; // incomplete request
+		
+		const char* body = conn.in.data() + pos + sizeof(body_len);
+		std::size_t response_pos = conn.out.size();
+		std::uint32_t response_len = 0;
+		conn.out.append(reinterpret_cast<const char*>(&response_len), sizeof(response_len));
+		
+		std::size_t q = 0;
+		while (q < body_len) {
+			if (body_len - q < 3)
+				return false;
+			std::uint8_t op = static_cast<std::uint8_t>(body[q]);
+			std::uint16_t len = 0;
+			std::memcpy(&len, body + q + 1, sizeof(len));
+			q += 3;
+			if (body_len - q < len || !execute(op, body + q, len, conn.out))
+				return false;
+			q += len;
+		}
+		
+		response_len = static_cast<std::uint32_t>(conn.out.size() - response_pos - sizeof(response_len));
+		std::memcpy(&conn.out[response_pos], &response_len, sizeof(response_len));
+		pos += sizeof(body_len) + body_len;
+	}
+	conn.in.erase(0, pos);
+	return true;
+}
+
+bool QueryServer::execute(std::uint8_t op, const char* arg, std::size_t len, std::string& out) {
+	switch (op) {
+	case OP_COUNT: {
+		std::size_t i = _table.find(arg, len);
+		std::uint64_t count = (i == FrozenTable::npos) ? 0 : _table.count(i);
+		out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+		return true;
+	}
+	case OP_TOP:
+	case OP_PREFIX: {
+		std::uint32_t limit = 0;
+		if (len < sizeof(limit))
+			return false;
+		std::memcpy(&limit, arg, sizeof(limit));
+		
+		std::size_t n_pos = out.size();
+		std::uint32_t n = 0;
+		out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+		if (op == OP_TOP) {
+			for (; n < limit && n < _by_count.size(); n++) {
+				std::size_t i = _by_count[n];
+				append_word(_table.word(i), _table.word_length(i), _table.count(i), out);
+			}
+		} else {
+			const char* prefix = arg + sizeof(limit);
+			std::size_t prefix_len = len - sizeof(limit);
+			// the table is sorted, the words with prefix are adjacent
+			for (std::size_t i = _table.lower_bound(prefix, prefix_len); 
+				n < limit && i < _table.size(); i++, n++) {
+				if (_table.word_length(i) < prefix_len 
+					|| std::memcmp(_table.word(i), prefix, prefix_len) != 0)
+					break;
+				append_word(_table.word(i), _table.word_length(i), _table.count(i), out);
+			}
+		}
+		std::memcpy(&out[n_pos], &n, sizeof(n));
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+void QueryServer::append_word(const char* w, std::size_t len, std::uint64_t count, std::string& out) {
+	std::uint16_t l = static_cast<std::uint16_t>(std::min<std::size_t>(len, UINT16_MAX));
+	out.append(reinterpret_cast<const char*>(&l), sizeof(l));
+	out.append(w, l);
+	out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+}
+
+void QueryServer::close_connection(int fd) {
+	epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	::close(fd);
+	_connections.erase(fd);
+}
+
+////////////////////////////////////////////////////////////////////////
+// query load generator
+static bool write_all(int fd, const char* data, std::size_t size) {
+	while (size != 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char* data, std::size_t size) {
+	while (size != 0) {
+		ssize_t n = read(fd, data, size);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool query_roundtrip(int fd, const std::string& request, std::string& response) {
+	std::uint32_t len = static_cast<std::uint32_t>(request.size());
+	std::string frame(reinterpret_cast<const char*>(&len), sizeof(len));
+	frame += request;
+	if (!write_all(fd, frame.data(), frame.size()) 
+		|| !read_all(fd, reinterpret_cast<char*>(&len), sizeof(len)))
+		return false;
+	response.resize(len);
+	return read_all(fd, &response[0], len);
+}
+
+static void append_query(std::string& request, std::uint8_t op, const char* arg, std::size_t len) {
+	std::uint16_t arg_len = static_cast<std::uint16_t>(len);
+	request.push_back(static_cast<char>(op));
+	request.append(reinterpret_cast<const char*>(&arg_len), sizeof(arg_len));
+	request.append(arg, len);
+}
+
+static int run_query_load(const char* path, std::size_t requests_num, std::size_t batch_size) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		perror("connect()");
+		std::cerr << "couldn't connect to " << path << std::endl;
+		::close(fd);
+		return -1;
+	}
+	
+	// the words to look up are the most frequent ones,
+	// plus a few which aren't in the table
+	static const std::uint32_t VOCABULARY_SIZE = 4096;
+	std::string request, response;
+	append_query(request, QueryServer::OP_TOP, 
+		reinterpret_cast<const char*>(&VOCABULARY_SIZE), sizeof(VOCABULARY_SIZE));
+	if (!query_roundtrip(fd, request, response)) {
+		std::cerr << "couldn't get vocabulary from server\n";
+		::close(fd);
+		return -1;
+	}
+	std::vector<std::string> words;
+	std::uint32_t n = 0;
+	std::memcpy(&n, response.data(), sizeof(n));
+	for (std::size_t pos = sizeof(n), i = 0; i < n; i++) {
+		std::uint16_t len = 0;
+		std::memcpy(&len, response.data() + pos, sizeof(len));
+		words.emplace_back(response.data() + pos + sizeof(len), len);
+		pos += sizeof(len) + len + sizeof(std::uint64_t);
+	}
+	for (std::size_t i = 0; i < VOCABULARY_SIZE / 16; i++) {
+		words.push_back("~missing~" + std::to_string(i));
+	}
+	
+	std::vector<double> latencies; // microseconds per request
+	latencies.reserve(requests_num);
+	std::uint32_t rnd = 2463534242U;
+	struct timespec start, t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t r = 0; r < requests_num; r++) {
+		request.clear();
+		for (std::size_t q = 0; q < batch_size; q++) {
+			rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5; // xorshift32
+			const std::string& w = words[rnd % words.size()];
+			append_query(request, QueryServer::OP_COUNT, w.data(), w.size());
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (!query_roundtrip(fd, request, response) 
+			|| response.size() != batch_size * sizeof(std::uint64_t)) {
+			std::cerr << "request " << r << " failed\n";
+			::close(fd);
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		latencies.push_back((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+	}
+	::close(fd);
+	if (latencies.empty())
+		return 0;
+	
+	double total = (t1.tv_sec - start.tv_sec) + (t1.tv_nsec - start.tv_nsec) / 1e9;
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(p * latencies.size()))];
+	};
+	std::cout << "requests " << latencies.size() << " lookups per request " << batch_size
+		<< " lookups per second " << latencies.size() * batch_size / total << std::endl
+		<< "request latency, usec: p50 " << percentile(0.50) 
+		<< " p99 " << percentile(0.99) << " p99.9 " << percentile(0.999) 
+		<< " max " << latencies.back() << std::endl
+		<< "per lookup, usec: p50 " << percentile(0.50) / batch_size 
+		<< " p99 " << percentile(0.99) / batch_size << std::endl;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// PreAggregator implementation
+PreAggregator::PreAggregator()
+	: _slots(SLOTS_NUM), _used(0), _tokens(0), _table_ops(0)
+	{
+	}
+
+void PreAggregator::add(const std::string& w, WordCounters& counters) {
+	_tokens++;
+	std::size_t i = hash_bytes(w.data(), w.size()) & (SLOTS_NUM - 1);
+	// linear probing, the load is bounded so an empty slot is always found
+	while (_slots[i].n != 0) {
+		if (_slots[i].key == w) {
+			// the hot word stays here, its count is flushed before overflow
+			if (_slots[i].n == WordCounters::MAX_NARROW) {
+				counters.add(w, _slots[i].n);
+				_slots[i].n = 0;
+			}
+			_slots[i].n++;
+			_slots[i].hits++;
+			return;
+		}
+		i = (i + 1) & (SLOTS_NUM - 1);
+	}
+	_slots[i].key.assign(w);
+	_slots[i].n = 1;
+	_slots[i].hits = 1;
+	if (++_used == MAX_LOAD)
+		evict(counters);
+}
+
+std::size_t PreAggregator::memory_usage() const {
+	std::size_t size = _slots.capacity() * sizeof(Slot);
+	for (const Slot& slot : _slots) {
+		// not in the small string buffer
+		if (slot.key.capacity() > 15)
+			size += slot.key.capacity() + 1;
+	}
+	return size;
+}
+
+void PreAggregator::evict(WordCounters& counters) {
+	std::vector<Slot> occupied;
+	occupied.reserve(_used);
+	for (Slot& slot : _slots) {
+		if (slot.n == 0)
+			continue;
+		occupied.push_back(Slot());
+		occupied.back().key.swap(slot.key);
+		occupied.back().n = slot.n;
+		occupied.back().hits = slot.hits;
+		slot.n = 0;
+	}
+	
+	std::nth_element(occupied.begin(), occupied.begin() + HOT_SLOTS_NUM, occupied.end(),
+		[](const Slot& a, const Slot& b) { return a.hits > b.hits; });
+	_used = 0;
+	for (std::size_t i = 0; i < occupied.size(); i++) {
+		if (i < HOT_SLOTS_NUM && occupied[i].hits > 1) {
+			occupied[i].hits = 0;
+			insert(occupied[i]);
+		} else {
+			counters.add(occupied[i].key, occupied[i].n);
+			_table_ops++;
+		}
+	}
+}
+
+void PreAggregator::insert(Slot& slot) {
+	std::size_t i = hash_bytes(slot.key.data(), slot.key.size()) & (SLOTS_NUM - 1);
+	while (_slots[i].n != 0)
+		i = (i + 1) & (SLOTS_NUM - 1);
+	_slots[i].key.swap(slot.key);
+	_slots[i].n = slot.n;
+	_slots[i].hits = slot.hits;
+	_used++;
+}
+
+void PreAggregator::flush(WordCounters& counters) {
+	if (_used == 0)
+		return;
+	for (Slot& slot : _slots) {
+		if (slot.n == 0)
+			continue;
+		counters.add(slot.key, slot.n);
+		_table_ops++;
+		slot.n = 0; // key keeps its capacity for reuse
+	}
+	_used = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// text normalization
+static const std::array<char, 256>& ascii_fold_table() {
+	static const std::array<char, 256> table = []() {
+		std::array<char, 256> t;
+		for (unsigned c = 0; c < t.size(); c++) {
+			bool keep = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+			t[c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : (keep ? c : ' ');
+		}
+		return t;
+	}();
+	return table;
+}
+
+// returns true if there are non-ASCII bytes
+static bool normalize_ascii(char* data, std::size_t size, bool simd) {
+	std::size_t i = 0;
+	bool non_ascii = false;
+#ifdef __SSE2__
+	if (simd) {
+		const __m128i space = _mm_set1_epi8(' '), case_bit = _mm_set1_epi8(0x20);
+		const __m128i before_a = _mm_set1_epi8('a' - 1), after_z = _mm_set1_epi8('z' + 1);
+		const __m128i before_0 = _mm_set1_epi8('0' - 1), after_9 = _mm_set1_epi8('9' + 1);
+		__m128i high = _mm_setzero_si128();
+		for (; i + 16 <= size; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			// the compares are signed, the bytes of UTF-8 sequences are negative
+			__m128i lower = _mm_or_si128(v, case_bit);
+			__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmplt_epi8(lower, after_z));
+			__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, before_0), _mm_cmplt_epi8(v, after_9));
+			__m128i utf8 = _mm_cmplt_epi8(v, _mm_setzero_si128());
+			__m128i same = _mm_or_si128(digit, utf8);
+			__m128i r = _mm_or_si128(_mm_and_si128(alpha, lower), _mm_and_si128(same, v));
+			r = _mm_or_si128(r, _mm_andnot_si128(_mm_or_si128(alpha, same), space));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), r);
+			high = _mm_or_si128(high, utf8);
+		}
+		non_ascii = _mm_movemask_epi8(high) != 0;
+	}
+#endif
+	const std::array<char, 256>& table = ascii_fold_table();
+	for (; i < size; i++) {
+		unsigned char c = static_cast<unsigned char>(data[i]);
+		non_ascii = non_ascii || c >= 0x80;
+		data[i] = table[c];
+	}
+	return non_ascii;
+}
+
+// folds uppercase letters and replaces punctuation of the common 2-byte
+// sequences, and the general punctuation block (dashes, quotes, ellipsis)
+static void normalize_utf8(char* data, std::size_t size) {
+	unsigned char* s = reinterpret_cast<unsigned char*>(data);
+	std::size_t i = 0;
+	while (i + 1 < size) {
+		unsigned char c = s[i], d = s[i + 1];
+		if (c < 0xc2 || (d & 0xc0) != 0x80) {
+			i++; // ASCII, continuation or invalid byte
+			continue;
+		}
+		if (c == 0xc2 && d >= 0xa0 && d != 0xaa && d != 0xb5 && d != 0xba) {
+			s[i] = s[i + 1] = ' '; // Latin-1 punctuation and symbols, but ordinal indicators and micro
+		} else if (c == 0xc3 && (d == 0x97 || d == 0xb7)) {
+			s[i] = s[i + 1] = ' '; // multiplication and division signs
+		} else if (c == 0xc3 && d <= 0x9e) {
+			s[i + 1] = d + 0x20; // Latin-1 letters
+		} else if (c == 0xce && d >= 0x91 && d <= 0x9f) {
+			s[i + 1] = d + 0x20; // Greek
+		} else if (c == 0xce && d >= 0xa0 && d <= 0xab && d != 0xa2) {
+			s[i] = 0xcf;
+			s[i + 1] = d - 0x20;
+		} else if (c == 0xd0 && d <= 0x8f) {
+			s[i] = 0xd1; // Cyrillic
+			s[i + 1] = d + 0x10;
+		} else if (c == 0xd0 && d <= 0x9f) {
+			s[i + 1] = d + 0x20;
+		} else if (c == 0xd0 && d <= 0xaf) {
+			s[i] = 0xd1;
+			s[i + 1] = d - 0x20;
+		} else if (c == 0xe2 && d == 0x80 && i + 2 < size && s[i + 2] >= 0x90 && s[i + 2] <= 0xa7) {
+			s[i] = s[i + 1] = s[i + 2] = ' ';
+		}
+		i += (c < 0xe0) ? 2 : (c < 0xf0) ? 3 : 4;
+	}
+}
+
+static void normalize_text(char* data, std::size_t size, bool simd) {
+	if (normalize_ascii(data, size, simd))
+		normalize_utf8(data, size);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Utf8Tokenizer implementation
+namespace {
+
+struct CodePointRange {
+	std::uint32_t first;
+	std::uint32_t last;
+};
+
+// whitespace, punctuation and symbols, apostrophes (U+0027, U+2019) are handled apart
+constexpr CodePointRange SEPARATOR_RANGES[] = {
+	{ 0x0000, 0x0026 }, { 0x0028, 0x002F }, { 0x003A, 0x0040 }, { 0x005B, 0x0060 }, { 0x007B, 0x009F },
+	{ 0x00A0, 0x00A9 }, { 0x00AB, 0x00B1 }, { 0x00B4, 0x00B4 }, { 0x00B6, 0x00B8 }, { 0x00BB, 0x00BB },
+	{ 0x00BF, 0x00BF }, { 0x00D7, 0x00D7 }, { 0x00F7, 0x00F7 },
+	{ 0x037E, 0x037E }, { 0x0387, 0x0387 }, { 0x055A, 0x055F }, { 0x0589, 0x058A },
+	{ 0x05BE, 0x05BE }, { 0x05C0, 0x05C0 }, { 0x05C3, 0x05C3 }, { 0x05C6, 0x05C6 }, { 0x05F3, 0x05F4 },
+	{ 0x060C, 0x060D }, { 0x061B, 0x061B }, { 0x061F, 0x061F }, { 0x066A, 0x066D }, { 0x06D4, 0x06D4 },
+	{ 0x0964, 0x0965 }, { 0x0970, 0x0970 }, { 0x0E4F, 0x0E4F }, { 0x0E5A, 0x0E5B },
+	{ 0x1680, 0x1680 }, { 0x2000, 0x2018 }, { 0x201A, 0x206F }, { 0x20A0, 0x20CF },
+	{ 0x2100, 0x2101 }, { 0x2103, 0x2106 }, { 0x2190, 0x23FF }, { 0x2500, 0x27BF }, { 0x27C0, 0x2BFF },
+	{ 0x2E00, 0x2E7F }, { 0x3000, 0x3004 }, { 0x3008, 0x3020 }, { 0x3030, 0x3030 }, { 0x30FB, 0x30FB },
+	{ 0xFD3E, 0xFD3F }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6B }, { 0xFEFF, 0xFEFF },
+	{ 0xFF01, 0xFF0F }, { 0xFF1A, 0xFF20 }, { 0xFF3B, 0xFF40 }, { 0xFF5B, 0xFF65 }, { 0xFFE0, 0xFFEE }
+};
+
+// two-level bitmap of separators in the BMP: each block of 256 code points
+// refers to one of the distinct bitmaps, the most of blocks share empty one
+struct SeparatorTable {
+	static const std::size_t MAX_BITMAPS = 48;
+	
+	std::uint8_t blocks[256];
+	std::uint64_t bitmaps[MAX_BITMAPS][4];
+	std::size_t bitmaps_num;
+	
+	bool contains(std::uint32_t cp) const {
+		return (bitmaps[blocks[cp >> 8]][(cp >> 6) & 3] >> (cp & 63)) & 1;
+	}
+};
+
+constexpr SeparatorTable MakeSeparatorTable() {
+	SeparatorTable t{};
+	t.bitmaps_num = 1; // empty
+	for (std::uint32_t b = 0; b < 256; b++) {
+		std::uint64_t bits[4] = { 0, 0, 0, 0 };
+		for (const CodePointRange& r : SEPARATOR_RANGES) {
+			std::uint32_t first = std::max(r.first, b << 8), last = std::min(r.last, (b << 8) | 0xff);
+			for (std::uint32_t cp = first; cp <= last; cp++) {
+				bits[(cp >> 6) & 3] |= 1ULL << (cp & 63);
+			}
+		}
+		std::size_t k = 0;
+		while (k < t.bitmaps_num && !(t.bitmaps[k][0] == bits[0] && t.bitmaps[k][1] == bits[1] 
+			&& t.bitmaps[k][2] == bits[2] && t.bitmaps[k][3] == bits[3]))
+			k++;
+		if (k == t.bitmaps_num) {
+			// out of bounds here fails the compilation
+			for (std::size_t w = 0; w < 4; w++) {
+				t.bitmaps[k][w] = bits[w];
+			}
+			t.bitmaps_num++;
+		}
+		t.blocks[b] = static_cast<std::uint8_t>(k);
+	}
+	return t;
+}
+
+constexpr SeparatorTable SEPARATOR_TABLE = MakeSeparatorTable();
+
+// validating DFA: the bytes are mapped to classes, by which the states go
+// 0 - accept (between sequences), 1 - reject, 2..8 - inside of sequence
+struct Utf8Classes {
+	std::uint8_t of[256];
+};
+
+constexpr Utf8Classes MakeUtf8Classes() {
+	Utf8Classes c{};
+	for (unsigned b = 0; b < 256; b++) {
+		c.of[b] = b < 0x80 ? 0 : b < 0x90 ? 1 : b < 0xa0 ? 2 : b < 0xc0 ? 3 : b < 0xc2 ? 11 
+			: b < 0xe0 ? 4 : b == 0xe0 ? 5 : b == 0xed ? 7 : b < 0xf0 ? 6 
+			: b == 0xf0 ? 8 : b < 0xf4 ? 9 : b == 0xf4 ? 10 : 11;
+	}
+	return c;
+}
+
+constexpr Utf8Classes UTF8_CLASSES = MakeUtf8Classes();
+
+constexpr std::uint8_t UTF8_TRANSITIONS[9][12] = {
+	//  00  80  90  A0  C2  E0  E1  ED  F0  F1  F4  bad
+	{   0,  1,  1,  1,  2,  4,  3,  5,  7,  6,  8,  1 }, // accept
+	{   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1 }, // reject
+	{   1,  0,  0,  0,  1,  1,  1,  1,  1,  1,  1,  1 }, // 1 continuation byte left
+	{   1,  2,  2,  2,  1,  1,  1,  1,  1,  1,  1,  1 }, // 2 left
+	{   1,  1,  1,  2,  1,  1,  1,  1,  1,  1,  1,  1 }, // after E0, no overlong
+	{   1,  2,  2,  1,  1,  1,  1,  1,  1,  1,  1,  1 }, // after ED, no surrogates
+	{   1,  3,  3,  3,  1,  1,  1,  1,  1,  1,  1,  1 }, // 3 left
+	{   1,  1,  3,  3,  1,  1,  1,  1,  1,  1,  1,  1 }, // after F0, no overlong
+	{   1,  3,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1 }  // after F4, up to U+10FFFF
+};
+
+// length of the apostrophe at the beginning or at the end of word, or 0
+inline std::size_t leading_apostrophe(const unsigned char* s, std::size_t size) {
+	if (size >= 1 && s[0] == '\'')
+		return 1;
+	return (size >= 3 && s[0] == 0xe2 && s[1] == 0x80 && s[2] == 0x99) ? 3 : 0;
+}
+
+inline std::size_t trailing_apostrophe(const unsigned char* s, std::size_t size) {
+	if (size >= 1 && s[size - 1] == '\'')
+		return 1;
+	return (size >= 3 && s[size - 3] == 0xe2 && s[size - 2] == 0x80 && s[size - 1] == 0x99) ? 3 : 0;
+}
+
+#ifdef __SSE2__
+// bit i is set if byte i is ASCII letter, digit or apostrophe
+inline std::uint32_t ascii_word_mask(__m128i v) {
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), 
+		_mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), 
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i apostrophe = _mm_cmpeq_epi8(v, _mm_set1_epi8('\''));
+	return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), apostrophe));
+}
+#endif
+
+} // namespace
+
+bool Utf8Tokenizer::IsSeparator(std::uint32_t cp) {
+	return cp < 0x10000 && SEPARATOR_TABLE.contains(cp);
+}
+
+std::size_t Utf8Tokenizer::SequenceLength(const unsigned char* s, std::size_t size) {
+	// well-formed sequences, as Unicode table 3-7 lists them
+	unsigned char c = s[0];
+	if (c < 0x80)
+		return 1;
+	if (c < 0xc2)
+		return 0;
+	if (c < 0xe0)
+		return (size >= 2 && (s[1] & 0xc0) == 0x80) ? 2 : 0;
+	if (c < 0xf0) {
+		unsigned char lo = (c == 0xe0) ? 0xa0 : 0x80, hi = (c == 0xed) ? 0x9f : 0xbf;
+		return (size >= 3 && s[1] >= lo && s[1] <= hi && (s[2] & 0xc0) == 0x80) ? 3 : 0;
+	}
+	if (c < 0xf5) {
+		unsigned char lo = (c == 0xf0) ? 0x90 : 0x80, hi = (c == 0xf4) ? 0x8f : 0xbf;
+		return (size >= 4 && s[1] >= lo && s[1] <= hi 
+			&& (s[2] & 0xc0) == 0x80 && (s[3] & 0xc0) == 0x80) ? 4 : 0;
+	}
+	return 0;
+}
+
+bool Utf8Tokenizer::Validate(const char* data, std::size_t size) {
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+	std::uint8_t state = 0;
+	std::size_t i = 0;
+	while (i < size) {
+		std::size_t block_end = size;
+#ifdef __SSE2__
+		// ASCII block is valid, if no sequence is continued into it
+		if (i + 16 <= size) {
+			if (state == 0 && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i))) == 0) {
+				i += 16;
+				continue;
+			}
+			block_end = i + 16;
+		}
+#endif
+		// no branches on the bytes, the state is checked once per block
+		for (; i < block_end; i++) {
+			state = UTF8_TRANSITIONS[state][UTF8_CLASSES.of[s[i]]];
+		}
+		if (state == 1)
+			return false;
+	}
+	return state == 0;
+}
+
+void Utf8Tokenizer::Split(const char* data, std::size_t size, const Visitor& visitor) {
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+	std::size_t begin = 0;
+	bool in_word = false;
+	auto emit = [s, &visitor](std::size_t b, std::size_t e) {
+		std::size_t n = 0;
+		while (b < e && (n = leading_apostrophe(s + b, e - b)) != 0)
+			b += n;
+		while (b < e && (n = trailing_apostrophe(s + b, e - b)) != 0)
+			e -= n;
+		if (b < e)
+			visitor(reinterpret_cast<const char*>(s + b), e - b);
+	};
+	
+	std::size_t i = 0;
+	while (i < size) {
+		std::size_t scalar_end = size;
+#ifdef __SSE2__
+		if (i + 16 <= size) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+			if (_mm_movemask_epi8(v) == 0) {
+				// the bits, where the byte's class differs from the previous one
+				std::uint32_t word = ascii_word_mask(v);
+				std::uint32_t edges = (word ^ ((word << 1) | (in_word ? 1 : 0))) & 0xffff;
+				while (edges != 0) {
+					std::size_t j = i + __builtin_ctz(edges);
+					edges &= edges - 1;
+					if (in_word)
+						emit(begin, j);
+					else
+						begin = j;
+					in_word = !in_word;
+				}
+				i += 16;
+				continue;
+			}
+			scalar_end = i + 16;
+		}
+#endif
+		while (i < scalar_end) {
+			std::size_t len = SequenceLength(s + i, size - i);
+			bool word = false;
+			if (len == 0) {
+				len = 1;
+			} else if (len == 1) {
+				word = s[i] == '\'' || !SEPARATOR_TABLE.contains(s[i]);
+			} else {
+				std::uint32_t cp = s[i] & (0x7f >> len);
+				for (std::size_t k = 1; k < len; k++) {
+					cp = (cp << 6) | (s[i + k] & 0x3f);
+				}
+				word = !IsSeparator(cp);
+			}
+			if (word != in_word) {
+				if (in_word)
+					emit(begin, i);
+				else
+					begin = i;
+				in_word = word;
+			}
+			i += len;
+		}
+	}
+	if (in_word)
+		emit(begin, size);
+}
+
+static int run_table_file(const char* path, const std::vector<std::string>& queries) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	FrozenTableFile table;
+	if (!table.open(path))
+		return -1;
+	double open_time = seconds_since(start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!table.verify()) {
+		std::cerr << "checksum mismatch of table file " << path << std::endl;
+		return -1;
+	}
+	double verify_time = seconds_since(start);
+	
+	// iteration over the entries, the total has to match the header
+	std::uint64_t total = 0;
+	std::size_t top = 0;
+	for (std::size_t i = 0; i < table.size(); i++) {
+		total += table.count(i);
+		if (table.count(i) > table.count(top))
+			top = i;
+	}
+	if (total != table.words_total()) {
+		std::cerr << "wrong counts in table file " << path << std::endl;
+		return -1;
+	}
+	std::cout << "table " << path 
+		<< " distinct words " << table.size()
+		<< " number of words " << table.words_total()
+		<< " perfect hash " << (table.has_perfect_hash() ? "yes" : "no")
+		<< " size " << table.file_size() << " bytes"
+		<< " open time " << open_time << " sec"
+		<< " verify time " << verify_time << " sec\n";
+	if (table.size() != 0)
+		std::cout << "  most frequent '" << table.word_str(top) << "' " << table.count(top) << std::endl;
+	
+	// lookups of all the words, as the queries of a job do
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::size_t found = 0;
+	for (std::size_t i = 0; i < table.size(); i++) {
+		found += (table.find(table.word(i), table.word_length(i)) == i);
+	}
+	double lookup_time = seconds_since(start);
+	if (found != table.size()) {
+		std::cerr << "lookups failed in table file " << path << std::endl;
+		return -1;
+	}
+	if (table.size() != 0)
+		std::cout << "  lookup time " << lookup_time * 1e9 / table.size() << " ns\n";
+	for (const std::string& q : queries) {
+		std::size_t i = table.find(q);
+		std::cout << "  '" << q << "' " << (i == FrozenTableFile::npos ? 0 : table.count(i)) << std::endl;
+	}
+	return 0;
+}
+
+static int run_text_benchmark(char* const* files, std::size_t files_num) {
+	struct timespec start;
+	std::vector<char> simd_buffer, scalar_buffer;
+	for (std::size_t f = 0; f < files_num; f++) {
+		std::uint64_t bytes = 0, non_ascii = 0, words = 0, invalid = 0;
+		double simd_time = 0, scalar_time = 0, validate_time = 0, split_time = 0;
+		double histogram_time = 0, single_histogram_time = 0;
+		ByteHistogram histogram;
+		std::uint64_t single_histogram[256] = {};
+		struct stat file_stat;
+		ChunkReader reader(files[f], 0, stat(files[f], &file_stat) == 0 ? file_stat.st_size : 0);
+		if (!reader.open()) {
+			std::cerr << "couldn't open file " << files[f] << std::endl;
+			continue;
+		}
+		auto tokenize = [&](const char* text, std::size_t size) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			invalid += !Utf8Tokenizer::Validate(text, size);
+			validate_time += seconds_since(start);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			Utf8Tokenizer::Split(text, size, [&words](const char*, std::size_t) { words++; });
+			split_time += seconds_since(start);
+		};
+		// whole lines are tokenized, the tail of chunk is kept for the next one
+		std::string lines;
+		const char* data = NULL;
+		std::size_t size = 0;
+		while (reader.next(data, size)) {
+			simd_buffer.assign(data, data + size);
+			scalar_buffer.assign(data, data + size);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			normalize_text(simd_buffer.data(), size, true);
+			simd_time += seconds_since(start);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			normalize_text(scalar_buffer.data(), size, false);
+			scalar_time += seconds_since(start);
+			if (simd_buffer != scalar_buffer) {
+				std::cerr << "normalization mismatch in " << files[f] << " at " << reader.offset() << std::endl;
+				return -1;
+			}
+			lines.append(data, size);
+			std::size_t end = lines.rfind('\n');
+			end = (end == std::string::npos) ? 0 : end + 1;
+			tokenize(lines.data(), end);
+			lines.erase(0, end);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			histogram.add(data, size);
+			histogram_time += seconds_since(start);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (std::size_t i = 0; i < size; i++) {
+				single_histogram[static_cast<unsigned char>(data[i])]++;
+			}
+			single_histogram_time += seconds_since(start);
+			bytes += size;
+		}
+		tokenize(lines.data(), lines.size());
+		if (bytes == 0)
+			continue;
+		for (std::size_t c = 0; c < 256; c++) {
+			if (histogram.count(static_cast<std::uint8_t>(c)) != single_histogram[c]) {
+				std::cerr << "byte histogram mismatch in " << files[f] << " at " << c << std::endl;
+				return -1;
+			}
+			if (c >= 0x80)
+				non_ascii += single_histogram[c];
+		}
+		std::cout << files[f] << ": " << bytes << " bytes, non-ASCII " << 100.0 * non_ascii / bytes << "%\n"
+			<< "  normalization: SIMD " << bytes / simd_time / (1 << 30) << " GB/s, scalar " 
+			<< bytes / scalar_time / (1 << 30) << " GB/s\n"
+			<< "  UTF-8 validation " << bytes / validate_time / (1 << 30) << " GB/s"
+			<< (invalid != 0 ? " (invalid)" : "") << std::endl
+			<< "  tokenization " << bytes / split_time / (1 << 30) << " GB/s, words " << words << std::endl
+			<< "  byte histogram: sub-histograms " << bytes / histogram_time / (1 << 30) 
+			<< " GB/s, single " << bytes / single_histogram_time / (1 << 30) << " GB/s\n";
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 
+static std::uint64_t hash_bytes(const char* data, std::size_t size, std::uint64_t seed) {
+	// multiply-xorshift over 8 byte words, good enough for hash tables
+	const std::uint64_t m = 0x9e3779b97f4a7c15ULL;
+	std::uint64_t h = seed ^ (size * m);
+	while (size >= 8) {
+		std::uint64_t k;
+		std::memcpy(&k, data, 8);
+		h = (h ^ k) * m;
+		h ^= h >> 29;
+		data += 8;
+		size -= 8;
+	}
+	if (size != 0) {
+		std::uint64_t k = 0;
+		std::memcpy(&k, data, size);
+		h = (h ^ k) * m;
+		h ^= h >> 29;
+	}
+	h *= m;
+	return h ^ (h >> 32);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -304,7 +7498,7 @@ TasksRegistry::~TasksRegistry() {
 std::list<const Task*> TasksRegistry::GetRunningTasks() {
 	std::list<const Task*> tasks;
 	TasksRegistry::_mutex.lock();
-	for (const std::pair<pthread_t, const Task*>& p : TasksRegistry::_tasks) {
+	for (const std::pair<const pthread_t, const Task*>& p : TasksRegistry::_tasks) {
 		if (p.second != NULL)
 			tasks.push_back(p.second);
 	}